@@ -6,7 +6,44 @@
 #include <iostream>
 #include <regex>
 #include <set>
+#include <map>
+#include <memory>
+#include <vector>
+#include <sstream>
+#include <unordered_map>
+#include <filesystem>
+#include <string_view>
+#include <chrono>
+#include <tuple>
 #include <algorithm>
+#include <csignal>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <thread>
+#include <atomic>
+#include <ctime>
+#include <fstream>
+#include <new>
+#include <cstdint>
+#include <deque>
+#include <iterator>
+#include <mutex>
+#include <functional>
+#ifdef WITH_ALPM
+#include <alpm.h>
+#include <alpm_list.h>
+#include <sys/utsname.h>
+#endif
 
 /* 
     * This program is designed to automatically resolve package conflicts for a full offline installation of BlackArch Linux.
@@ -24,21 +61,227 @@
     * 
  */
 
+// Heap allocations made by the program, reported by --bench-resolver. Counted only in a build with
+// -DFC_COUNT_ALLOCS, the replaced operator new is left out of the normal build.
+std::atomic<unsigned long> stats_allocations{0};
+
+#ifdef FC_COUNT_ALLOCS
+void* operator new(std::size_t size) {
+    stats_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* memory = malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+// Not inlined, GCC would take the free() of memory from this operator new as mismatched
+__attribute__((noinline)) void operator delete(void* memory) noexcept {
+    free(memory);
+}
+__attribute__((noinline)) void operator delete(void* memory, std::size_t) noexcept {
+    free(memory);
+}
+#endif
+
+// Package name interning. Every package name the resolver keeps gets a dense integer id the first time
+// it is seen, so its bookkeeping sets are bitsets over the ids instead of trees of strings.
+using PackageId = uint32_t;
+std::unordered_map<std::string, PackageId> package_ids; // Package name -> id
+std::deque<std::string> package_names; // Id -> package name. A deque, so names stay in place as new ones are added
+
+// Set of packages, as a bitset over their ids. It iterates the names in id order (the order they were first seen).
+class PackageSet {
+public:
+    class const_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::string;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const std::string*;
+        using reference = const std::string&;
+
+        const_iterator(const PackageSet* set, size_t id) : set(set), id(id) {}
+        reference operator*() const { return package_names[id]; }
+        pointer operator->() const { return &package_names[id]; }
+        const_iterator& operator++() { id = set->next_id(id + 1); return *this; }
+        bool operator==(const const_iterator& other) const { return id == other.id; }
+        bool operator!=(const const_iterator& other) const { return id != other.id; }
+    private:
+        const PackageSet* set;
+        size_t id;
+    };
+
+    bool insert(const std::string& packageName); // True if the package was not in the set
+    bool erase(const std::string& packageName); // True if the package was in the set
+    size_t count(const std::string& packageName) const;
+    void clear();
+    bool empty() const { return members == 0; }
+    size_t size() const { return members; }
+    const_iterator begin() const { return const_iterator(this, next_id(0)); }
+    const_iterator end() const { return const_iterator(this, words.size() * 64); }
+private:
+    size_t next_id(size_t from) const; // First id in the set from the given one, end() id if none
+    std::vector<uint64_t> words;
+    size_t members = 0;
+};
+
 // Global variables
-std::set<std::string> pkge_processed; // To keep track of processed packages. It avoids infinite loops and helps removing necessary packages in order.
-std::set<std::string> removed_pkges; // To keep track of removed packages for reinstallation later.
-std::string current_pkge_to_remove = ""; // To keep track of the current package to remove when dependencies are found.
-bool remove_pkge = false; // Flag to indicate if a package needs to be removed.
+PackageSet removed_pkges; // To keep track of removed packages for reinstallation later.
 
 // Logging tracking structures
-std::set<std::string> log_removed_reinstalled; // Packages removed and reinstalled
-std::set<std::string> log_removed_not_reinstalled; // Packages removed but not reinstalled
-std::set<std::string> log_conflicts_resolved; // Packages in conflict that were resolved
-std::set<std::string> log_requiredby_resolved; // Packages required-by that were resolved
-std::set<std::string> log_not_found_in_repos; // Packages not found in repos
-std::set<std::string> log_dependency_unsatisfy_removed; // Packages removed due to unsatisfied dependencies
+PackageSet log_removed_reinstalled; // Packages removed and reinstalled
+PackageSet log_removed_not_reinstalled; // Packages removed but not reinstalled
+PackageSet log_reinstall_failed; // Packages removed to be reinstalled, whose reinstall failed or that left the repositories
+PackageSet log_conflicts_resolved; // Packages in conflict that were resolved
+PackageSet log_requiredby_resolved; // Packages required-by that were resolved
+PackageSet log_not_found_in_repos; // Packages not found in repos
+PackageSet log_dependency_unsatisfy_removed; // Packages removed due to unsatisfied dependencies
+
+// Event log. Every logged package is appended as a JSON line with its timestamp when it happens,
+// instead of rewriting the whole log each cycle. --render-log prints the summary from it.
+std::string event_log_name; // fixConflicts_<date>-<time>_<pid>.jsonl, unique per run
+int event_log_fd = -1; // Open event log, -1 when not logging (benchmarks)
+
+// Resolution journal. Planned and committed removals, reinstalls and the issues found are appended to it
+// and synced to disk, so a run killed or stopped by a failure is continued with --resume instead of
+// rediscovering everything and losing the packages it had removed.
+std::string journal_file = "fixConflicts.journal"; // Journal path. Can be changed with --journal
+int journal_fd = -1; // Open journal, -1 when not journaling (benchmarks)
+
+// Package metadata parsed from a pacman database "desc" entry
+struct PackageDesc {
+    std::string name;
+    std::string version;
+    std::string arch;
+    std::vector<std::string> depends;
+    std::vector<std::string> provides;
+    std::vector<std::string> conflicts;
+    std::vector<std::string> replaces;
+};
+
+// Files of an installed package, absolute paths (directories are left out)
+struct PackageFiles {
+    std::string name;
+    std::vector<std::string> files;
+};
+
+// Sync database index. Built once per run from /var/lib/pacman/sync/*.db,
+// so checking if a package is still in the repositories is a lookup instead of a pacman -Si call.
+std::string pacman_dbpath = "/var/lib/pacman"; // Pacman database path. Can be changed with --dbpath
+std::unordered_map<std::string, PackageDesc> sync_pkges_index; // Package name -> metadata
+std::unordered_map<std::string, std::vector<std::string>> sync_provides_index; // Provided name -> packages providing it
+bool sync_db_loaded = false; // Flag to indicate if the sync databases were loaded and can be used
+std::string sync_db_loaded_generation; // Generation of the sync databases the index was built from
+
+// Sync database refreshes. The databases are refreshed once at startup and every other pacman run
+// goes without -y, unless --refresh-each is used.
+std::string pacman_config; // pacman.conf passed to pacman with --config (e.g. a local file:// repository)
+std::vector<std::string> pacman_cachedirs; // Package cache directories, changed with --cachedir (default: <root>/var/cache/pacman/pkg)
+
+// Archives of the removed packages. Before a package is removed, the archive of its installed version is taken from
+// the package cache or rebuilt from its files, and it is reinstalled from it with pacman -U: no download, same version.
+std::unordered_map<std::string, std::string> preserved_archives; // Removed package -> archive of the version removed
+std::string archives_dir = "fixConflicts.archives"; // Archives rebuilt from the installed files, changed with --archives-dir
+bool prefer_repo = false; // Reinstall the repository version of the packages still in the repositories (--prefer-repo)
+int stats_archives_cached = 0; // Archives found in the package cache
+int stats_archives_rebuilt = 0; // Archives rebuilt from the installed files
+int stats_archives_reinstalled = 0; // Packages reinstalled from their archive
+
+// Download prefetch. The packages the full system upgrade and the reinstall will need are downloaded in the background
+// (pacman -Sw into a cache of its own, with a database path of its own so it takes no lock of the system database)
+// while the resolver removes and analyses. The transactions search that cache too and find the archives already local.
+bool prefetch_enabled = true; // Disabled with --no-prefetch
+std::string prefetch_dir = "fixConflicts.prefetch"; // Prefetch cache and database path, changed with --prefetch-dir
+std::thread prefetch_thread; // Running the queued prefetches, joined by wait_prefetch()
+std::mutex prefetch_mutex; // Guards the queue and the statistics of the prefetch
+std::vector<std::string> prefetch_queue; // Packages waiting for the prefetch thread
+bool prefetch_active = false; // The prefetch thread is running
+std::set<std::string> prefetch_requested; // Packages already prefetched or queued
+int stats_prefetch_runs = 0; // pacman -Sw runs
+int stats_prefetch_packages = 0; // Packages prefetched
+int stats_prefetch_failed = 0; // pacman -Sw runs that failed (their packages are downloaded by the transactions)
+double stats_prefetch_seconds = 0; // Time spent prefetching in the background
+double stats_prefetch_wait_seconds = 0; // Time the transactions waited for the prefetch
+std::string pacman_root; // Installation root passed to pacman with --root, empty for /
+bool refresh_each_run = false; // Refresh the sync databases on every pacman run, as before
+int stats_sync_refreshes = 0; // pacman runs refreshing the sync databases
+
+// Local database index and reverse-dependency graph. Built from /var/lib/pacman/local/*/desc
+// so remove_package can compute the whole dependents-first removal order without pacman -Qi calls.
+std::unordered_map<std::string, PackageDesc> local_pkges_index; // Installed package name -> metadata
+std::unordered_map<std::string, std::vector<std::string>> local_provides_index; // Provided name -> installed packages providing it
+std::unordered_map<std::string, std::vector<std::string>> local_replaces_index; // Replaced name -> installed packages replacing it
+std::unordered_map<std::string, std::set<std::string>> local_requiredby_index; // Installed package -> installed packages requiring it
+std::string local_db_generation; // Generation of the local database when it was loaded
+bool local_db_loaded = false; // Flag to indicate if the local database was loaded and can be used
+
+// File ownership index. Built from the %FILES% entries of the local database as a flat table of sorted paths
+// and their owner, the same in memory and on disk: it is saved and the next runs map it while the local
+// database does not change. A file conflict is attributed to its owner with a binary search, not a pacman -Qo call.
+class FileOwnerIndex {
+public:
+    FileOwnerIndex() = default;
+    FileOwnerIndex(const FileOwnerIndex&) = delete; // Holds a mapping
+    FileOwnerIndex& operator=(const FileOwnerIndex&) = delete;
+    ~FileOwnerIndex();
+    bool build(const std::vector<PackageFiles>& pkges, const std::string& generation, const std::string& filename);
+    bool map(const std::string& filename, const std::string& generation); // Map a saved index, if it is for this generation
+    std::string_view owner(std::string_view path) const; // Package owning an installed file, empty if none
+    const std::string& generation() const { return loaded_generation; }
+    size_t size() const { return header ? header->entries : 0; }
+private:
+    struct Header {
+        char magic[8];
+        uint32_t generation_bytes;
+        uint32_t owners;
+        uint32_t entries;
+        uint32_t names_bytes;
+        uint32_t paths_bytes;
+    };
+    struct Entry {
+        uint32_t path_offset;
+        uint32_t path_bytes;
+        uint32_t owner;
+    };
+    // Layout: header, owner name offsets (owners + 1), entries sorted by path, generation, owner names, paths
+    bool attach(const char* data, size_t length, const std::string& generation);
+    void release();
+
+    std::string image; // Index built in this run
+    void* mapping = nullptr; // Index mapped from its file
+    size_t mapping_length = 0;
+    const Header* header = nullptr;
+    const uint32_t* owner_offsets = nullptr;
+    const Entry* entries = nullptr;
+    const char* names = nullptr;
+    const char* paths = nullptr;
+    std::string loaded_generation;
+};
+FileOwnerIndex files_index;
+std::string files_index_file = "fixConflicts.files"; // Saved file ownership index, changed with --files-index
+
+// File conflicts. Only the files no package owns and the ones matching a glob given with --overwrite are
+// overwritten, files owned by another package are resolved through that package.
+std::vector<std::string> overwrite_globs; // Globs passed to pacman --overwrite
+bool overwrite_all = false; // Overwrite every conflicting file (--overwrite-all), as every upgrade used to
+int stats_files_overwritten = 0; // Files no package owned, overwritten
+int stats_file_owners_resolved = 0; // Packages owning conflicting files, resolved
+
+// Read-only queries (pacman -Si/-Qi) used when the databases cannot be read. They take no lock,
+// so they run in a bounded pool of workers while transactions stay serialized.
+int query_jobs = 0; // Queries run at once (--query-jobs), 0 = one per CPU, at most 8
+
+// Transaction statistics, reported at the end of the run
+int stats_removal_transactions = 0; // pacman -R/-Rdd transactions run
+int stats_removal_transactions_per_package = 0; // Transactions the per-package removal would have run (pacman -R twice per package)
+double stats_removal_seconds = 0; // Wall time spent in removal transactions
+int stats_reinstall_transactions = 0; // Reinstall transactions run
+int stats_reinstall_bisections = 0; // Failed reinstall batches split in two to isolate the packages failing
+int stats_reinstall_failed = 0; // Packages that failed to reinstall alone
+double stats_reinstall_seconds = 0; // Wall time spent in reinstall transactions
 
 // Regex patterns
+// The resolver classifies pacman output with classify_output(). These patterns are its reference
+// implementation, used by --bench-classifier to compare both and check they find the same issues.
 /*
  * Pattern explanations:
  * 1. Conflict between two packages: "packageA and packageB are in conflict"
@@ -51,7 +294,7 @@ std::set<std::string> log_dependency_unsatisfy_removed; // Packages removed due
  */
 std::regex pattern_rgx_conflict(R"((?!.*\[y/N\])(\S+)\s+and\s+(\S+) are in conflict)");
 std::regex pattern_rgx_requiredby(R"((\S+)\s+required by\s+(\S+))");
-//std::regex pattern_rgx_conflict_files(R"((\S+):\s(\S+)\s+exists in filesystem \(owned by)");
+std::regex pattern_rgx_conflict_files(R"((\S+):\s(\S+)\s+exists in filesystem)");
 std::regex pattern_rgx_up_to_date(R"(\s*is up to date\s*-+\s*reinstalling)");
 std::regex pattern_rgx_target_not_found(R"(\s*target not found:\s+(\S+))");
 std::regex pattern_rgx_was_not_found(R"(\s+package '(\S+)' was not found)");
@@ -63,10 +306,12 @@ std::regex pattern_rgx_nothing_to_fix(R"(.*there is nothing to do.*)");
 enum class IssueType {
     CONFLICT,
     REQUIRED_BY,
-    // CONFLICT_FILES,
+    CONFLICT_FILES,
     TARGET_NOT_FOUND,
     DEPENDENCY_UNSATISFY,
     NOTHING_TO_FIX,
+    UP_TO_DATE,
+    PACKAGE_NOT_FOUND,
     UNKNOWN
 };
 
@@ -75,7 +320,7 @@ enum ProceedureStatus {
     NOTHING_TO_DO,
     CONFLICTS_RESOLVED,
     REQUIREDBY_RESOLVED,
-    // FILE_CONFLICTS_RESOLVED,
+    FILE_CONFLICTS_RESOLVED,
     TARGET_NOT_FOUND_RESOLVED,
     DEPENDENCY_UNSATISFY_RESOLVED,
     INSTALLED_PACKAGE,
@@ -85,52 +330,658 @@ enum ProceedureStatus {
     ERROR_OCCURRED 
 };
 
+// Issue found in pacman output by the classifier
+struct OutputEvent {
+    IssueType type;
+    std::string first; // Package A in conflict, dependency required, target or package not found, package installing a conflicting file
+    std::string second; // Package B in conflict, package requiring the dependency, conflicting file
+};
+
+// Last probe (pacman -Syv <package>) of a package
+struct ProbeResult {
+    std::vector<OutputEvent> events; // Issues found by the probe
+    bool empty_output = false; // pacman printed nothing
+    unsigned long generation = 0; // System generation when the probe ran
+};
+
+// Resolver state. It is kept for the whole run, so a package is never probed again
+// while nothing changed in the system since its last probe.
+PackageSet pkge_resolved; // Packages whose probe finished without issues (installed, upgraded or up to date)
+std::unordered_map<PackageId, ProbeResult> probe_cache; // Package id -> its last probe
+unsigned long system_generation = 0; // Incremented by every transaction that may change the installed packages
+int stats_pacman_runs = 0; // pacman runs made by the resolver (full upgrades and probes)
+int stats_pacman_runs_avoided = 0; // Probes skipped because the package state had not changed
+int stats_cycles = 0; // Cycles of the main loop (reinstall, then inspect and resolve)
+
+// Incremental checks. Packages touched in a cycle (removed, reinstalled, probed, in conflict) are
+// re-validated by the next cycle with a targeted pacman -S, the full system upgrade only confirms at the end.
+PackageSet dirty_pkges; // Packages touched in the current cycle
+bool incremental_checks = true; // Disabled with --full-each-cycle
+int stats_full_checks = 0; // Full system upgrade runs
+int stats_targeted_checks = 0; // Targeted runs over the dirty packages
+
+// Global solver. When the full system upgrade fails, the issues it reported and the ones the databases predict
+// it would report next are solved together: a small removal set covering all of them is removed in one
+// transaction and the upgrade runs again, instead of resolving one issue kind per pacman run.
+struct SolverIssue {
+    IssueType type; // CONFLICT, REQUIRED_BY or DEPENDENCY_UNSATISFY
+    std::string first; // Package upgraded (conflict) or dependency broken/unsatisfied, as the classifier reports them
+    std::string second; // Package in conflict with it, or package requiring the dependency
+    std::vector<std::string> candidates; // Installed packages whose removal solves the issue, any of them
+    bool predicted = false; // Found in the databases, not in the pacman output
+};
+bool global_solver = true; // Disabled with --no-solver
+bool upgrade_predicted = false; // The issues predicted before the first full system upgrade were solved
+
+// Full system upgrade predicted from the database indexes, without running pacman
+struct UpgradePrediction {
+    std::set<std::string> upgraded; // Installed packages with a newer version in the repositories
+    std::vector<std::pair<std::string, std::string>> replacements; // Installed package and repository package replacing it
+    std::vector<std::string> not_in_repos; // Installed packages in no repository (target not found if reinstalled)
+    std::vector<SolverIssue> issues; // Conflicts, broken dependents and unsatisfiable dependencies
+};
+int stats_solver_plans = 0; // Removal plans applied by the solver
+int stats_packages_removed = 0; // Packages removed by the whole run
+
+// Result of a command whose output was classified while streaming
+struct StreamResult {
+    std::vector<OutputEvent> events; // Issues found in the output
+    size_t bytes_read = 0; // Bytes of output read
+    int exit_code = 0; // Exit code of the command (-1 if it could not be run)
+    bool aborted = false; // True if the command was interrupted after a fatal issue
+    bool timed_out = false; // True if the command was killed on timeout (--timeout)
+    double classify_seconds = 0; // Time spent classifying the output
+};
+
+// Subprocess layer. Commands are argv vectors started with posix_spawn, no shell in between. stdout and stderr are
+// read with poll and large reads into an arena reused by the next command of the thread, and echoed from it.
+// A command can have a timeout (SIGTERM, then SIGKILL) and is interrupted when the run is cancelled (Ctrl+C).
+struct SpawnOptions {
+    bool echo = true; // Echo the output to the terminal as it arrives
+    bool capture = true; // Keep the whole output, else only each chunk is passed to on_output
+    bool merge_stderr = true; // stderr in the same pipe as stdout, in order (pacman splits its messages between them)
+    bool answer_yes = false; // Answer "y" to every prompt on stdin, as "yes |" did. Otherwise stdin is /dev/null.
+    int timeout_seconds = 0; // 0 for none
+    std::function<bool(std::string_view chunk)> on_output; // Called for each chunk of stdout, false interrupts the command
+};
+struct SpawnResult {
+    int exit_code = -1; // Exit code, 128 + signal if killed, -1 if it could not be started
+    bool timed_out = false;
+    bool interrupted = false; // Interrupted by on_output
+    size_t bytes_read = 0;
+    std::string_view output; // stdout (and stderr if merged), in the arena: valid until the next command of the thread
+    std::string errors; // stderr when not merged
+    double user_seconds = 0; // CPU time of the child
+    double system_seconds = 0;
+    long max_rss_kb = 0; // Peak resident memory of the child
+};
+int command_timeout = 0; // Timeout of the pacman transactions in seconds, changed with --timeout (0: none)
+int query_timeout = 300; // Timeout of the read-only commands (queries, database extraction)
+std::atomic<bool> cancel_requested{false}; // Set by SIGINT/SIGTERM, the running command is interrupted and the run stops
+std::thread::id main_thread_id = std::this_thread::get_id(); // Only the main thread stops the run on cancellation
+std::atomic<int> stats_command_timeouts{0}; // Commands killed on timeout
+std::atomic<long long> stats_child_cpu_us{0}; // CPU time of every command run
+std::atomic<long> stats_child_max_rss_kb{0}; // Peak resident memory of the largest command
+
+// Tracing. Every package manager operation, removal, reinstall and database load is recorded as a span
+// with its wall time, exit code and output size. They are exported as a Chrome trace (--trace),
+// as Prometheus textfile counters (--metrics) and summarized at the end of the run.
+struct TraceSpan {
+    std::string category; // Operation: full_upgrade, targeted_upgrade, probe, removal, reinstall, query_local...
+    std::string name; // Operation and its targets
+    double start_us = 0; // Start, from the start of the run
+    double duration_us = 0;
+    int exit_code = 0;
+    size_t bytes = 0; // Output bytes read
+    double classify_us = 0; // Time spent classifying the output
+    int depth = 0; // Worklist depth of the resolver when the span started
+    double cpu_us = 0; // CPU time of the commands run by the operation
+};
+std::vector<TraceSpan> trace_spans;
+std::chrono::steady_clock::time_point trace_epoch = std::chrono::steady_clock::now();
+int trace_worklist_depth = 0; // Depth of the worklist of the package being resolved
+std::string trace_file; // Chrome trace-event JSON written at exit (--trace)
+std::string metrics_file; // Prometheus textfile written at exit (--metrics)
+
+// Span recorded from its construction to end(), or to its destruction if end() is not called
+class TraceScope {
+public:
+    TraceScope(const std::string& category, const std::string& name);
+    ~TraceScope();
+    void end(int exit_code, size_t bytes, double classify_seconds = 0);
+private:
+    size_t span;
+    std::chrono::steady_clock::time_point start;
+    long long cpu_start_us; // CPU time of the commands run before it
+    bool ended = false;
+};
+
+// Package manager backend. Every interaction of the resolver with the package manager goes through it.
+// PacmanBackend runs pacman, ScriptedBackend replays a package universe read from a file in-process
+// (--fake-universe), so a whole run is deterministic, needs no root and takes milliseconds.
+class PackageBackend {
+public:
+    virtual ~PackageBackend() = default;
+    virtual std::string source() const = 0; // Where the packages are read from, for messages
+    virtual bool refresh() = 0; // Refresh the sync databases (pacman -Sy)
+    virtual StreamResult upgrade(const std::vector<std::string>& targets) = 0; // Full upgrade (-Suv) if no targets, else -Sv --needed <targets>
+    virtual StreamResult probe(const std::string& packageName) = 0; // -Sv <package> accepting every prompt
+    virtual std::string remove(const std::vector<std::string>& packageNames, bool nodeps, int* exit_code) = 0; // -R, or -Rdd if nodeps
+    virtual std::string install(const std::vector<std::string>& packageNames, int* exit_code) = 0; // -S --noconfirm <packages>
+    // Read-only queries. They take no lock in the package database and run concurrently (query_packages),
+    // so they must not echo their output nor change the backend state.
+    virtual std::string query_local(const std::string& packageName) = 0; // -Qi <package>
+    virtual std::string query_sync(const std::string& packageName) = 0; // -Si <package>
+    virtual std::string local_generation() = 0; // Changes whenever the installed packages change, empty if unknown
+    virtual std::string sync_generation() = 0; // Changes whenever the sync databases change
+    virtual bool read_local(std::vector<PackageDesc>* pkges) = 0; // Installed packages
+    virtual bool read_sync(std::vector<PackageDesc>* pkges, size_t* databases) = 0; // Repository packages, in repository order
+    virtual bool read_local_files(std::vector<PackageFiles>* pkges) = 0; // Files of the installed packages
+    // Archive of the installed version of a package, from the package cache or rebuilt from its files, empty if none
+    virtual std::string preserve_archive(const PackageDesc& pkge, bool* rebuilt) = 0;
+    virtual std::string install_archives(const std::vector<std::string>& archives, int* exit_code) = 0; // -U --noconfirm <archives>
+    // -Sw of repository packages into the prefetch cache. Runs in the prefetch thread while the other operations run,
+    // so it must not take the lock of the package database nor change the backend state.
+    virtual std::string prefetch(const std::vector<std::string>& packageNames, int* exit_code) = 0;
+};
+
+// Backend running pacman (through sudo for transactions) with the global options
+class PacmanBackend : public PackageBackend {
+public:
+    std::string source() const override;
+    bool refresh() override;
+    StreamResult upgrade(const std::vector<std::string>& targets) override;
+    StreamResult probe(const std::string& packageName) override;
+    std::string remove(const std::vector<std::string>& packageNames, bool nodeps, int* exit_code) override;
+    std::string install(const std::vector<std::string>& packageNames, int* exit_code) override;
+    std::string query_local(const std::string& packageName) override;
+    std::string query_sync(const std::string& packageName) override;
+    std::string local_generation() override;
+    std::string sync_generation() override;
+    bool read_local(std::vector<PackageDesc>* pkges) override;
+    bool read_sync(std::vector<PackageDesc>* pkges, size_t* databases) override;
+    bool read_local_files(std::vector<PackageFiles>* pkges) override;
+    std::string preserve_archive(const PackageDesc& pkge, bool* rebuilt) override;
+    std::string install_archives(const std::vector<std::string>& archives, int* exit_code) override;
+    std::string prefetch(const std::vector<std::string>& packageNames, int* exit_code) override;
+};
+
+// Backend replaying a scripted package universe. Each line of the file is a package:
+//   installed|repo <name> <version> [depends=a,b>=1.0] [provides=..] [conflicts=..] [replaces=..] [files=/a,/b]
+// "file <path>" is a file on disk no package owns and "cached <name> <version>" an archive in the package cache. Transactions follow pacman rules (targets not found,
+// dependencies pulled from the repos, conflicts asked as prompts, dependencies broken by an upgrade or a removal,
+// files already on disk unless overwritten) and print the messages pacman prints, which go through the same
+// classifier. Lines starting with # are comments.
+class ScriptedBackend : public PackageBackend {
+public:
+    bool load(const std::string& filename);
+    bool load_text(const std::string& content, const std::string& name);
+    std::string source() const override;
+    bool refresh() override;
+    StreamResult upgrade(const std::vector<std::string>& targets) override;
+    StreamResult probe(const std::string& packageName) override;
+    std::string remove(const std::vector<std::string>& packageNames, bool nodeps, int* exit_code) override;
+    std::string install(const std::vector<std::string>& packageNames, int* exit_code) override;
+    std::string query_local(const std::string& packageName) override;
+    std::string query_sync(const std::string& packageName) override;
+    std::string local_generation() override;
+    std::string sync_generation() override;
+    bool read_local(std::vector<PackageDesc>* pkges) override;
+    bool read_sync(std::vector<PackageDesc>* pkges, size_t* databases) override;
+    bool read_local_files(std::vector<PackageFiles>* pkges) override;
+    std::string preserve_archive(const PackageDesc& pkge, bool* rebuilt) override;
+    std::string install_archives(const std::vector<std::string>& archives, int* exit_code) override;
+    std::string prefetch(const std::vector<std::string>& packageNames, int* exit_code) override;
+
+    std::atomic<unsigned long> operations{0}; // Operations run, each one would have been a pacman process
+
+private:
+    // Output of a transaction: echoed, classified and kept as text
+    struct Output {
+        StreamResult result;
+        std::string text;
+        void emit(const std::string& line);
+    };
+    // Package held by an archive: the installed package and its files when it was preserved
+    struct Archive {
+        PackageDesc pkge;
+        std::vector<std::string> files;
+    };
+    Output transaction(const std::vector<std::string>& targets, bool sysupgrade, bool needed, bool accept_prompts,
+                       const std::vector<const Archive*>& archived = {});
+    std::string find_satisfier(const std::map<std::string, PackageDesc>& pkges,
+                               const std::unordered_map<std::string, std::set<std::string>>& provides,
+                               const std::string& depend) const;
+    void install_package(const PackageDesc& pkge, const std::vector<std::string>& files);
+    void uninstall_package(const std::string& packageName);
+
+    std::string universe_file;
+    std::map<std::string, PackageDesc> installed; // Installed packages, ordered so every run is the same
+    std::map<std::string, PackageDesc> repo; // Repository packages
+    std::unordered_map<std::string, std::set<std::string>> installed_provides; // Provided name -> installed packages providing it
+    std::unordered_map<std::string, std::set<std::string>> repo_provides; // Provided name -> repository packages providing it
+    std::unordered_map<std::string, std::set<std::string>> installed_dependents; // Depended name -> installed packages depending on it
+    std::unordered_map<std::string, std::set<std::string>> installed_conflicts; // Conflict name -> installed packages declaring it
+    std::unordered_map<std::string, std::vector<std::string>> installed_files; // Installed package -> its files
+    std::unordered_map<std::string, std::vector<std::string>> repo_files; // Repository package -> its files
+    std::unordered_map<std::string, std::string> file_owners; // File -> installed package owning it
+    std::set<std::string> orphan_files; // Files on disk no package owns
+    std::set<std::string> cached; // "<name>-<version>" of the archives in the package cache
+    std::set<std::string> corrupted; // Packages failing the integrity check, from the repositories or an archive
+    std::map<std::string, Archive> archives; // Archive path -> package it holds
+    unsigned long changes = 0; // Transactions that changed the installed packages
+};
+
+#ifdef WITH_ALPM
+// Backend running every operation in-process with libalpm (--alpm). Built with -DWITH_ALPM and linked
+// with -lalpm (libalpm 14 or newer). The local and sync databases are loaded once for the whole run,
+// there is no shell, sudo and pacman startup per call, and the issues are built from the structured
+// errors of libalpm (missing dependencies, conflicts) instead of being read back from messages.
+// Repositories and servers come from pacman.conf (--config), --root and --dbpath are honoured,
+// so it also runs against a temporary root and a local file:// repository.
+class AlpmBackend : public PackageBackend {
+public:
+    ~AlpmBackend() override;
+    bool open(); // Initialize libalpm and register the repositories of pacman.conf
+    std::string source() const override;
+    bool refresh() override;
+    StreamResult upgrade(const std::vector<std::string>& targets) override;
+    StreamResult probe(const std::string& packageName) override;
+    std::string remove(const std::vector<std::string>& packageNames, bool nodeps, int* exit_code) override;
+    std::string install(const std::vector<std::string>& packageNames, int* exit_code) override;
+    std::string query_local(const std::string& packageName) override;
+    std::string query_sync(const std::string& packageName) override;
+    std::string local_generation() override;
+    std::string sync_generation() override;
+    bool read_local(std::vector<PackageDesc>* pkges) override;
+    bool read_sync(std::vector<PackageDesc>* pkges, size_t* databases) override;
+    bool read_local_files(std::vector<PackageFiles>* pkges) override;
+    std::string preserve_archive(const PackageDesc& pkge, bool* rebuilt) override;
+    std::string install_archives(const std::vector<std::string>& archives, int* exit_code) override;
+    std::string prefetch(const std::vector<std::string>& packageNames, int* exit_code) override;
+
+private:
+    // Output of an operation: pacman-like lines echoed and kept as text, and the issues found
+    struct Report {
+        StreamResult result;
+        std::string text;
+        void emit(const std::string& line);
+        void emit(const std::string& line, const OutputEvent& event);
+    };
+    Report transaction(const std::vector<std::string>& targets, bool sysupgrade, bool needed, bool accept_prompts);
+    void commit_transaction(Report* report, const std::string& verb);
+    static void answer_question(void* ctx, alpm_question_t* question);
+    static int parse_siglevel(const std::string& value, int level);
+    static PackageDesc describe(alpm_pkg_t* pkge);
+    static std::string package_token(alpm_pkg_t* pkge);
+
+    alpm_handle_t* handle = nullptr;
+    bool accept_prompts = false; // Answer yes to conflict questions (probes, as "yes | pacman")
+    Report* current_report = nullptr; // Report of the running transaction, for the questions
+    unsigned long local_changes = 0; // Transactions committed
+    unsigned long sync_updates = 0; // Sync database updates
+    std::mutex handle_lock; // The handle is not thread safe, concurrent queries (query_packages) take turns
+};
+#endif
+
+std::unique_ptr<PackageBackend> backend; // Backend in use, chosen in main
+
+// Fleet mode (--fleet). Every target is a system of its own (an install root, a database path, a pacman.conf or a
+// scripted universe), fixed by a child process working in <fleet dir>/<target>: the resolver state of each run is
+// the state of its process, as with --bench-resolver. At most --fleet-jobs targets run at once. They share one
+// download cache (the prefetch cache, downloads serialized by a lock) and each writes its report, gathered in fleet.json.
+struct FleetTarget {
+    std::string name; // Directory of the target in the fleet directory
+    std::string root; // --root, empty for /
+    std::string dbpath; // --dbpath, <root>/var/lib/pacman by default
+    std::string config; // --config, the one of the fleet by default
+    std::string universe; // --fake-universe, empty to run pacman
+};
+std::string fleet_dir = "fixConflicts.fleet"; // Fleet directory, changed with --fleet-dir
+int fleet_jobs = 4; // Targets fixed at once, changed with --fleet-jobs
+std::string prefetch_dbpath; // Database path of pacman -Sw, empty for <prefetch dir>/db (each fleet target has its own)
+
+// Recipe cache. The resolution a run converged on (its removal transactions, the packages not reinstalled and the files
+// overwritten) is recorded under the fingerprint of the system before the run: installed and repository packages with
+// their versions. A run on a system with the same fingerprint replays it, and the main loop checks the result once.
+bool recipes_enabled = true; // Disabled with --no-recipes
+std::string recipes_file = "fixConflicts.recipes"; // Recipe cache, changed with --recipes
+std::vector<std::vector<std::string>> recipe_removals; // Removal transactions of this run, in order
+int stats_recipes_replayed = 0; // Recipes replayed
+int stats_recipe_removals = 0; // Removal transactions replayed from a recipe
+
 
 // Function declarations
 ProceedureStatus inspect_and_resolve_packages(std::string packageName); // Main function to inspect and resolve packages
-std::string popen_exec(const std::string* clicommand); // Function to execute a command and return its output
-void inspect_regex_and_resolve(std::string *depends, std::regex *pattern_rgx, IssueType isstype); // Function to inspect regex matches and resolve issues
+ProceedureStatus resolve_package(const std::string& packageName); // Function to resolve a package with the worklist engine
+const ProbeResult& probe_package(const std::string& packageName); // Function to probe a package, reusing the last probe if nothing changed
+ProceedureStatus inspect_and_resolve_dirty(); // Function to re-check only the packages touched in the last cycle
+ProceedureStatus run_and_resolve(const std::vector<std::string>& targets); // Function to run a pacman upgrade and resolve the issues it reports
+void mark_dirty(const std::string& packageName); // Function to mark a package as touched in the current cycle
+void write_all(int fd, const char* data, size_t size); // Function to write a whole buffer to a file descriptor
+void check_cancelled(); // Function to stop the run once it was cancelled (Ctrl+C)
+void exit_removal_failed(); // Function to stop the run after a failed removal transaction
+SpawnResult spawn_exec(const std::vector<std::string>& argv, const SpawnOptions& options); // Function to run a command without a shell, reading its output with poll
+std::string command_exec(const std::vector<std::string>& argv, int* exit_code = nullptr); // Function to execute a command, echoing and returning its output
+StreamResult stream_exec(const std::vector<std::string>& argv, bool abort_on_fatal, bool answer_yes = false); // Function to execute a command classifying its output as it arrives
+void inspect_events_and_resolve(const std::vector<OutputEvent>* events, IssueType isstype); // Function to resolve the issues that only need removals
 std::string remove_package(std::string packageName); // Function to remove a package and its dependents
-void write_log_file(const std::string& filename); // Function to write log file with all tracked actions
+bool open_event_log(); // Function to create the event log of this run
+void log_event(const std::string& event, const std::string& key, const std::string& value); // Function to append an event to the event log
+void log_package(PackageSet& log_set, const std::string& event, const std::string& package); // Function to log a package once in its log set and the event log
+bool render_event_log(const std::string& filename, FILE* out); // Function to render the summary of an event log
+std::string command_read(const std::vector<std::string>& argv, bool merge_stderr); // Function to execute a command and return its output without echoing it
+std::string strip_version_constraint(const std::string& depend); // Function to get the package name of a depend/provide entry
+void parse_desc_entries(const std::string& content, std::vector<PackageDesc>* pkges); // Function to parse desc entries of a pacman database
+bool load_sync_databases(); // Function to build the sync database index
+bool is_in_sync_repos(const std::string& packageName); // Function to check if a package (or a provider of it) is in the repos
+bool ensure_sync_databases(); // Function to (re)load the sync database index if the databases changed
+std::string sync_databases_generation(const std::string& dbpath); // Function to get the generation of the sync databases
+bool refresh_sync_databases(); // Function to refresh the sync databases once for the whole run
+std::vector<std::string> pacman_command(const std::vector<std::string>& arguments, bool as_root); // Function to build a pacman command with the global options
+std::string sync_operation(const std::string& flags); // Function to build a -S operation, refreshing only with --refresh-each
+bool load_local_database(); // Function to build the local database index and reverse-dependency graph
+bool ensure_local_database(); // Function to (re)load the local database if it changed on disk
+std::vector<std::string> resolve_local_depend(const std::string& depend); // Function to get the installed packages satisfying a dependency
+std::vector<std::string> removal_order(const std::vector<std::string>& packageNames); // Function to get packages and their dependents, dependents first
+std::string remove_packages(const std::vector<std::string>& packageNames); // Function to remove packages and their dependents in one planned transaction
+std::string remove_single_package(const std::string& packageName); // Function to run pacman -R for a single package
+std::vector<std::string> query_packages(const std::vector<std::string>& packageNames, bool sync); // Function to run -Si/-Qi queries concurrently, outputs in the order of the packages
+void print_transaction_report(); // Function to print how many transactions and how much time batching saved
+void classify_line(std::string_view line, std::vector<OutputEvent>* events); // Function to classify one line of pacman output
+std::vector<OutputEvent> classify_output(const std::string& output); // Function to classify the whole pacman output in a single pass
+bool has_event(const std::vector<OutputEvent>& events, IssueType isstype); // Function to check if an issue type was found
+int run_classifier_benchmark(const std::vector<std::string>& transcripts, int iterations); // Function to compare the classifier against the regex patterns
+std::string package_name_of(const std::string& token); // Function to get the package name of a "name-pkgver-pkgrel" token from pacman messages
+int compare_versions(const std::string& version_a, const std::string& version_b); // Function to compare two package versions as pacman (vercmp) does
+bool depend_satisfied_by(const std::string& depend, const PackageDesc& pkge); // Function to check if a package satisfies a dependency, by name or provides
+ProceedureStatus run_fix_loop(); // Function to run the main loop until nothing is left to do or an error occurs
+std::string generate_universe(const std::string& shape, int packages); // Function to generate a synthetic package universe for the benchmark
+int run_resolver_benchmark(const std::vector<std::string>& shapes, const std::vector<int>& sizes); // Function to benchmark the resolver on synthetic universes
+void print_trace_summary(); // Function to print the time spent per operation
+PackageId intern_package(const std::string& packageName); // Function to get the id of a package name, giving it one the first time
+bool journal_open(bool resume); // Function to open the journal, replaying an unfinished run with --resume
+void journal_replay(const std::vector<std::string>& records); // Function to restore the state of an unfinished run from its journal records
+void journal_append(const std::vector<std::string>& records); // Function to append records to the journal and sync them to disk
+bool write_trace_file(const std::string& filename); // Function to export the spans as a Chrome trace-event JSON file
+bool write_metrics_file(const std::string& filename); // Function to export the counters in the Prometheus textfile format
+void write_trace_outputs(); // Function to write the --trace and --metrics files, at exit
+UpgradePrediction predict_upgrade(); // Function to predict a full system upgrade from the database indexes, without running pacman
+int run_prediction(); // Function to print the prediction of a full system upgrade (--predict)
+std::vector<SolverIssue> collect_upgrade_issues(const std::vector<OutputEvent>& events); // Function to collect the issues of a full upgrade, reported and predicted
+std::vector<std::string> solve_removal_set(const std::vector<SolverIssue>& issues); // Function to choose a small removal set solving all the issues
+ProceedureStatus solve_upgrade_issues(const std::vector<OutputEvent>& events); // Function to solve every issue of a full upgrade in one removal transaction
+bool ensure_files_index(); // Function to build or map the file ownership index of the installed packages
+bool resolve_file_conflicts(const std::vector<OutputEvent>& events); // Function to resolve file conflicts, overwriting only files no package owns
+std::vector<std::string> overwrite_arguments(); // Function to build the --overwrite options of pacman
+bool overwrite_allowed(const std::string& path); // Function to check if a conflicting file may be overwritten
+void preserve_archives(const std::vector<std::string>& packageNames); // Function to keep the archive of the installed version of packages about to be removed
+std::string find_cached_archive(const PackageDesc& pkge); // Function to find the archive of a package version in the package cache
+std::string rebuild_archive(const PackageDesc& pkge); // Function to rebuild the archive of an installed package from its files
+bool reinstalls_from_repo(const std::string& packageName); // Function to check if a removed package is reinstalled from the repositories
+std::vector<std::string> reinstall_order(const std::vector<std::string>& packageNames); // Function to order packages to reinstall, dependencies first
+bool reinstall_batch(const std::vector<std::string>& packageNames, bool from_archives); // Function to reinstall packages in one transaction
+std::vector<std::string> reinstall_packages(const std::vector<std::string>& packageNames, bool from_archives); // Function to reinstall packages in batches, bisecting the failed ones
+std::vector<std::string> prefetch_cachedirs(); // Function to list the package caches including the prefetch cache
+std::string prefetch_with_pacman(const std::vector<std::string>& packageNames, int* exit_code); // Function to download packages with pacman -Sw into the prefetch cache
+void start_prefetch(const std::vector<std::string>& packageNames); // Function to queue packages for the background prefetch
+void prefetch_worker(); // Function to run the queued prefetches, in the prefetch thread
+void prefetch_upgrade(); // Function to prefetch the packages of the predicted full system upgrade
+void wait_prefetch(); // Function to wait for the prefetch before a transaction that downloads
+bool open_backend(bool use_alpm, const std::string& fake_universe); // Function to create the package backend chosen by the options
+int run_fix(bool resume, ProceedureStatus* status); // Function to fix the system: event log, journal, main loop and reports
+int fix_exit_code(ProceedureStatus status); // Function to get the exit code of a fix: 1 on error, 2 when removed packages are lost
+bool read_fleet_targets(const std::string& filename, std::vector<FleetTarget>* targets); // Function to read the targets of a fleet
+int run_fleet(const std::string& filename, bool use_alpm, bool resume); // Function to fix every target of a fleet, a bounded number at once
+void write_target_report(const FleetTarget& target, const std::string& status, double elapsed_seconds); // Function to write the report of a fleet target
+std::string system_fingerprint(); // Function to compute the fingerprint of the installed and repository packages
+std::vector<std::pair<std::string, std::vector<std::string>>> read_recipes(); // Function to read the recipes of the cache
+bool replay_recipe(const std::string& fingerprint); // Function to replay the recipe recorded for the same system
+bool record_recipe(const std::string& fingerprint); // Function to record the resolution of this run in the recipe cache
 
 
 // Main function
 int main(int argc, char *argv[]) {
 
-    ProceedureStatus status;
     std::string commandline_input;
-    std::string file_log_name;
+
+    // Parsing options. The remaining argument is the package name or --fix
+    std::vector<std::string> query_pkges;
+    bool query_repos = false;
+    bool query_removal = false;
+    bool predict = false;
+    bool bench_classifier = false;
+    int bench_iterations = 20;
+    bool bench_resolver = false;
+    std::vector<int> bench_sizes = {100, 1000, 10000};
+    std::string fake_universe;
+    bool resume = false;
+    std::string render_log;
+    bool use_alpm = false;
+    std::string fleet_file;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "--dbpath" && i + 1 < argc) {
+            pacman_dbpath = argv[++i];
+        } else if (arg == "--full-each-cycle") {
+            incremental_checks = false;
+        } else if (arg == "--overwrite" && i + 1 < argc) {
+            overwrite_globs.push_back(argv[++i]);
+        } else if (arg == "--overwrite-all") {
+            overwrite_all = true;
+        } else if (arg == "--files-index" && i + 1 < argc) {
+            files_index_file = argv[++i];
+        } else if (arg == "--cachedir" && i + 1 < argc) {
+            pacman_cachedirs.push_back(argv[++i]);
+        } else if (arg == "--archives-dir" && i + 1 < argc) {
+            archives_dir = argv[++i];
+        } else if (arg == "--prefer-repo") {
+            prefer_repo = true;
+        } else if (arg == "--fleet" && i + 1 < argc) {
+            fleet_file = argv[++i];
+        } else if (arg == "--fleet-jobs" && i + 1 < argc) {
+            fleet_jobs = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--fleet-dir" && i + 1 < argc) {
+            fleet_dir = argv[++i];
+        } else if (arg == "--recipes" && i + 1 < argc) {
+            recipes_file = argv[++i];
+        } else if (arg == "--no-recipes") {
+            recipes_enabled = false;
+        } else if (arg == "--no-prefetch") {
+            prefetch_enabled = false;
+        } else if (arg == "--prefetch-dir" && i + 1 < argc) {
+            prefetch_dir = argv[++i];
+        } else if (arg == "--timeout" && i + 1 < argc) {
+            command_timeout = std::max(0, atoi(argv[++i]));
+        } else if (arg == "--no-solver") {
+            global_solver = false;
+        } else if (arg == "--refresh-each") {
+            refresh_each_run = true;
+        } else if (arg == "--config" && i + 1 < argc) {
+            pacman_config = argv[++i];
+        } else if (arg == "--root" && i + 1 < argc) {
+            pacman_root = argv[++i];
+        } else if (arg == "--alpm") {
+            use_alpm = true;
+        } else if (arg == "--fake-universe" && i + 1 < argc) {
+            fake_universe = argv[++i];
+        } else if (arg == "--journal" && i + 1 < argc) {
+            journal_file = argv[++i];
+        } else if (arg == "--render-log" && i + 1 < argc) {
+            render_log = argv[++i];
+        } else if (arg == "--resume") {
+            resume = true;
+        } else if (arg == "--query-jobs" && i + 1 < argc) {
+            query_jobs = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--trace" && i + 1 < argc) {
+            trace_file = argv[++i];
+        } else if (arg == "--metrics" && i + 1 < argc) {
+            metrics_file = argv[++i];
+        } else if (arg == "--query-repos") {
+            query_repos = true;
+        } else if (arg == "--predict") {
+            predict = true;
+        } else if (arg == "--query-removal") {
+            query_removal = true;
+        } else if (arg == "--bench-classifier") {
+            bench_classifier = true;
+        } else if (arg == "--bench-iterations" && i + 1 < argc) {
+            bench_iterations = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--bench-resolver") {
+            bench_resolver = true;
+        } else if (arg == "--bench-sizes" && i + 1 < argc) {
+            std::istringstream sizes(argv[++i]);
+            std::string size;
+            bench_sizes.clear();
+            while (std::getline(sizes, size, ',')) {
+                if (atoi(size.c_str()) > 0) {
+                    bench_sizes.push_back(atoi(size.c_str()));
+                }
+            }
+        } else if (query_repos || query_removal || bench_classifier || bench_resolver) {
+            query_pkges.push_back(arg);
+        } else if (commandline_input.empty()) {
+            commandline_input = arg;
+        } else {
+            commandline_input = "--help"; // Only one package name or --fix is accepted
+        }
+    }
+
+    // Rendering the summary of an event log, without touching the system
+    if (!render_log.empty()) {
+        return render_event_log(render_log, stdout) ? 0 : EXIT_FAILURE;
+    }
 
     // Sanitizing input
-    if (argc > 2 || argc < 2 || std::string(argv[1]) == "--help" || std::string(argv[1]) == "-h") {
+    int query_modes = query_repos + query_removal + predict + bench_classifier + bench_resolver + !fleet_file.empty();
+    if ((query_modes == 0 && commandline_input.empty()) || commandline_input == "--help" || commandline_input == "-h"
+        || (query_modes > 0 && query_pkges.empty() && !bench_resolver && !predict && fleet_file.empty()) || query_modes > 1 || bench_sizes.empty()) {
         std::cerr << "\nUsage: " << argv[0] << " [optional: package_name]" << "   :   Fix conflicts for a specific package" << std::endl;
-        std::cerr << "Usage: " << argv[0] << " --fix" << "  :   Fix all conflicts automatically" << "\n\n";
+        std::cerr << "Usage: " << argv[0] << " --fix" << "  :   Fix all conflicts automatically" << "\n";
+        std::cerr << "Usage: " << argv[0] << " --query-repos <package_name>..." << "  :   Check if packages are in the sync databases" << "\n";
+        std::cerr << "Usage: " << argv[0] << " --query-removal <package_name>..." << "  :   Show the order packages and their dependents would be removed" << "\n";
+        std::cerr << "Usage: " << argv[0] << " --predict" << "  :   Predict the issues of a full system upgrade from the databases, without running pacman" << "\n";
+        std::cerr << "Usage: " << argv[0] << " --fleet <targets file>" << "  :   Fix many install roots, each in a process of its own" << "\n";
+        std::cerr << "Usage: " << argv[0] << " --render-log <file.jsonl>" << "  :   Print the summary of the event log of a run" << "\n";
+        std::cerr << "Usage: " << argv[0] << " --bench-classifier <transcript>..." << "  :   Benchmark the output classifier against the regex patterns" << "\n";
+        std::cerr << "Usage: " << argv[0] << " --bench-resolver [chain|diamond|fanout|cycle]..." << "  :   Benchmark the resolver on synthetic package universes (JSON lines)" << "\n\n";
+        std::cerr << "Options:\n";
+        std::cerr << "  --dbpath <path>   :   Pacman database path (default: /var/lib/pacman)" << "\n";
+        std::cerr << "  --config <file>   :   pacman.conf passed to pacman (e.g. a local file:// repository)" << "\n";
+        std::cerr << "  --overwrite <glob>   :   Files pacman may overwrite on a file conflict, besides the ones no package owns (repeatable)" << "\n";
+        std::cerr << "  --overwrite-all   :   Overwrite every conflicting file, owned or not (pacman --overwrite=/*)" << "\n";
+        std::cerr << "  --files-index <file>   :   Saved file ownership index (default: fixConflicts.files)" << "\n";
+        std::cerr << "  --cachedir <dir>   :   Package cache searched for the archives of the packages removed (repeatable, default: /var/cache/pacman/pkg)" << "\n";
+        std::cerr << "  --archives-dir <dir>   :   Archives rebuilt from the installed files (default: fixConflicts.archives)" << "\n";
+        std::cerr << "  --prefer-repo   :   Reinstall removed packages from the repositories when they are still there, not from their archive" << "\n";
+        std::cerr << "  --recipes <file>   :   Resolutions recorded per system fingerprint and replayed (default: fixConflicts.recipes)" << "\n";
+        std::cerr << "  --no-recipes   :   Neither replay nor record resolutions" << "\n";
+        std::cerr << "  --no-prefetch   :   Do not download the packages of the upgrade and the reinstall in the background" << "\n";
+        std::cerr << "  --prefetch-dir <dir>   :   Cache of the background downloads (default: fixConflicts.prefetch)" << "\n";
+        std::cerr << "  --timeout <seconds>   :   Kill a pacman transaction running longer (default: none, queries: 300)" << "\n";
+        std::cerr << "  --no-solver   :   Resolve the issues of the full system upgrade one kind per pacman run, without the global solver" << "\n";
+        std::cerr << "  --full-each-cycle   :   Run the full system upgrade every cycle instead of re-checking only the touched packages" << "\n";
+        std::cerr << "  --refresh-each   :   Refresh the sync databases on every pacman run instead of once at startup" << "\n";
+        std::cerr << "  --root <path>   :   Installation root passed to pacman (default: /)" << "\n";
+        std::cerr << "  --alpm   :   Run the package operations in-process with libalpm (builds with -DWITH_ALPM)" << "\n";
+        std::cerr << "  --fake-universe <file>   :   Replay a scripted package universe instead of running pacman (no root needed)" << "\n";
+        std::cerr << "  --fleet-jobs <n>   :   Targets of --fleet fixed at once (default: 4)" << "\n";
+        std::cerr << "  --fleet-dir <dir>   :   Work directories and reports of the --fleet targets (default: fixConflicts.fleet)" << "\n";
+        std::cerr << "  --journal <file>   :   Resolution journal (default: fixConflicts.journal)" << "\n";
+        std::cerr << "  --resume   :   Continue the unfinished run recorded in the journal" << "\n";
+        std::cerr << "  --query-jobs <n>   :   pacman -Si/-Qi queries run at once when the databases cannot be read (default: CPUs, at most 8)" << "\n";
+        std::cerr << "  --trace <file>   :   Write a Chrome trace-event JSON file with the timing of every operation" << "\n";
+        std::cerr << "  --metrics <file>   :   Write the run counters in the Prometheus textfile format" << "\n";
+        std::cerr << "  --bench-iterations <n>   :   Iterations per transcript for --bench-classifier (default: 20)" << "\n";
+        std::cerr << "  --bench-sizes <n,n,..>   :   Universe sizes for --bench-resolver (default: 100,1000,10000)" << "\n\n";
         return EXIT_FAILURE;
     }
 
-    // Checking if --fix flag is used, otherwise using the package name provided
-    if (std::string(argv[1]) == "--fix") {
-        commandline_input = "--fix";
-    } else {
-        commandline_input = std::string(argv[1]);
+    // Benchmarking the resolver on synthetic universes. Each scenario picks its own backend.
+    if (bench_resolver) {
+        if (query_pkges.empty()) {
+            query_pkges = {"chain", "diamond", "fanout", "cycle"};
+        }
+        return run_resolver_benchmark(query_pkges, bench_sizes);
     }
 
-    printf("\nRunning pacman to see packages in conflict...:\n\n");
+    // Fixing many targets, each one in a child process with its own backend
+    if (!fleet_file.empty()) {
+        return run_fleet(fleet_file, use_alpm, resume);
+    }
 
-    // Checking if the file log already exists to backup it
-    // It creates a new log file with an incremented number at every execution
-    for (int num_file_logs = 1; ; ++num_file_logs) {
-        file_log_name = "fixConflicts_" + std::to_string(num_file_logs) + ".log";
-        FILE *file_check = fopen(file_log_name.c_str(), "r");
-        if (!file_check) {
-            break;
+    // Choosing the package manager backend
+    if (!open_backend(use_alpm, fake_universe)) {
+        return EXIT_FAILURE;
+    }
+
+    // Checking packages against the sync databases only, without touching the system
+    if (query_repos) {
+        if (!load_sync_databases()) {
+            std::cerr << "Failed to load sync databases from: " << backend->source() << "\n";
+            return EXIT_FAILURE;
+        }
+        int not_found = 0;
+        for (const auto& pkge : query_pkges) {
+            if (is_in_sync_repos(pkge)) {
+                printf("[FOUND] >> %s\n", pkge.c_str());
+            } else {
+                printf("[NOT FOUND] >> %s\n", pkge.c_str());
+                ++not_found;
+            }
         }
-        fclose(file_check);
+        return not_found == 0 ? 0 : EXIT_FAILURE;
     }
 
-    // Main loop to inspect and resolve packages and reinstall removed packages
-    // It continues until there are no more conflicts or an error occurs
+    // Benchmarking the classifier on recorded pacman transcripts
+    if (bench_classifier) {
+        return run_classifier_benchmark(query_pkges, bench_iterations);
+    }
+
+    // Showing the dependents-first removal order from the local database, without touching the system
+    if (query_removal) {
+        if (!load_local_database()) {
+            std::cerr << "Failed to load local database from: " << backend->source() << "\n";
+            return EXIT_FAILURE;
+        }
+        for (const auto& pkge : query_pkges) {
+            std::vector<std::string> order = removal_order({pkge});
+            if (order.empty()) {
+                printf("[PACKAGE NOT INSTALLED] >> %s\n", pkge.c_str());
+                continue;
+            }
+            printf("[REMOVAL ORDER] >> %s:", pkge.c_str());
+            for (const auto& dependent : order) {
+                printf(" %s", dependent.c_str());
+            }
+            printf("\n");
+        }
+        return 0;
+    }
+
+    // Predicting the full system upgrade from the databases, without touching the system
+    if (predict) {
+        return run_prediction();
+    }
+
+    // Fixing the system: main loop to inspect and resolve packages and reinstall removed packages
+    ProceedureStatus status;
+    return run_fix(resume, &status);
+}
+
+
+// Function to run the main loop: reinstall removed packages, then inspect and resolve packages.
+// It continues until there are no more conflicts or an error occurs.
+// The log file is rewritten every cycle (skipped if no name is given, as in benchmarks).
+ProceedureStatus run_fix_loop() {
+    ProceedureStatus status;
+
     do {
+        check_cancelled();
+        ++stats_cycles;
+
         // Reinstalling removed packages. If any package was removed, it will be reinstalled here.
         // Some packages might need to be re-removed if they are still causing conflicts.
         // This is done before inspecting packages again to ensure all dependencies are met.
@@ -141,526 +992,5984 @@ int main(int argc, char *argv[]) {
             std::string get_pgkes_info;
             std::set<std::string> pkges_to_skip;
 
+            // Loading the sync databases index. It is only rebuilt if the databases were refreshed since.
+            ensure_sync_databases();
+
             // Checking if any removed package was not found in the repositories
-            // to avoid reinstalling it and causing errors
+            // to avoid reinstalling it and causing errors. Only the packages going back from the repositories
+            // are checked: the ones with an archive are reinstalled from it, repositories or not.
+            // If the sync databases could not be read, pacman -Si is used instead.
+            // The pacman -Si queries are read-only and run concurrently.
+            std::vector<std::string> repo_candidates;
             for (const auto& pkge : removed_pkges) {
-                get_pgkes_info = "pacman -Si " + pkge + " 2>&1";
-                if (std::regex_search(popen_exec(&get_pgkes_info), pattern_rgx_was_not_found)) {
+                if (reinstalls_from_repo(pkge)) {
+                    repo_candidates.push_back(pkge);
+                }
+            }
+            std::vector<std::string> sync_infos;
+            if (!sync_db_loaded) {
+                sync_infos = query_packages(repo_candidates, true);
+            }
+            size_t info_index = 0;
+            for (const auto& pkge : repo_candidates) {
+                bool not_found;
+                if (sync_db_loaded) {
+                    not_found = !is_in_sync_repos(pkge);
+                } else {
+                    not_found = has_event(classify_output(sync_infos[info_index++]), IssueType::PACKAGE_NOT_FOUND);
+                }
+                if (not_found) {
                     printf("[PACKAGE NOT FOUND] >> %s was not found in the repositories. Skipping reinstall.\n", pkge.c_str());
                     pkges_to_skip.insert(pkge);
-                    log_not_found_in_repos.insert(pkge);
+                    log_package(log_not_found_in_repos, "not_found_in_repos", pkge);
                 }
             }
 
+            std::vector<std::string> skipped_records;
             for (const auto& pkge : pkges_to_skip) {
                 removed_pkges.erase(pkge);
-                log_removed_not_reinstalled.insert(pkge);
+                log_package(log_removed_not_reinstalled, "removed_not_reinstalled", pkge);
+                log_package(log_reinstall_failed, "reinstall_failed", pkge);
+                skipped_records.push_back("not_in_repos\t" + pkge);
+                skipped_records.push_back("not_reinstalled\t" + pkge);
+                skipped_records.push_back("reinstall_failed\t" + pkge);
             }
+            journal_append(skipped_records);
 
-            std::string reinstall_cmd = "sudo pacman -Sy --noconfirm ";
+            // The packages with an archive are reinstalled from it (pacman -U, the version removed),
+            // the others from the repositories. With --prefer-repo, the repositories win when they have the package.
+            std::vector<std::string> reinstall_pkges;
+            std::vector<std::string> archive_pkges;
+            for (const auto& pkge : removed_pkges) {
+                if (reinstalls_from_repo(pkge)) {
+                    reinstall_pkges.push_back(pkge);
+                } else {
+                    archive_pkges.push_back(pkge);
+                }
+            }
+            printf("\n[REINSTALLING] >>");
             for (const auto& pkge : removed_pkges) {
-                reinstall_cmd += pkge + " ";
-                log_removed_reinstalled.insert(pkge);
+                printf(" %s", pkge.c_str());
+            }
+            printf("\n\n");
+
+            // A package failing to reinstall does not take the others down: the failed batches are bisected
+            std::vector<std::string> failed_pkges;
+            if (!archive_pkges.empty()) {
+                std::vector<std::string> archive_failed = reinstall_packages(archive_pkges, true);
+                std::set<std::string> archive_failed_set(archive_failed.begin(), archive_failed.end());
+                for (const auto& pkge : archive_pkges) {
+                    if (archive_failed_set.count(pkge) > 0) {
+                        continue;
+                    }
+                    ++stats_archives_reinstalled;
+                    // Rebuilt archives are not needed anymore, the cached ones belong to pacman
+                    std::error_code ec;
+                    std::filesystem::path archive = std::filesystem::absolute(preserved_archives[pkge], ec);
+                    if (archive.parent_path() == std::filesystem::absolute(archives_dir, ec)) {
+                        std::filesystem::remove(archive, ec);
+                    }
+                }
+                if (!archive_failed.empty()) {
+                    // The versions removed cannot go back (an upgrade they block, a dependency gone): the repositories are tried
+                    printf("\n[ARCHIVES NOT REINSTALLED] >> %zu package(s), reinstalling the ones still in the repositories instead\n\n", archive_failed.size());
+                    std::vector<std::string> not_found_records;
+                    for (const auto& pkge : archive_failed) {
+                        if (is_in_sync_repos(pkge)) {
+                            reinstall_pkges.push_back(pkge);
+                        } else {
+                            printf("[PACKAGE NOT FOUND] >> %s was not found in the repositories either.\n", pkge.c_str());
+                            log_package(log_not_found_in_repos, "not_found_in_repos", pkge);
+                            not_found_records.push_back("not_in_repos\t" + pkge);
+                            failed_pkges.push_back(pkge);
+                        }
+                    }
+                    journal_append(not_found_records);
+                }
+            }
+            if (!reinstall_pkges.empty()) {
+                wait_prefetch();
+                std::vector<std::string> repo_failed = reinstall_packages(reinstall_pkges, false);
+                failed_pkges.insert(failed_pkges.end(), repo_failed.begin(), repo_failed.end());
             }
 
-            printf("\n[REINSTALLING] >> %s\n\n", reinstall_cmd.c_str());
-            popen_exec(&reinstall_cmd);
+            std::set<std::string> failed_set(failed_pkges.begin(), failed_pkges.end());
+            std::vector<std::string> failed_records;
+            for (const auto& pkge : removed_pkges) {
+                if (failed_set.count(pkge) > 0) {
+                    printf("[NOT REINSTALLED] >> %s could not be reinstalled\n", pkge.c_str());
+                    log_package(log_removed_not_reinstalled, "removed_not_reinstalled", pkge);
+                    log_package(log_reinstall_failed, "reinstall_failed", pkge);
+                    failed_records.push_back("not_reinstalled\t" + pkge);
+                    failed_records.push_back("reinstall_failed\t" + pkge);
+                } else {
+                    log_package(log_removed_reinstalled, "removed_reinstalled", pkge);
+                }
+            }
+            journal_append(failed_records);
+            printf("\n[REINSTALL RESULT] >> %zu package(s) reinstalled, %zu not reinstalled\n",
+                   removed_pkges.size() - failed_set.size(), failed_set.size());
+            for (const auto& pkge : removed_pkges) {
+                preserved_archives.erase(pkge);
+            }
             removed_pkges.clear();
             printf("\n[REINSTALLATION DONE]\n\n");
 
         }
 
-        // Update Write log file
-        write_log_file(file_log_name.c_str());
-        
-        status = inspect_and_resolve_packages("--fix");
 
-    } while (status != NOTHING_TO_DO && status != ERROR_OCCURRED);
+        // Only the packages touched by the last cycle are re-checked. Once they are clean,
+        // the full system upgrade runs as a confirmation pass (and finds the next issues if any).
+        if (incremental_checks && !dirty_pkges.empty()) {
+            status = inspect_and_resolve_dirty();
+        } else {
+            status = inspect_and_resolve_packages("--fix");
+        }
 
-    printf("\n[FINISHED]. All conflicts and required packages processed.\n\n");
-    printf("If any package was removed, it has been reinstalled.\n");
-    printf("Execute the program again if there are still conflicts.\n\n");
-    printf("[YOU MIGHT WANT TO EXECUTE pacman -Syu --needed --overwrite=/*]\n");
-    printf("[OR pacman -Syu --needed blackarch --overwrite=/* to install all tools]\n\n");
+    } while (status != NOTHING_TO_DO && status != ERROR_OCCURRED);
 
-    return 0;
+    return status;
 }
 
 
-// Function to inspect and resolve packages based on the provided packagename
+// Function to inspect and resolve packages based on the provided packagename.
+// With --fix, a full system upgrade is run and every issue it reports is resolved.
+// Otherwise, the package is resolved with the worklist engine.
 ProceedureStatus inspect_and_resolve_packages(std::string packageName) {
 
-    // Variables 
-    std::string depends; // To store the output of the pacman command
-    std::string clicommand; // To store the command to be executed
-    std::vector<std::string> pkges; // To store packages found in the output
-    std::vector<std::string> general_or_package = {"-Syv", "-Syuv"}; // General command or package specific command
-
-    // Removing package if already processed
-    if (packageName == "--fix") {
-        pkge_processed.clear();
-
-    } else if (pkge_processed.count(packageName) > 0) {
-        printf("\n[PKGE(S) REQUIRE(S) TO BE REMOVED] >> %s\nPrevious PKGES might need to be removed first.\n", packageName.c_str());
+    if (packageName != "--fix") {
+        return resolve_package(packageName);
+    }
 
-        current_pkge_to_remove = packageName; // Setting current package to remove
+    printf("\n[RESOLVING ALL CONFLICTS AUTOMATICALLY]\n\n");
 
-        remove_pkge = true;
+    dirty_pkges.clear();
 
-        return PKGES_REQUIRED_TO_REMOVE;
+    // The packages of the upgrade are downloaded while the predicted issues are solved
+    prefetch_upgrade();
 
-    } else {
-        // Marking package as processed to avoid infinite loops and removing them later if needed
-        pkge_processed.insert(packageName); 
+    // Before the first full system upgrade, the issues predicted from the databases are solved,
+    // so no pacman run is spent discovering them
+    if (global_solver && !upgrade_predicted) {
+        upgrade_predicted = true;
+        ProceedureStatus solved = solve_upgrade_issues({});
+        if (solved != CONTINUE_PROCESSING) {
+            return solved;
+        }
     }
 
-    // Putting together the string command line
-    if (packageName.find("--fix") != std::string::npos) {
-        printf("\n[RESOLVING ALL CONFLICTS AUTOMATICALLY]\n\n");
-        clicommand = "sudo pacman ";
-        clicommand += general_or_package[1]; // "Syuv"
-        clicommand += " ";
-        clicommand += "--needed --noconfirm --overwrite=/*"; // To overwrite all files causing conflicts
+    ++stats_full_checks;
+    return run_and_resolve({});
+}
 
-    } else {
-        printf("\n[RESOLVING FOR] >> %s\n\n", packageName.c_str());
-        clicommand = "yes | sudo pacman ";
-        clicommand += general_or_package[0]; // "Syv"
-        clicommand += " ";
-        clicommand += packageName;
-        clicommand += " 2>&1";
-    }
-    
-    depends = popen_exec(&clicommand);
 
-    // Analyzing the output for conflicts or issues
-	if (!depends.empty()){
-
-        // Checking for different issues using regex patterns
-        // Conflict between packages
-        if (std::regex_search(depends, pattern_rgx_conflict)) {
-            inspect_regex_and_resolve(&depends, &pattern_rgx_conflict, IssueType::CONFLICT);
-            pkge_processed.clear();
-            return CONFLICTS_RESOLVED;
-
-        } 
-        // Package required by another
-        else if (std::regex_search(depends, pattern_rgx_requiredby) && !std::regex_search(depends, pattern_rgx_unable_to_satisfy_depen)) {
-            inspect_regex_and_resolve(&depends, &pattern_rgx_requiredby, IssueType::REQUIRED_BY);
-            if (remove_pkge) {
-                return CONTINUE_PROCESSING;
-            }
-            pkge_processed.clear();
-            return REQUIREDBY_RESOLVED;
-
-        } 
-        /* // File conflicts
-        else if (std::regex_search(depends, pattern_rgx_conflict_files)) {
-            inspect_regex_and_resolve(&depends, &pattern_rgx_conflict_files, IssueType::CONFLICT_FILES);
-            pkge_processed.clear();
-            return FILE_CONFLICTS_RESOLVED;
-
-        }  */
-        // Target not found. They might need to be removed.
-        else if (std::regex_search(depends, pattern_rgx_target_not_found)) {
-            inspect_regex_and_resolve(&depends, &pattern_rgx_target_not_found, IssueType::TARGET_NOT_FOUND);
-            return TARGET_NOT_FOUND_RESOLVED;
-
-        } 
-        // Unable to satisfy dependency
-        else if (std::regex_search(depends, pattern_rgx_unable_to_satisfy_depen)) {
-            inspect_regex_and_resolve(&depends, &pattern_rgx_unable_to_satisfy_depen, IssueType::DEPENDENCY_UNSATISFY);
-            pkge_processed.clear();
-            return REQUIREDBY_RESOLVED;
-
-        }
-        // Nothing to fix
-        else if (std::regex_search(depends, pattern_rgx_nothing_to_fix)) {
-            inspect_regex_and_resolve(&depends, &pattern_rgx_nothing_to_fix, IssueType::NOTHING_TO_FIX);
-            pkge_processed.clear();
-            return NOTHING_TO_DO;
-
-        } 
-        // Package is already installed and up to date
-        else if (std::regex_search(depends, pattern_rgx_up_to_date)) {
-            printf("\n[UP TO DATE] >> %s is already installed and up to date.\n", packageName.c_str());
-            pkge_processed.clear();
-            return INSTALLED_PACKAGE;
-
-        }
-    }
-    else {
-        printf("[EMPTY OUTPUT].\n");
-    }   
-    
-    // Final done message. If reached here, means no issues were found.
-    printf("\n[DONE]\n\n");
-    pkge_processed.clear();
-    return DONE;
-}
+// Function to re-check only the packages touched in the last cycle, with a targeted pacman -S.
+// Only packages installed and still in the repositories are checked, a foreign package would be
+// reported as target not found and removed. When they are clean, CONTINUE_PROCESSING makes the
+// main loop run the full system upgrade as a confirmation pass.
+ProceedureStatus inspect_and_resolve_dirty() {
+    std::vector<std::string> targets;
 
+    ensure_sync_databases();
+    bool installed_known = ensure_local_database();
 
-// Function to execute a command and return its output as a string
-std::string popen_exec(const std::string* clicommand) {
-    // Executing the string command line
-    // std::cout << "\n[COMMAND]: " << clicommand.c_str() << "\n";
-    FILE *listPkgsLookUp = popen(clicommand->c_str(), "r");
-    if (!listPkgsLookUp) {
-        std::cerr << "Failed to run command\n";
-        return "";
+    for (const auto& pkge : dirty_pkges) {
+        if (sync_db_loaded && !is_in_sync_repos(pkge)) {
+            continue;
+        }
+        if (installed_known ? local_pkges_index.count(pkge) == 0
+                            : log_not_found_in_repos.count(pkge) > 0 || log_dependency_unsatisfy_removed.count(pkge) > 0) {
+            continue;
+        }
+        targets.push_back(pkge);
     }
+    dirty_pkges.clear();
 
-    // Moving the CLI output to a string to be easly managed
-    // This while loop needs to be executed before closing the pipe with pclose
-    // otherwise no output is captured
-    char data[1024];
-    std::string output_cli;
-    while(fgets(data, sizeof(data), listPkgsLookUp) != nullptr) {
-        printf("%s", data);
-        output_cli += (std::string)data;
+    // Without the sync databases there is no safe way to choose the targets
+    if (!sync_db_loaded || targets.empty()) {
+        return CONTINUE_PROCESSING;
     }
 
-    // Capture exit status. Capture exit code 2 ignoring code 1
-    int output_status = pclose(listPkgsLookUp);
-    if (output_status == -1) {
-        std::cerr << "pclose faild\n";
-        return "";
-    }
+    printf("\n[RE-CHECKING TOUCHED PACKAGES] >> %zu package(s)\n\n", targets.size());
 
-    // Getting exit code from status
-    int output_exit_code = WEXITSTATUS(output_status);
-    if (output_exit_code != 0) {
-        // std::cerr << "Command faild with exit code: " << output_exit_code << std::endl;
-        if (output_exit_code == 2) {
-            std::cerr <<"pacman error: Pakage not found or similar.\n";
-        }
-        // printf("Exit code: %d\n\n", output_exit_code);
+    ++stats_targeted_checks;
+    ProceedureStatus status = run_and_resolve(targets);
+    if (status == NOTHING_TO_DO || status == INSTALLED_PACKAGE || status == DONE) {
+        printf("\n[TOUCHED PACKAGES CLEAN] >> Running the full system upgrade to confirm.\n");
+        return CONTINUE_PROCESSING;
     }
-    return output_cli;
+    return status;
 }
 
 
-// Function to inspect regex matches and resolve issues based on issue type
-void inspect_regex_and_resolve(std::string *depends, std::regex *pattern_rgx, IssueType isstype) {
-
-    std::string remove_pkge_output; // To store output of remove package function
-    ProceedureStatus proceedure_status; // To store status of the proceedure
-    ProceedureStatus status;
-    std::sregex_iterator findingMatches(depends->begin(), depends->end(), *pattern_rgx); // Iterator to find regex matches
-    std::sregex_iterator end; // End iterator
-
-    // Looping through all matches found.
-    // Each match is handled based on the issue type.
-    // As conflicts might have multiple required by packages, all matches are processed via this loop.
-    while (findingMatches != end){
-        switch (isstype) {
-
-            // Conflict between packages
-            case IssueType::CONFLICT:
-                printf("\n[CONFLICT BETWEEN] >> %s and %s\n", findingMatches->str(1).c_str(), findingMatches->str(2).c_str());
-                
-                // This loop continues until the conflict is resolved or a package is installed or target not found is resolved
-                do {
-                    status = inspect_and_resolve_packages(findingMatches->str(1));
-                    
-                } while ((status != DONE) && (status != INSTALLED_PACKAGE) && (status != TARGET_NOT_FOUND_RESOLVED));
-
-                log_conflicts_resolved.insert(findingMatches->str(1));
-                log_conflicts_resolved.insert(findingMatches->str(2));
-                
-                break;
-
-            // Package required by another
-            case IssueType::REQUIRED_BY:
-                printf("\n[REQUIRED BY] >> %s required by %s\n\n", findingMatches->str(1).c_str(), findingMatches->str(2).c_str());
-                
-                // Trying to resolve the required by issue.
-                // It attempts to inspect and resolve the required package by updating, removing, or reinstalling it.
-                // The loop means: first attempt to resolve the required package normally.
-                // if there is a problem, it will solve it in the recursion before coming back and check if it is resolved.
-                for (int attempt = 0; attempt < 2; ++attempt) {
-
-                    //
-                    if (removed_pkges.count(findingMatches->str(2)) == 0) {
-                        status = inspect_and_resolve_packages(findingMatches->str(2));
-
-                        if (status == DONE || status == TARGET_NOT_FOUND_RESOLVED) {
-                            break;
-                        }
-                        
-                        // This status indicates that the package has already processed and needs to be removed.
-                        // And because of that, we return in the recursion to handle previous packages first
-                        // before reaching this one again.
-                        // When a package is already processed, it means that it has been inspected and needs to be removed
-                        // before ending in a infinite loop. However, the removed packages are stored in a set and reinstalled later.
-                        // This way, we ensure that all dependencies are met and conflicts are resolved in the correct order.
-                        // After the main package that generated the conflicts is resolved, all removed packages are reinstalled.
-                        if (status == PKGES_REQUIRED_TO_REMOVE) {
-                            return;
-                        }
-                        // When a packages is already processed, it is marked for removal and previous packages are handled first.
-                        // This make the remove_pkge flag to be set to true.
-                        // So, with remove_pkge being true and making sure that the package exists in the pkge_processed set,
-                        // we proceed to remove the package.
-                        if (remove_pkge && (pkge_processed.count(findingMatches->str(2)) > 0)) {
-
-                            remove_pkge_output = remove_package(findingMatches->str(2));
-
-                            if (remove_pkge_output == "OK") {
-                                status = DONE;
-                                pkge_processed.erase(findingMatches->str(2));
-
-                            } else if (remove_pkge_output == "ERROR") {
-                                printf("\n[FAILED REMOVING PACKAGE] >> %s\n", current_pkge_to_remove.c_str());
-                                exit(EXIT_FAILURE);
-                            }
-
-                            // Here, the first processed package that triggers the removal is handled
-                            // and the flag is reset to false to avoid removing other packages unintentionally.
-                            // This allows the main package to that generated the conflicts to be resolved,
-                            // and then the removed packages are reinstalled later without any issues.
-                            if (findingMatches->str(2) == current_pkge_to_remove) {
-                                remove_pkge = false;
-                                current_pkge_to_remove = "";
-                            }
-                        }
+// Function to run a pacman upgrade (full without targets, or targeted) and resolve the issues it reports
+ProceedureStatus run_and_resolve(const std::vector<std::string>& targets) {
 
-                    } else {
-                        status = DONE;
-                        break;
-                    }
-                } 
-                switch (status) {
-                    case DONE:
-                        printf("\n[REQUIRED BY RESOLVED] >> %s required by %s has been resolved.\n", findingMatches->str(1).c_str(), findingMatches->str(2).c_str());
-                        break;
+    // The output is classified while pacman runs. Once a conflict or an unsatisfiable dependency
+    // is reported, pacman is interrupted and the issues are resolved right away.
+    TraceScope trace(targets.empty() ? "full_upgrade" : "targeted_upgrade",
+                     targets.empty() ? "-Suv" : "-Sv --needed " + std::to_string(targets.size()) + " package(s)");
+    wait_prefetch();
+    StreamResult depends = backend->upgrade(targets);
+    trace.end(depends.exit_code, depends.bytes_read, depends.classify_seconds);
+    ++stats_pacman_runs;
+    if (depends.exit_code == 0) {
+        ++system_generation;
+    }
 
-                    case INSTALLED_PACKAGE:
-                        printf("\n[INSTALLED PACKAGE] >> %s is already installed.\n", findingMatches->str(2).c_str());
-                        break;
+    // A pacman that could not run or was killed on timeout has not upgraded anything, whatever its output
+    if (depends.exit_code == -1 || depends.timed_out || (depends.bytes_read == 0 && depends.exit_code != 0)) {
+        printf("\n[PACMAN FAILED] >> %s\n\n", depends.timed_out ? "Killed on timeout (--timeout), nothing was upgraded."
+                                                : "It could not be run or failed without any output.");
+        return ERROR_OCCURRED;
+    }
 
-                    case TARGET_NOT_FOUND_RESOLVED:
-                        printf("\n[TARGET NOT FOUND RESOLVED] >> %s was not found and has been handled.\n", findingMatches->str(2).c_str());
-                        break;
+    // Analyzing the output for conflicts or issues
+    if (depends.bytes_read == 0) {
+        printf("[EMPTY OUTPUT].\n");
+        printf("\n[DONE]\n\n");
+        return DONE;
+    }
 
-                    default:
-                        break;
-                }
+    // The output was classified once while streaming. Every check below is a lookup over the issues found.
+    const std::vector<OutputEvent>& events = depends.events;
 
-                log_requiredby_resolved.insert(findingMatches->str(1));
-                log_requiredby_resolved.insert(findingMatches->str(2));
+    // Full system upgrade failing on conflicts or dependencies: all the issues are solved at once.
+    // Whatever the solver cannot plan is resolved below, one issue kind at a time.
+    if (global_solver && targets.empty() && (has_event(events, IssueType::CONFLICT) || has_event(events, IssueType::REQUIRED_BY)
+                                             || has_event(events, IssueType::DEPENDENCY_UNSATISFY))) {
+        ProceedureStatus solved = solve_upgrade_issues(events);
+        if (solved != CONTINUE_PROCESSING) {
+            return solved;
+        }
+    }
 
-                break;
-            
-            // Dependency unable to be satisfied because not found in repositories
-            // It will be removed
-            case IssueType::DEPENDENCY_UNSATISFY:
-                printf("\n[DEPENDENCY UNSATISFIED] >> %s required by %s\n\n", findingMatches->str(1).c_str(), findingMatches->str(2).c_str());
-                printf("[REMOVING PACKAGE] >> %s to resolve the unsatisfied dependency.\n", findingMatches->str(2).c_str());
-                
-                // Trying to remove the package that has the unsatisfied dependency
-                remove_pkge_output = remove_package(findingMatches->str(2));
-                if (remove_pkge_output == "OK") {
-                    printf("\n[DEPENDENCY UNSATISFY RESOLVED] >> %s has been removed to resolve the unsatisfied dependency.\n", findingMatches->str(2).c_str());
-                    removed_pkges.erase(findingMatches->str(2)); // Removing from removed packages set to avoid reinstalling it later
-                    log_dependency_unsatisfy_removed.insert(findingMatches->str(2));
-
-                } else if (remove_pkge_output == "ERROR") {
-                    printf("\n[FAILED REMOVING PACKAGE] >> %s\n", findingMatches->str(2).c_str());
-                    exit(EXIT_FAILURE);
+    // Conflict between packages. Each package in conflict is resolved by the worklist engine.
+    if (has_event(events, IssueType::CONFLICT)) {
+        for (const auto& event : events) {
+            if (event.type == IssueType::CONFLICT) {
+                std::string pkge_a = package_name_of(event.first);
+                std::string pkge_b = package_name_of(event.second);
+                printf("\n[CONFLICT BETWEEN] >> %s and %s\n", pkge_a.c_str(), pkge_b.c_str());
+                journal_append({"conflict\t" + pkge_a + "\t" + pkge_b});
+                mark_dirty(pkge_a);
+                mark_dirty(pkge_b);
+                resolve_package(pkge_a);
+                log_package(log_conflicts_resolved, "conflict_resolved", pkge_a);
+                log_package(log_conflicts_resolved, "conflict_resolved", pkge_b);
+            }
+        }
+        return CONFLICTS_RESOLVED;
+    }
+    // Package required by another. Packages requiring it are resolved by the worklist engine,
+    // unless they were already removed (they are reinstalled later).
+    // A package already resolved (up to date) that still requires the old version blocks the upgrade:
+    // it is removed, and the package it blocks is upgraded before it is reinstalled.
+    if (has_event(events, IssueType::REQUIRED_BY) && !has_event(events, IssueType::DEPENDENCY_UNSATISFY)) {
+        std::vector<std::string> blocking;
+        std::vector<std::string> blocked;
+        for (const auto& event : events) {
+            if (event.type == IssueType::REQUIRED_BY) {
+                printf("\n[REQUIRED BY] >> %s required by %s\n\n", event.first.c_str(), event.second.c_str());
+                journal_append({"required_by\t" + event.first + "\t" + event.second});
+                mark_dirty(event.first);
+                mark_dirty(event.second);
+                if (removed_pkges.count(event.second) > 0) {
+                    // Already removed, it is reinstalled later
+                } else if (pkge_resolved.count(event.second) > 0) {
+                    std::string required = event.first;
+                    required.erase(std::remove(required.begin(), required.end(), '\''), required.end());
+                    blocking.push_back(event.second);
+                    blocked.push_back(strip_version_constraint(required));
+                } else {
+                    resolve_package(event.second);
                 }
-                break;
+                log_package(log_requiredby_resolved, "requiredby_resolved", event.first);
+                log_package(log_requiredby_resolved, "requiredby_resolved", event.second);
+            }
+        }
+        if (!blocking.empty()) {
+            printf("\n[PKGE(S) REQUIRE(S) TO BE REMOVED] >> Up to date packages blocking the upgrade\n");
+            if (remove_packages(blocking) == "ERROR") {
+                exit_removal_failed();
+            }
+            for (const auto& pkge : blocked) {
+                resolve_package(pkge);
+            }
+        }
+        return REQUIREDBY_RESOLVED;
+    }
+    // File conflicts. Files no package owns are overwritten, owned ones are resolved through their package.
+    if (has_event(events, IssueType::CONFLICT_FILES)) {
+        if (!resolve_file_conflicts(events)) {
+            printf("\n[UNRESOLVED FILE CONFLICTS] >> Use --overwrite <glob> for files known to be safe to overwrite.\n");
+            return ERROR_OCCURRED;
+        }
+        return FILE_CONFLICTS_RESOLVED;
+    }
+    // Target not found. They might need to be removed.
+    if (has_event(events, IssueType::TARGET_NOT_FOUND)) {
+        inspect_events_and_resolve(&events, IssueType::TARGET_NOT_FOUND);
+        return TARGET_NOT_FOUND_RESOLVED;
+    }
+    // Unable to satisfy dependency
+    if (has_event(events, IssueType::DEPENDENCY_UNSATISFY)) {
+        inspect_events_and_resolve(&events, IssueType::DEPENDENCY_UNSATISFY);
+        return REQUIREDBY_RESOLVED;
+    }
+    // Nothing to fix
+    if (has_event(events, IssueType::NOTHING_TO_FIX)) {
+        printf("\n[DONE]\n");
+        return NOTHING_TO_DO;
+    }
+    // Package is already installed and up to date
+    if (has_event(events, IssueType::UP_TO_DATE)) {
+        printf("\n[UP TO DATE] >> System packages are already installed and up to date.\n");
+        return INSTALLED_PACKAGE;
+    }
 
-            /* case IssueType::CONFLICT_FILES:
-                // str(2) is the file path
-                printf("\n[CONFLICT FILES] >> %s exists in filesystem\n", findingMatches->str(2).c_str());
-                printf("[REMOVING FILE] >> %s\n", findingMatches->str(1).c_str());
+    // Final done message. If reached here, means no issues were found.
+    printf("\n[DONE]\n\n");
+    return DONE;
+}
 
-                {
-                    // Scoped using {} to avoid bypassing variable initialization error
-                    std::string removeFileCmd = "sudo rm -f " + findingMatches->str(2);
-                    popen_exec(&removeFileCmd);
-                }
 
-                break; */
+// Function to mark a package as touched in the current cycle.
+// Names from pacman messages can be quoted dependencies with a version ('glibc>=2.38').
+void mark_dirty(const std::string& packageName) {
+    std::string name = packageName;
+    name.erase(std::remove(name.begin(), name.end(), '\''), name.end());
+    name = strip_version_constraint(name);
+    if (!name.empty()) {
+        dirty_pkges.insert(name);
+    }
+}
 
-            // If target not found in repositories, remove the package
-            case IssueType::TARGET_NOT_FOUND:
-                {
-                    printf("\n[TARGET NOT FOUND] >> %s - Desinstalling...\n", findingMatches->str(1).c_str());
-                    std::string rm_output;
-                    do {
-                        rm_output = remove_package(findingMatches->str(1));
-                    } while (rm_output != "OK" && rm_output != "NOT_INSTALLED");
 
-                    log_not_found_in_repos.insert(findingMatches->str(1));
-                    
-                    break;
-                }
+// Function to probe a package with pacman -Syv <package>, reusing its last probe if nothing changed.
+// "yes" accepts pacman prompts, so conflicts pacman can solve by itself are solved here.
+const ProbeResult& probe_package(const std::string& packageName) {
+    PackageId pkge_id = intern_package(packageName);
+    auto cached = probe_cache.find(pkge_id);
+    if (cached != probe_cache.end() && cached->second.generation == system_generation) {
+        ++stats_pacman_runs_avoided;
+        printf("\n[ALREADY INSPECTED] >> %s did not change since its last inspection.\n", packageName.c_str());
+        return cached->second;
+    }
 
-            // When the full update finishes without issues
-            case IssueType::NOTHING_TO_FIX:
-                printf("\n[DONE]\n");
-                break;
+    printf("\n[RESOLVING FOR] >> %s\n\n", packageName.c_str());
+    mark_dirty(packageName);
+    TraceScope trace("probe", "-Sv " + packageName);
+    StreamResult depends = backend->probe(packageName);
+    trace.end(depends.exit_code, depends.bytes_read, depends.classify_seconds);
+    ++stats_pacman_runs;
 
-            default:
-                break;
-        }
-        ++findingMatches;
+    // A probe without issues installed or upgraded packages
+    if (depends.exit_code == 0) {
+        ++system_generation;
     }
+
+    ProbeResult& probe = probe_cache[pkge_id];
+    probe.events = std::move(depends.events);
+    probe.empty_output = depends.bytes_read == 0;
+    probe.generation = system_generation;
+    return probe;
 }
 
 
-// Function to remove a package and its dependents
-std::string remove_package(std::string packageName) {
-    std::regex pattern_rgx_removing(R"(Required By\s+:\s+(.+))"); // To capture packages that require the target package
-    std::smatch match;
-    std::string clicommand = "pacman -Qi " + packageName + " 2>&1"; // Command to get package info
-    std::vector<std::string> removed_pkges_requiredby; // To store 
-    std::string rm_pkge_output;
+// Function to resolve a package with the worklist engine.
+// The package is probed. Every package it depends on to be resolved (a package in conflict with it,
+// a package requiring an old version of it) is pushed on the worklist and resolved first, then the
+// package is probed again. When a package comes back while it is still on the worklist, the packages
+// from it to the top form a cycle that cannot be upgraded, and they are removed together
+// (they are reinstalled later). Visited and resolved packages are kept for the whole run.
+ProceedureStatus resolve_package(const std::string& packageName) {
+    const int max_attempts = 3; // Probes of a package before giving up on it
+    struct WorkItem {
+        std::string pkge;
+        int attempts;
+    };
+    std::vector<WorkItem> worklist;
+    PackageSet on_worklist;
+    ProceedureStatus status = DONE;
 
-    removed_pkges_requiredby.push_back(packageName);
+    auto pop_item = [&]() {
+        on_worklist.erase(worklist.back().pkge);
+        worklist.pop_back();
+    };
+    auto push_item = [&](const std::string& pkge) {
+        worklist.push_back({pkge, 0});
+        on_worklist.insert(pkge);
+    };
+    auto remove_or_exit = [&](const std::vector<std::string>& pkges) {
+        if (remove_packages(pkges) == "ERROR") {
+            exit_removal_failed();
+        }
+    };
 
-    printf("\n[CHECKING DEPENDENCIES FOR] >> %s\n\n", packageName.c_str());
+    push_item(packageName);
 
-    std::string required_by_output = popen_exec(&clicommand); // Getting package info
+    while (!worklist.empty()) {
+        std::string pkge = worklist.back().pkge;
 
-    // Checking if package is installed, if not, return NOT_INSTALLED
-    if (!std::regex_search(required_by_output, match, pattern_rgx_was_not_found)) {
+        if (pkge_resolved.count(pkge) > 0) {
+            ++stats_pacman_runs_avoided;
+            pop_item();
+            continue;
+        }
+        if (++worklist.back().attempts > max_attempts) {
+            printf("\n[UNRESOLVED] >> %s still has issues after %d attempts. Skipping it.\n", pkge.c_str(), max_attempts);
+            if (pkge == packageName) {
+                status = ERROR_OCCURRED;
+            }
+            pop_item();
+            continue;
+        }
 
-        // Checking for packages that require the target package being removed
-        if (std::regex_search(required_by_output, match, pattern_rgx_removing)) {
+        trace_worklist_depth = static_cast<int>(worklist.size());
+        const ProbeResult& probe = probe_package(pkge);
+        const std::vector<OutputEvent>& events = probe.events;
 
-            std::string required_by = match.str(1); // Getting the required by packages
+        // Conflict between packages. The other package is resolved first. If it cannot be
+        // (it is this package, or it is already on the worklist), the installed package in conflict is removed.
+        if (has_event(events, IssueType::CONFLICT)) {
+            bool pushed = false;
+            std::vector<std::string> conflicting;
+            for (const auto& event : events) {
+                if (event.type != IssueType::CONFLICT) {
+                    continue;
+                }
+                std::string pkge_a = package_name_of(event.first);
+                std::string pkge_b = package_name_of(event.second);
+                printf("\n[CONFLICT BETWEEN] >> %s and %s\n", pkge_a.c_str(), pkge_b.c_str());
+                journal_append({"conflict\t" + pkge_a + "\t" + pkge_b});
+                log_package(log_conflicts_resolved, "conflict_resolved", pkge_a);
+                log_package(log_conflicts_resolved, "conflict_resolved", pkge_b);
 
-            // If there are packages depending on the target package, add them to the list for removal
-            // These packages will be removed first before removing the target package
-            // although they will be reinstalled later
-            if (required_by != "None") {
-                std::istringstream iss(required_by);
-                std::string word;
-                // Splitting the required by string into individual package names
-                while (iss >> word) {
-                    removed_pkges_requiredby.push_back(word);
-                    printf("**** Marking package for removal: %s\n\n", word.c_str());
+                if (pkge_resolved.count(pkge_a) == 0 && on_worklist.count(pkge_a) == 0) {
+                    push_item(pkge_a);
+                    pushed = true;
+                } else {
+                    conflicting.push_back(pkge_b);
                 }
-            } else {
-                printf("[REMOVING] >> No packages depending on: %s\n\n", packageName.c_str());
-                std::string rm_pkge = "sudo pacman -R --noconfirm " + packageName + " 2>&1";
+            }
+            if (!pushed && !conflicting.empty()) {
+                remove_or_exit(conflicting);
+            }
+            continue;
+        }
 
-                removed_pkges.insert(packageName); // Adding package to removed packages set for reinstallation later
+        // Package required by another. Packages requiring it are resolved first.
+        if (has_event(events, IssueType::REQUIRED_BY) && !has_event(events, IssueType::DEPENDENCY_UNSATISFY)) {
+            bool pushed = false;
+            size_t cycle_from = std::string::npos; // Position of the first package found again on the worklist
+            std::vector<std::string> blocking;
+            for (const auto& event : events) {
+                if (event.type != IssueType::REQUIRED_BY) {
+                    continue;
+                }
+                printf("\n[REQUIRED BY] >> %s required by %s\n\n", event.first.c_str(), event.second.c_str());
+                journal_append({"required_by\t" + event.first + "\t" + event.second});
+                log_package(log_requiredby_resolved, "requiredby_resolved", event.first);
+                log_package(log_requiredby_resolved, "requiredby_resolved", event.second);
 
-                for (int attempt = 0; attempt < 2; ++attempt) {
-                    rm_pkge_output = popen_exec(&rm_pkge);
+                if (removed_pkges.count(event.second) > 0) {
+                    continue; // Already removed, it is reinstalled later
                 }
-                if (std::regex_search(rm_pkge_output, match, pattern_rgx_target_not_found)) {
-                    printf("\n[PACKAGE UNINSTALLED] >> %s \n\n", packageName.c_str());
-                    return "OK";
+                if (on_worklist.count(event.second) > 0) {
+                    for (size_t i = 0; i < worklist.size(); ++i) {
+                        if (worklist[i].pkge == event.second) {
+                            cycle_from = std::min(cycle_from, i);
+                        }
+                    }
+                } else if (pkge_resolved.count(event.second) == 0) {
+                    push_item(event.second);
+                    pushed = true;
                 } else {
-                    return "ERROR";
+                    blocking.push_back(event.second); // Resolved, but still requiring the old version
+                }
+            }
+
+            // The package came back while on the worklist: removing the whole cycle
+            if (cycle_from != std::string::npos) {
+                std::vector<std::string> cycle;
+                while (worklist.size() > cycle_from) {
+                    cycle.push_back(worklist.back().pkge);
+                    pop_item();
                 }
+                printf("\n[PKGE(S) REQUIRE(S) TO BE REMOVED] >> %s\nPrevious PKGES on the worklist are removed with it.\n", cycle.back().c_str());
+                remove_or_exit(cycle);
+                continue;
+            }
+            if (!pushed && !blocking.empty()) {
+                printf("\n[PKGE(S) REQUIRE(S) TO BE REMOVED] >> Up to date packages still requiring %s\n", pkge.c_str());
+                remove_or_exit(blocking);
+            }
+            continue;
+        }
+
+        // Target not found: the package is not in the repositories anymore, it is removed
+        if (has_event(events, IssueType::TARGET_NOT_FOUND)) {
+            inspect_events_and_resolve(&events, IssueType::TARGET_NOT_FOUND);
+            if (pkge == packageName) {
+                status = TARGET_NOT_FOUND_RESOLVED;
             }
+            pop_item();
+            continue;
         }
 
-        // Reversing the order of packages to remove dependents first
-        if (removed_pkges_requiredby.size() > 1) {
-            // Reverse the order to remove dependents first before the target package
-            // Using std::reverse from <algorithm>
-            std::reverse(removed_pkges_requiredby.begin(), removed_pkges_requiredby.end());
+        // Unable to satisfy dependency: the packages requiring it are removed, then the package is probed again
+        if (has_event(events, IssueType::DEPENDENCY_UNSATISFY)) {
+            inspect_events_and_resolve(&events, IssueType::DEPENDENCY_UNSATISFY);
+            continue;
         }
-        
-        // Removing packages that require the target package first
-        for (const auto& pkge : removed_pkges_requiredby) {
-            remove_package(pkge);
+
+        // Files already on disk: they are overwritten or their owner is resolved, then the package is probed again
+        if (has_event(events, IssueType::CONFLICT_FILES)) {
+            std::vector<OutputEvent> file_events = events; // The probe cache entry may change while resolving
+            if (!resolve_file_conflicts(file_events)) {
+                printf("\n[UNRESOLVED FILE CONFLICTS] >> %s\n", pkge.c_str());
+                if (pkge == packageName) {
+                    status = ERROR_OCCURRED;
+                }
+                pop_item();
+            }
+            continue;
         }
-        printf("[PACKAGE REMOVED] >> %s and its dependents were removed successfully.\n", packageName.c_str());
-        return "OK";
 
-    } else {
-        printf("[PACKAGE NOT INSTALLED] >> %s was not found in the system.\n", packageName.c_str());
-        return "NOT_INSTALLED";
+        // No issues left
+        if (has_event(events, IssueType::UP_TO_DATE)) {
+            printf("\n[UP TO DATE] >> %s is already installed and up to date.\n", pkge.c_str());
+            if (pkge == packageName) {
+                status = INSTALLED_PACKAGE;
+            }
+        } else if (probe.empty_output) {
+            printf("[EMPTY OUTPUT].\n");
+        } else {
+            printf("\n[RESOLVED] >> %s\n", pkge.c_str());
+        }
+        pkge_resolved.insert(pkge);
+        journal_append({"resolved\t" + pkge});
+        pop_item();
     }
+
+    trace_worklist_depth = 0;
+    printf("\n[DONE]\n\n");
+    return status;
 }
 
 
-// Function to write all logged actions to a file
-void write_log_file(const std::string& filename) {
-    FILE *logFile = fopen(filename.c_str(), "w");
-    if (!logFile) {
-        std::cerr << "Failed to create log file: " << filename << "\n";
-        return;
+// Function to write a whole buffer to a file descriptor (the terminal), retrying short writes
+void write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data += written;
+        size -= written;
     }
+}
 
-    fprintf(logFile, "=== Package Conflict Resolution Log ===\n");
-    fprintf(logFile, "Date: %s\n\n", __DATE__);
 
-    // Packages removed and reinstalled
-    fprintf(logFile, "[PACKAGES REMOVED AND REINSTALLED]\n");
-    if (!log_removed_reinstalled.empty()) {
-        for (const auto& pkg : log_removed_reinstalled) {
-            fprintf(logFile, "  - %s\n", pkg.c_str());
-        }
-    } else {
-        fprintf(logFile, "  (none)\n");
+// Function to stop the run once it was cancelled (Ctrl+C). The removals are already in the journal,
+// so --resume reinstalls the packages removed so far. Query workers return to the main thread, which stops.
+void check_cancelled() {
+    if (!cancel_requested || std::this_thread::get_id() != main_thread_id) {
+        return;
     }
-    fprintf(logFile, "\n");
+    wait_prefetch(); // Its pacman -Sw got SIGINT too
+    printf("\n[INTERRUPTED] >> Run cancelled. Continue it with --resume, the packages removed so far are reinstalled first.\n");
+    log_event("run_finished", "status", "cancelled");
+    exit(130);
+}
 
-    // Packages removed but not reinstalled
-    fprintf(logFile, "[PACKAGES REMOVED BUT NOT REINSTALLED]\n");
-    if (!log_removed_not_reinstalled.empty()) {
-        for (const auto& pkg : log_removed_not_reinstalled) {
-            fprintf(logFile, "  - %s\n", pkg.c_str());
-        }
-    } else {
-        fprintf(logFile, "  (none)\n");
-    }
-    fprintf(logFile, "\n");
 
-    // Packages in conflict and resolved
-    fprintf(logFile, "[PACKAGES IN CONFLICT AND RESOLVED]\n");
-    if (!log_conflicts_resolved.empty()) {
-        for (const auto& pkg : log_conflicts_resolved) {
-            fprintf(logFile, "  - %s\n", pkg.c_str());
-        }
+// Function to stop the run after a failed removal transaction. The prefetch thread is joined first:
+// a joinable std::thread destroyed at exit terminates the process.
+void exit_removal_failed() {
+    printf("\n[FAILED REMOVING PACKAGES]\n");
+    wait_prefetch();
+    exit(EXIT_FAILURE);
+}
+
+
+// Function to run a command without a shell, reading its output with poll.
+// The child gets its own process group, so sudo and pacman are signalled together. Its output is read with large
+// reads straight into an arena reused by the next command of the thread, and echoed from there.
+// On timeout the group gets SIGTERM, then SIGKILL 5 seconds later. When on_output returns false or the run is
+// cancelled, the group gets SIGINT (pacman releases its lock) and the output left is still read.
+SpawnResult spawn_exec(const std::vector<std::string>& argv, const SpawnOptions& options) {
+    SpawnResult result;
+    check_cancelled();
+    if (cancel_requested || argv.empty()) {
+        return result;
+    }
+
+    // The parent must survive a child closing its stdin early ("yes" prompts)
+    static bool sigpipe_ignored = (signal(SIGPIPE, SIG_IGN), true);
+    (void)sigpipe_ignored;
+
+    int out_fds[2] = {-1, -1};
+    int err_fds[2] = {-1, -1};
+    int in_fds[2] = {-1, -1};
+    if (pipe2(out_fds, O_CLOEXEC) == -1 || (!options.merge_stderr && pipe2(err_fds, O_CLOEXEC) == -1) ||
+        (options.answer_yes && pipe2(in_fds, O_CLOEXEC) == -1)) {
+        std::cerr << "Failed to run command\n";
+        for (int fd : {out_fds[0], out_fds[1], err_fds[0], err_fds[1], in_fds[0], in_fds[1]}) {
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+        return result;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, out_fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, options.merge_stderr ? out_fds[1] : err_fds[1], STDERR_FILENO);
+    if (options.answer_yes) {
+        posix_spawn_file_actions_adddup2(&actions, in_fds[0], STDIN_FILENO);
     } else {
-        fprintf(logFile, "  (none)\n");
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    }
+
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    sigset_t default_signals;
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGINT);
+    sigaddset(&default_signals, SIGTERM);
+    sigaddset(&default_signals, SIGPIPE);
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    posix_spawnattr_setpgroup(&attributes, 0);
+    posix_spawnattr_setsigdefault(&attributes, &default_signals);
+    posix_spawnattr_setsigmask(&attributes, &no_signals);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    std::vector<char*> arguments;
+    for (const auto& argument : argv) {
+        arguments.push_back(const_cast<char*>(argument.c_str()));
+    }
+    arguments.push_back(nullptr);
+
+    fflush(stdout);
+    pid_t pid;
+    int spawn_error = posix_spawnp(&pid, arguments[0], &actions, &attributes, arguments.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    for (int fd : {out_fds[1], err_fds[1], in_fds[0]}) {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    if (spawn_error != 0) {
+        std::cerr << "Failed to run command " << argv[0] << ": " << strerror(spawn_error) << "\n";
+        for (int fd : {out_fds[0], err_fds[0], in_fds[1]}) {
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+        return result;
+    }
+    if (in_fds[1] != -1) {
+        fcntl(in_fds[1], F_SETFL, O_NONBLOCK);
+    }
+
+    auto deadline = std::chrono::steady_clock::time_point::max();
+    if (options.timeout_seconds > 0) {
+        deadline = std::chrono::steady_clock::now() + std::chrono::seconds(options.timeout_seconds);
+    }
+    auto kill_deadline = std::chrono::steady_clock::time_point::max();
+    bool cancel_forwarded = false;
+    bool killed = false;
+
+    // Timeout and cancellation, checked at least every 250 ms
+    auto signal_group = [&]() {
+        auto now = std::chrono::steady_clock::now();
+        if (cancel_requested && !cancel_forwarded) {
+            kill(-pid, SIGINT);
+            cancel_forwarded = true;
+        }
+        if (now >= deadline && !result.timed_out) {
+            printf("\n[COMMAND TIMED OUT] >> %s did not finish within %d s, stopping it.\n", argv[0].c_str(), options.timeout_seconds);
+            fflush(stdout);
+            kill(-pid, SIGTERM);
+            result.timed_out = true;
+            kill_deadline = now + std::chrono::seconds(5);
+        }
+        if (now >= kill_deadline && !killed) {
+            kill(-pid, SIGKILL);
+            killed = true;
+        }
+    };
+
+    // Every read goes straight into the arena. Without capture, each chunk overwrites the previous one.
+    thread_local std::vector<char> arena;
+    const size_t chunk_size = 65536;
+    size_t used = 0;
+    char error_data[4096];
+    char yes_data[4096];
+    for (size_t i = 0; i < sizeof(yes_data); i += 2) {
+        yes_data[i] = 'y';
+        yes_data[i + 1] = '\n';
+    }
+
+    int out_fd = out_fds[0];
+    int err_fd = err_fds[0];
+    int in_fd = in_fds[1];
+    while (out_fd != -1 || err_fd != -1) {
+        pollfd fds[3];
+        nfds_t count = 0;
+        int out_index = -1;
+        int err_index = -1;
+        int in_index = -1;
+        if (out_fd != -1) {
+            out_index = count;
+            fds[count++] = {out_fd, POLLIN, 0};
+        }
+        if (err_fd != -1) {
+            err_index = count;
+            fds[count++] = {err_fd, POLLIN, 0};
+        }
+        if (in_fd != -1) {
+            in_index = count;
+            fds[count++] = {in_fd, POLLOUT, 0};
+        }
+        int ready = poll(fds, count, 250);
+        signal_group();
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (out_index != -1 && fds[out_index].revents != 0) {
+            if (arena.size() < used + chunk_size) {
+                arena.resize(std::max(arena.size() * 2, used + chunk_size));
+            }
+            ssize_t bytes_read = read(out_fd, arena.data() + used, arena.size() - used);
+            if (bytes_read > 0) {
+                std::string_view chunk(arena.data() + used, bytes_read);
+                if (options.echo) {
+                    write_all(STDOUT_FILENO, chunk.data(), chunk.size());
+                }
+                result.bytes_read += bytes_read;
+                if (options.on_output && !options.on_output(chunk) && !result.interrupted) {
+                    kill(-pid, SIGINT);
+                    result.interrupted = true;
+                }
+                if (options.capture) {
+                    used += bytes_read;
+                }
+            } else if (bytes_read == 0 || errno != EINTR) {
+                close(out_fd);
+                out_fd = -1;
+            }
+        }
+        if (err_index != -1 && fds[err_index].revents != 0) {
+            ssize_t bytes_read = read(err_fd, error_data, sizeof(error_data));
+            if (bytes_read > 0) {
+                if (options.echo) {
+                    write_all(STDERR_FILENO, error_data, bytes_read);
+                }
+                result.errors.append(error_data, bytes_read);
+            } else if (bytes_read == 0 || errno != EINTR) {
+                close(err_fd);
+                err_fd = -1;
+            }
+        }
+        if (in_index != -1 && fds[in_index].revents != 0) {
+            if ((fds[in_index].revents & POLLOUT) == 0 || (write(in_fd, yes_data, sizeof(yes_data)) == -1 && errno != EAGAIN && errno != EINTR)) {
+                close(in_fd);
+                in_fd = -1;
+            }
+        }
+    }
+    for (int fd : {out_fd, err_fd, in_fd}) {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    // Reaping the child with its resource usage, still under the timeout
+    int status = 0;
+    rusage usage = {};
+    while (true) {
+        pid_t reaped = wait4(pid, &status, WNOHANG, &usage);
+        if (reaped == pid) {
+            result.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            break;
+        }
+        if (reaped == -1 && errno != EINTR) {
+            break;
+        }
+        signal_group();
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+
+    result.output = std::string_view(arena.data(), used);
+    result.user_seconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    result.system_seconds = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    result.max_rss_kb = usage.ru_maxrss;
+    stats_child_cpu_us += static_cast<long long>((result.user_seconds + result.system_seconds) * 1e6);
+    long peak = stats_child_max_rss_kb.load();
+    while (result.max_rss_kb > peak && !stats_child_max_rss_kb.compare_exchange_weak(peak, result.max_rss_kb)) {
+    }
+    if (result.timed_out) {
+        ++stats_command_timeouts;
+    }
+    check_cancelled();
+    return result;
+}
+
+
+// Function to execute a command and return its output as a string, echoing it as it arrives
+std::string command_exec(const std::vector<std::string>& argv, int* exit_code) {
+    SpawnOptions options;
+    options.timeout_seconds = command_timeout;
+    SpawnResult result = spawn_exec(argv, options);
+    if (exit_code) {
+        *exit_code = result.exit_code;
+    }
+    if (result.exit_code == 2) {
+        std::cerr <<"pacman error: Pakage not found or similar.\n";
+    }
+    return std::string(result.output);
+}
+
+
+// Function to execute a command classifying its output as it arrives.
+// Output is echoed and classified line by line, only the issues found are kept in memory.
+// When abort_on_fatal is set, pacman is interrupted as soon as the block of conflicts or
+// unsatisfiable dependencies it reported ends, instead of waiting for it to exit by itself.
+// With answer_yes, every prompt is answered "y" (pacman solves the conflicts it can by itself).
+StreamResult stream_exec(const std::vector<std::string>& argv, bool abort_on_fatal, bool answer_yes) {
+    StreamResult result;
+
+    // Complete lines go to the classifier, an incomplete line waits for the next chunk
+    // (up to a bound, so memory stays bounded).
+    const size_t max_line = 1 << 20;
+    std::string line;
+    bool fatal_block = false;
+    bool interrupt = false;
+
+    auto classify_pending_line = [&](std::string_view pending) {
+        size_t previous_events = result.events.size();
+        auto classify_start = std::chrono::steady_clock::now();
+        classify_line(pending, &result.events);
+        result.classify_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - classify_start).count();
+
+        bool fatal_line = false;
+        for (size_t i = previous_events; i < result.events.size(); ++i) {
+            fatal_line |= result.events[i].type == IssueType::CONFLICT || result.events[i].type == IssueType::DEPENDENCY_UNSATISFY;
+        }
+        if (fatal_line) {
+            fatal_block = true;
+        } else if (fatal_block && abort_on_fatal) {
+            interrupt = true;
+        }
+    };
+
+    SpawnOptions options;
+    options.capture = false;
+    options.answer_yes = answer_yes;
+    options.timeout_seconds = command_timeout;
+    options.on_output = [&](std::string_view chunk) {
+        size_t start = 0;
+        size_t end;
+        while ((end = chunk.find('\n', start)) != std::string_view::npos) {
+            if (line.empty()) {
+                classify_pending_line(chunk.substr(start, end - start));
+            } else {
+                line.append(chunk.substr(start, end - start));
+                classify_pending_line(line);
+                line.clear();
+            }
+            start = end + 1;
+        }
+        line.append(chunk.substr(start));
+        if (line.size() > max_line) {
+            classify_pending_line(line);
+            line.clear();
+        }
+        return !interrupt;
+    };
+    SpawnResult spawned = spawn_exec(argv, options);
+    if (!line.empty()) {
+        classify_pending_line(line);
+    }
+    result.bytes_read = spawned.bytes_read;
+    result.exit_code = spawned.exit_code;
+    result.aborted = spawned.interrupted;
+    result.timed_out = spawned.timed_out;
+
+    if (result.aborted) {
+        printf("\n[PACMAN INTERRUPTED] >> Resolving the issues already reported.\n");
+    }
+    return result;
+}
+
+
+// Function to execute a command and return its output without echoing it.
+// Used for commands whose output is data to be parsed (e.g. database archives, -Qi/-Si queries).
+// stderr is dropped unless merged with stdout.
+std::string command_read(const std::vector<std::string>& argv, bool merge_stderr) {
+    SpawnOptions options;
+    options.echo = false;
+    options.merge_stderr = merge_stderr;
+    options.timeout_seconds = query_timeout;
+    return std::string(spawn_exec(argv, options).output);
+}
+
+// Function to get the package name of a depend/provide entry.
+// e.g. "glibc>=2.38" -> "glibc", "libfoo.so=1-64" -> "libfoo.so"
+std::string strip_version_constraint(const std::string& depend) {
+    size_t pos = depend.find_first_of("<>=:");
+    if (pos == std::string::npos) {
+        return depend;
+    }
+    return depend.substr(0, pos);
+}
+
+
+// Function to parse desc entries of a pacman database.
+// The content can hold several desc files one after another (as a whole sync database extracted to stdout).
+// Each section starts with a %HEADER% line followed by one value per line and ends with an empty line.
+void parse_desc_entries(const std::string& content, std::vector<PackageDesc>* pkges) {
+    std::istringstream iss(content);
+    std::string line;
+    std::string section;
+    PackageDesc current;
+
+    while (std::getline(iss, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            section.clear();
+            continue;
+        }
+
+        if (line.size() > 2 && line.front() == '%' && line.back() == '%') {
+            section = line;
+            // A new entry starts with %FILENAME% (sync databases) or with %NAME% (local database)
+            if ((section == "%FILENAME%" || section == "%NAME%") && !current.name.empty()) {
+                pkges->push_back(std::move(current));
+                current = PackageDesc();
+            }
+            continue;
+        }
+
+        if (section == "%NAME%") {
+            current.name = line;
+        } else if (section == "%VERSION%") {
+            current.version = line;
+        } else if (section == "%ARCH%") {
+            current.arch = line;
+        } else if (section == "%DEPENDS%") {
+            current.depends.push_back(line);
+        } else if (section == "%PROVIDES%") {
+            current.provides.push_back(line);
+        } else if (section == "%CONFLICTS%") {
+            current.conflicts.push_back(line);
+        } else if (section == "%REPLACES%") {
+            current.replaces.push_back(line);
+        }
+    }
+
+    if (!current.name.empty()) {
+        pkges->push_back(std::move(current));
+    }
+}
+
+
+// Function to build the sync database index from the repository packages of the backend.
+// With pacman they are read from <dbpath>/sync/*.db, see PacmanBackend::read_sync.
+bool load_sync_databases() {
+    std::vector<PackageDesc> pkges;
+    size_t databases = 0;
+
+    TraceScope trace("sync_db_load", "sync databases");
+    if (!backend->read_sync(&pkges, &databases)) {
+        return false;
+    }
+
+    sync_pkges_index.clear();
+    sync_provides_index.clear();
+
+    for (auto& pkge : pkges) {
+        // The first repository holding a package wins, as pacman does
+        if (sync_pkges_index.count(pkge.name) > 0) {
+            continue;
+        }
+        for (const auto& provide : pkge.provides) {
+            sync_provides_index[strip_version_constraint(provide)].push_back(pkge.name);
+        }
+        std::string name = pkge.name;
+        sync_pkges_index.emplace(name, std::move(pkge));
+    }
+
+    sync_db_loaded = !sync_pkges_index.empty();
+    sync_db_loaded_generation = backend->sync_generation();
+    printf("[SYNC DB LOADED] >> %zu packages and %zu provides from %zu databases\n",
+           sync_pkges_index.size(), sync_provides_index.size(), databases);
+    return sync_db_loaded;
+}
+
+
+// Function to get the generation of the sync databases: name, size and modification time of every database.
+// It changes whenever pacman refreshes (downloads) a database.
+std::string sync_databases_generation(const std::string& dbpath) {
+    std::vector<std::string> generation;
+    std::error_code ec;
+
+    for (const auto& entry : std::filesystem::directory_iterator(dbpath + "/sync", ec)) {
+        if (entry.path().extension() != ".db") {
+            continue;
+        }
+        std::error_code entry_ec;
+        auto mtime = std::filesystem::last_write_time(entry.path(), entry_ec).time_since_epoch().count();
+        auto size = std::filesystem::file_size(entry.path(), entry_ec);
+        generation.push_back(entry.path().stem().string() + ":" + std::to_string(size) + ":" + std::to_string(mtime));
+    }
+    std::sort(generation.begin(), generation.end());
+
+    std::string joined;
+    for (const auto& db : generation) {
+        joined += db + " ";
+    }
+    return joined;
+}
+
+
+// Function to (re)load the sync database index, only if the databases changed since it was built
+bool ensure_sync_databases() {
+    if (sync_db_loaded && sync_db_loaded_generation == backend->sync_generation()) {
+        return true;
+    }
+    return load_sync_databases();
+}
+
+
+// Function to refresh the sync databases once for the whole run (pacman -Sy)
+bool refresh_sync_databases() {
+    printf("\n[REFRESHING SYNC DATABASES]\n\n");
+    TraceScope trace("refresh", "-Sy");
+    bool refreshed = backend->refresh();
+    trace.end(refreshed ? 0 : 1, 0);
+    ++stats_sync_refreshes;
+
+    std::string generation = backend->sync_generation();
+    printf("\n[SYNC DATABASES GENERATION] >> %s\n", generation.empty() ? "(none)" : generation.c_str());
+    return refreshed;
+}
+
+
+// Function to build a pacman command with the global options (--config, --root, --dbpath, --cachedir).
+// It is an argv, run without a shell: no quoting, package names and paths go as they are.
+std::vector<std::string> pacman_command(const std::vector<std::string>& arguments, bool as_root) {
+    std::vector<std::string> command;
+    if (as_root) {
+        command.push_back("sudo");
+    }
+    command.push_back("pacman");
+    if (!pacman_config.empty()) {
+        command.insert(command.end(), {"--config", pacman_config});
+    }
+    if (!pacman_root.empty()) {
+        command.insert(command.end(), {"--root", pacman_root});
+    }
+    if (pacman_dbpath != "/var/lib/pacman") {
+        command.insert(command.end(), {"--dbpath", pacman_dbpath});
+    }
+    for (const auto& cachedir : prefetch_cachedirs()) {
+        command.insert(command.end(), {"--cachedir", cachedir});
+    }
+    command.insert(command.end(), arguments.begin(), arguments.end());
+    return command;
+}
+
+
+// Function to build a -S operation with the given flags (e.g. "uv" -> "-Suv").
+// The sync databases are refreshed once at startup, -y is only added with --refresh-each.
+std::string sync_operation(const std::string& flags) {
+    if (refresh_each_run) {
+        ++stats_sync_refreshes;
+        return "-Sy" + flags;
+    }
+    return "-S" + flags;
+}
+
+
+// Function to check if a package, or a package providing it, is in the sync databases
+bool is_in_sync_repos(const std::string& packageName) {
+    return sync_pkges_index.count(packageName) > 0 || sync_provides_index.count(packageName) > 0;
+}
+
+
+// Function to build the local database index and reverse-dependency graph from the installed packages of the backend.
+// With pacman they are read from <dbpath>/local/*/desc, see PacmanBackend::read_local.
+bool load_local_database() {
+    std::string generation = backend->local_generation();
+    std::vector<PackageDesc> pkges;
+
+    TraceScope trace("local_db_load", "local database");
+    if (generation.empty() || !backend->read_local(&pkges)) {
+        return false;
+    }
+
+    local_pkges_index.clear();
+    local_provides_index.clear();
+    local_replaces_index.clear();
+    local_requiredby_index.clear();
+
+    for (auto& pkge : pkges) {
+        std::string name = pkge.name;
+        local_pkges_index[name] = std::move(pkge);
+    }
+
+    for (const auto& [name, pkge] : local_pkges_index) {
+        for (const auto& provide : pkge.provides) {
+            local_provides_index[strip_version_constraint(provide)].push_back(name);
+        }
+        for (const auto& replace : pkge.replaces) {
+            local_replaces_index[strip_version_constraint(replace)].push_back(name);
+        }
+    }
+
+    // Reverse edges: every installed package satisfying a dependency is required by the package depending on it.
+    // This is what pacman -Qi shows as "Required By".
+    for (const auto& [name, pkge] : local_pkges_index) {
+        for (const auto& depend : pkge.depends) {
+            for (const auto& satisfier : resolve_local_depend(depend)) {
+                if (satisfier != name) {
+                    local_requiredby_index[satisfier].insert(name);
+                }
+            }
+        }
+    }
+
+    local_db_generation = generation;
+    local_db_loaded = true;
+    return true;
+}
+
+
+// Function to (re)load the local database if it changed since it was loaded.
+// With pacman, its transactions add and remove entries of the local directory, so its mtime is enough to know.
+bool ensure_local_database() {
+    std::string generation = backend->local_generation();
+    if (generation.empty()) {
+        local_db_loaded = false;
+        return false;
+    }
+    if (local_db_loaded && generation == local_db_generation) {
+        return true;
+    }
+    return load_local_database();
+}
+
+
+// Function to get the installed packages satisfying a dependency.
+// As pacman does, a package with the same name wins over providers. Replacers are the last resort.
+std::vector<std::string> resolve_local_depend(const std::string& depend) {
+    std::string name = strip_version_constraint(depend);
+
+    if (local_pkges_index.count(name) > 0) {
+        return {name};
+    }
+    auto provider = local_provides_index.find(name);
+    if (provider != local_provides_index.end()) {
+        return provider->second;
+    }
+    auto replacer = local_replaces_index.find(name);
+    if (replacer != local_replaces_index.end()) {
+        return replacer->second;
+    }
+    return {};
+}
+
+
+// Function to get packages and all packages depending on them, directly or not.
+// The order is dependents first, so every package comes before the packages it depends on.
+// Packages not installed are skipped, the result is empty if none is installed.
+std::vector<std::string> removal_order(const std::vector<std::string>& packageNames) {
+    std::vector<std::string> order;
+    std::set<std::string> visited;
+    std::vector<std::pair<std::string, bool>> stack; // Package name and if its dependents were already pushed
+
+    // Iterative post-order DFS over the reverse-dependency graph. The visited set breaks dependency cycles
+    // and merges the dependents shared by several packages.
+    // A package is only emitted once all packages depending on it were emitted.
+    for (auto root = packageNames.rbegin(); root != packageNames.rend(); ++root) {
+        if (local_pkges_index.count(*root) > 0) {
+            stack.push_back({*root, false});
+        }
+    }
+    while (!stack.empty()) {
+        auto [pkge, expanded] = stack.back();
+        if (expanded) {
+            order.push_back(pkge);
+            stack.pop_back();
+            continue;
+        }
+        if (!visited.insert(pkge).second) {
+            stack.pop_back(); // Already reached through another dependent
+            continue;
+        }
+        stack.back().second = true;
+
+        auto dependents = local_requiredby_index.find(pkge);
+        if (dependents == local_requiredby_index.end()) {
+            continue;
+        }
+        for (const auto& dependent : dependents->second) {
+            if (local_pkges_index.count(dependent) > 0 && visited.count(dependent) == 0) {
+                stack.push_back({dependent, false});
+            }
+        }
+    }
+    return order;
+}
+
+
+// Function to remove packages and all their dependents in one planned transaction.
+// The plan is the whole dependents-first removal set from the local database graph. As it already holds
+// every dependent, pacman -Rdd removes it at once instead of one pacman -R (twice) per package.
+// Very large plans are split in a few transactions to keep the command line bounded.
+std::string remove_packages(const std::vector<std::string>& packageNames) {
+    const size_t max_per_transaction = 500;
+
+    // Fallback when the local database cannot be read: one package at a time with pacman -Qi
+    if (!ensure_local_database()) {
+        std::string rm_output = "NOT_INSTALLED";
+        for (const auto& pkge : packageNames) {
+            std::string pkge_output = remove_package(pkge);
+            if (pkge_output == "ERROR") {
+                return "ERROR";
+            }
+            if (pkge_output == "OK") {
+                rm_output = "OK";
+            }
+        }
+        return rm_output;
+    }
+
+    std::vector<std::string> order = removal_order(packageNames);
+    if (order.empty()) {
+        return "NOT_INSTALLED";
+    }
+
+    printf("\n[REMOVAL PLAN] >> %zu package(s):", order.size());
+    for (const auto& pkge : order) {
+        printf(" %s", pkge.c_str());
+    }
+    printf("\n\n");
+
+    for (size_t first = 0; first < order.size(); first += max_per_transaction) {
+        std::vector<std::string> rm_pkges;
+        size_t last = std::min(order.size(), first + max_per_transaction);
+        std::vector<std::string> planned_records;
+        for (size_t i = first; i < last; ++i) {
+            rm_pkges.push_back(order[i]);
+            pkge_resolved.erase(order[i]); // It has to be resolved again once reinstalled
+            mark_dirty(order[i]);
+            planned_records.push_back("planned\t" + order[i]);
+        }
+        preserve_archives(rm_pkges);
+        journal_append(planned_records);
+
+        // The packages going back from the repositories are downloaded during the removal and the analysis
+        std::vector<std::string> repo_pkges;
+        for (const auto& pkge : rm_pkges) {
+            if (reinstalls_from_repo(pkge)) {
+                repo_pkges.push_back(pkge);
+            }
+        }
+        start_prefetch(repo_pkges);
+
+        int exit_code;
+        TraceScope trace("removal", "-Rdd " + std::to_string(rm_pkges.size()) + " package(s)");
+        auto removal_start = std::chrono::steady_clock::now();
+        std::string rm_output = backend->remove(rm_pkges, true, &exit_code);
+        trace.end(exit_code, rm_output.size());
+        ++system_generation;
+        stats_removal_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - removal_start).count();
+        ++stats_removal_transactions;
+
+        if (exit_code != 0) {
+            // Nothing of this transaction was removed: it is not reinstalled, and its archives are not kept
+            for (const auto& pkge : rm_pkges) {
+                preserved_archives.erase(pkge);
+            }
+            return "ERROR";
+        }
+        std::vector<std::string> removed_records;
+        for (const auto& pkge : rm_pkges) {
+            removed_pkges.insert(pkge); // Adding package to removed packages set for reinstallation later
+            removed_records.push_back("removed\t" + pkge);
+        }
+        journal_append(removed_records);
+        recipe_removals.push_back(rm_pkges);
+    }
+    stats_removal_transactions_per_package += 2 * order.size();
+    stats_packages_removed += order.size();
+
+    printf("\n[PACKAGES UNINSTALLED] >> %zu package(s) in %zu transaction(s)\n\n", order.size(),
+           (order.size() + max_per_transaction - 1) / max_per_transaction);
+    return "OK";
+}
+
+
+// Function to run pacman -R for a single package that has no dependents left
+std::string remove_single_package(const std::string& packageName) {
+    std::string rm_pkge_output;
+
+    pkge_resolved.erase(packageName); // It has to be resolved again once reinstalled
+    mark_dirty(packageName);
+    preserve_archives({packageName});
+    journal_append({"planned\t" + packageName});
+
+    // The second attempt confirms the removal, as pacman reports the target is not found anymore
+    auto removal_start = std::chrono::steady_clock::now();
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        int exit_code;
+        TraceScope trace("removal", "-R " + packageName);
+        rm_pkge_output = backend->remove({packageName}, false, &exit_code);
+        trace.end(exit_code, rm_pkge_output.size());
+    }
+    stats_removal_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - removal_start).count();
+    stats_removal_transactions += 2;
+    stats_removal_transactions_per_package += 2;
+    ++system_generation;
+    if (has_event(classify_output(rm_pkge_output), IssueType::TARGET_NOT_FOUND)) {
+        removed_pkges.insert(packageName); // Adding package to removed packages set for reinstallation later
+        journal_append({"removed\t" + packageName});
+        recipe_removals.push_back({packageName});
+        ++stats_packages_removed;
+        printf("\n[PACKAGE UNINSTALLED] >> %s \n\n", packageName.c_str());
+        return "OK";
+    }
+    preserved_archives.erase(packageName);
+    return "ERROR";
+}
+
+
+// Function to run read-only queries (pacman -Si if sync, else -Qi) for several packages at once.
+// They take no lock in the pacman database, so a bounded pool of workers runs them concurrently
+// while transactions stay serialized. The outputs are returned and echoed in the order of the packages.
+std::vector<std::string> query_packages(const std::vector<std::string>& packageNames, bool sync) {
+    std::vector<std::string> outputs(packageNames.size());
+    if (packageNames.empty()) {
+        return outputs;
+    }
+
+    size_t jobs = query_jobs > 0 ? query_jobs : std::min(8u, std::max(1u, std::thread::hardware_concurrency()));
+    jobs = std::min(jobs, packageNames.size());
+
+    TraceScope trace(sync ? "query_sync" : "query_local",
+                     std::string(sync ? "-Si " : "-Qi ") + std::to_string(packageNames.size()) + " package(s), " + std::to_string(jobs) + " job(s)");
+    std::atomic<size_t> next_query{0};
+    auto worker = [&]() {
+        for (size_t i = next_query++; i < packageNames.size(); i = next_query++) {
+            outputs[i] = sync ? backend->query_sync(packageNames[i]) : backend->query_local(packageNames[i]);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t job = 1; job < jobs; ++job) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& running : workers) {
+        running.join();
+    }
+
+    size_t bytes = 0;
+    for (const auto& output : outputs) {
+        printf("%s", output.c_str());
+        bytes += output.size();
+    }
+    trace.end(0, bytes);
+    return outputs;
+}
+
+
+// Helpers for the classifier. Whitespace is the same set matched by \\s in the regex patterns.
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+// Token (run of non-whitespace characters) ending right before position end
+static std::string_view token_before(std::string_view line, size_t end) {
+    size_t start = end;
+    while (start > 0 && !is_space(line[start - 1])) {
+        --start;
+    }
+    return line.substr(start, end - start);
+}
+
+// Token (run of non-whitespace characters) starting at position start
+static std::string_view token_after(std::string_view line, size_t start) {
+    size_t end = start;
+    while (end < line.size() && !is_space(line[end])) {
+        ++end;
+    }
+    return line.substr(start, end - start);
+}
+
+// Position after the whitespace run starting at pos. Same as pos if there is no whitespace.
+static size_t skip_spaces(std::string_view line, size_t pos) {
+    while (pos < line.size() && is_space(line[pos])) {
+        ++pos;
+    }
+    return pos;
+}
+
+
+// Function to classify one line of pacman output.
+// It finds the same issues as the regex patterns, but with plain substring searches over the line:
+//   "A and B are in conflict"                          (not a [y/N] prompt)
+//   "A required by B"                                  (e.g. "breaks dependency 'A' required by B")
+//   "unable to satisfy dependency 'A' required by B"
+//   "target not found: A"
+//   "package 'A' was not found"
+//   "A is up to date -- reinstalling"
+//   "there is nothing to do"
+void classify_line(std::string_view line, std::vector<OutputEvent>* events) {
+    size_t pos;
+
+    if (line.find("there is nothing to do") != std::string_view::npos) {
+        events->push_back({IssueType::NOTHING_TO_FIX, "", ""});
+    }
+
+    pos = line.find("is up to date");
+    if (pos != std::string_view::npos) {
+        size_t next = skip_spaces(line, pos + 13);
+        size_t dashes = next;
+        while (dashes < line.size() && line[dashes] == '-') {
+            ++dashes;
+        }
+        if (dashes > next && line.substr(skip_spaces(line, dashes)).substr(0, 12) == "reinstalling") {
+            events->push_back({IssueType::UP_TO_DATE, std::string(token_before(line, pos > 0 ? pos - 1 : 0)), ""});
+        }
+    }
+
+    pos = line.find("target not found:");
+    if (pos != std::string_view::npos) {
+        size_t next = skip_spaces(line, pos + 17);
+        std::string_view target = token_after(line, next);
+        if (next > pos + 17 && !target.empty()) {
+            events->push_back({IssueType::TARGET_NOT_FOUND, std::string(target), ""});
+        }
+    }
+
+    pos = line.find("package '");
+    if (pos != std::string_view::npos && pos > 0 && is_space(line[pos - 1])) {
+        size_t end = line.find("' was not found", pos + 9);
+        if (end != std::string_view::npos) {
+            std::string_view name = line.substr(pos + 9, end - pos - 9);
+            if (!name.empty() && token_after(name, 0).size() == name.size()) {
+                events->push_back({IssueType::PACKAGE_NOT_FOUND, std::string(name), ""});
+            }
+        }
+    }
+
+    // An unsatisfied dependency line also reads as "A required by B", it is reported only once
+    pos = line.find("unable to satisfy dependency '");
+    if (pos != std::string_view::npos) {
+        size_t end = line.find("' required by", pos + 30);
+        if (end != std::string_view::npos) {
+            std::string_view depend = line.substr(pos + 30, end - pos - 30);
+            size_t next = skip_spaces(line, end + 13);
+            std::string_view requiring = token_after(line, next);
+            if (!depend.empty() && token_after(depend, 0).size() == depend.size() && next > end + 13 && !requiring.empty()) {
+                events->push_back({IssueType::DEPENDENCY_UNSATISFY, std::string(depend), std::string(requiring)});
+                return;
+            }
+        }
+    }
+
+    pos = line.find("required by");
+    while (pos != std::string_view::npos) {
+        size_t token_end = pos;
+        while (token_end > 0 && is_space(line[token_end - 1])) {
+            --token_end;
+        }
+        std::string_view required = token_before(line, token_end);
+        size_t next = skip_spaces(line, pos + 11);
+        std::string_view requiring = token_after(line, next);
+        if (token_end < pos && !required.empty() && next > pos + 11 && !requiring.empty()) {
+            events->push_back({IssueType::REQUIRED_BY, std::string(required), std::string(requiring)});
+        }
+        pos = line.find("required by", pos + 11);
+    }
+
+    // "<package>: <path> exists in filesystem [(owned by <owner>)]", the owner is found with the file ownership index
+    pos = line.find(" exists in filesystem");
+    if (pos != std::string_view::npos) {
+        size_t path_end = pos;
+        while (path_end > 0 && is_space(line[path_end - 1])) {
+            --path_end;
+        }
+        std::string_view path = token_before(line, path_end);
+        size_t path_start = path_end - path.size();
+        if (!path.empty() && path_start >= 3 && line[path_start - 1] == ' ' && line[path_start - 2] == ':') {
+            std::string_view pkge = token_before(line, path_start - 2);
+            if (!pkge.empty()) {
+                events->push_back({IssueType::CONFLICT_FILES, std::string(pkge), std::string(path)});
+            }
+        }
+    }
+
+    pos = line.find(" are in conflict");
+    if (pos != std::string_view::npos) {
+        std::string_view pkge_b = token_before(line, pos);
+        size_t and_end = pos - pkge_b.size();
+        size_t and_pos = and_end;
+        while (and_pos > 0 && is_space(line[and_pos - 1])) {
+            --and_pos;
+        }
+        bool has_and = and_pos < and_end && and_pos >= 3 && line.substr(and_pos - 3, 3) == "and";
+        if (has_and && !pkge_b.empty()) {
+            size_t token_end = and_pos - 3;
+            size_t spaces_end = token_end;
+            while (token_end > 0 && is_space(line[token_end - 1])) {
+                --token_end;
+            }
+            std::string_view pkge_a = token_before(line, token_end);
+            size_t pkge_a_pos = token_end - pkge_a.size();
+            // Conflicts asked as a prompt are answered by pacman itself, only the final report is an issue
+            if (token_end < spaces_end && !pkge_a.empty() && line.find("[y/N]", pkge_a_pos) == std::string_view::npos) {
+                events->push_back({IssueType::CONFLICT, std::string(pkge_a), std::string(pkge_b)});
+            }
+        }
+    }
+}
+
+
+// Function to classify the whole pacman output in a single pass, line by line
+std::vector<OutputEvent> classify_output(const std::string& output) {
+    std::vector<OutputEvent> events;
+    std::string_view text(output);
+    size_t start = 0;
+
+    while (start < text.size()) {
+        size_t end = text.find('\n', start);
+        if (end == std::string_view::npos) {
+            end = text.size();
+        }
+        classify_line(text.substr(start, end - start), &events);
+        start = end + 1;
+    }
+    return events;
+}
+
+
+// Function to check if an issue type was found
+bool has_event(const std::vector<OutputEvent>& events, IssueType isstype) {
+    for (const auto& event : events) {
+        if (event.type == isstype) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Function to compare the classifier against the regex patterns on recorded pacman transcripts.
+// The regex path is what the resolver used to do: every regex_search of inspect_and_resolve_packages
+// plus the match iteration of each pattern. Both paths must find the same issues.
+int run_classifier_benchmark(const std::vector<std::string>& transcripts, int iterations) {
+    int mismatches = 0;
+
+    printf("%-40s %10s %8s %12s %12s %8s %s\n", "TRANSCRIPT", "BYTES", "EVENTS", "REGEX(ms)", "CLASSIF(ms)", "SPEEDUP", "RESULT");
+
+    for (const auto& transcript : transcripts) {
+        FILE *transcript_file = fopen(transcript.c_str(), "r");
+        if (!transcript_file) {
+            std::cerr << "Failed to open transcript: " << transcript << "\n";
+            return EXIT_FAILURE;
+        }
+        char data[65536];
+        std::string output;
+        size_t bytes_read;
+        while ((bytes_read = fread(data, 1, sizeof(data), transcript_file)) > 0) {
+            output.append(data, bytes_read);
+        }
+        fclose(transcript_file);
+
+        // Regex path
+        std::vector<OutputEvent> regex_events;
+        auto regex_start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i) {
+            regex_events.clear();
+            bool found = std::regex_search(output, pattern_rgx_conflict);
+            found |= std::regex_search(output, pattern_rgx_requiredby) && !std::regex_search(output, pattern_rgx_unable_to_satisfy_depen);
+            found |= std::regex_search(output, pattern_rgx_target_not_found);
+            found |= std::regex_search(output, pattern_rgx_unable_to_satisfy_depen);
+            found |= std::regex_search(output, pattern_rgx_nothing_to_fix);
+            found |= std::regex_search(output, pattern_rgx_up_to_date);
+            found |= std::regex_search(output, pattern_rgx_conflict_files);
+            (void)found;
+
+            const std::pair<std::regex*, IssueType> patterns[] = {
+                {&pattern_rgx_conflict, IssueType::CONFLICT},
+                {&pattern_rgx_requiredby, IssueType::REQUIRED_BY},
+                {&pattern_rgx_target_not_found, IssueType::TARGET_NOT_FOUND},
+                {&pattern_rgx_unable_to_satisfy_depen, IssueType::DEPENDENCY_UNSATISFY},
+                {&pattern_rgx_was_not_found, IssueType::PACKAGE_NOT_FOUND},
+                {&pattern_rgx_conflict_files, IssueType::CONFLICT_FILES},
+            };
+            for (const auto& [pattern_rgx, isstype] : patterns) {
+                for (std::sregex_iterator findingMatches(output.begin(), output.end(), *pattern_rgx), end; findingMatches != end; ++findingMatches) {
+                    regex_events.push_back({isstype, findingMatches->str(1), findingMatches->size() > 2 ? findingMatches->str(2) : ""});
+                }
+            }
+        }
+        double regex_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - regex_start).count() / iterations;
+
+        // Classifier path
+        std::vector<OutputEvent> events;
+        auto classifier_start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i) {
+            events = classify_output(output);
+        }
+        double classifier_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - classifier_start).count() / iterations;
+
+        // Comparing the issues found. The required-by pattern also matches unsatisfied dependency lines
+        // (with the quotes around the dependency), the classifier reports those lines only once.
+        std::multiset<std::tuple<int, std::string, std::string>> expected, found;
+        for (const auto& event : regex_events) {
+            expected.insert({(int)event.type, event.first, event.second});
+        }
+        for (const auto& event : regex_events) {
+            if (event.type == IssueType::DEPENDENCY_UNSATISFY) {
+                auto quoted = expected.find({(int)IssueType::REQUIRED_BY, "'" + event.first + "'", event.second});
+                if (quoted != expected.end()) {
+                    expected.erase(quoted);
+                }
+            }
+        }
+        for (const auto& event : events) {
+            if (event.type == IssueType::CONFLICT || event.type == IssueType::REQUIRED_BY || event.type == IssueType::TARGET_NOT_FOUND
+                || event.type == IssueType::DEPENDENCY_UNSATISFY || event.type == IssueType::PACKAGE_NOT_FOUND
+                || event.type == IssueType::CONFLICT_FILES) {
+                found.insert({(int)event.type, event.first, event.second});
+            }
+        }
+        bool same = expected == found;
+        mismatches += !same;
+
+        printf("%-40s %10zu %8zu %12.3f %12.3f %7.1fx %s\n", transcript.c_str(), output.size(), events.size(),
+               regex_ms, classifier_ms, classifier_ms > 0 ? regex_ms / classifier_ms : 0.0, same ? "MATCH" : "MISMATCH");
+    }
+    return mismatches == 0 ? 0 : EXIT_FAILURE;
+}
+
+
+// Function to resolve the issues that only need removals.
+// Unsatisfied dependencies and targets not found need no probing, the packages are just removed.
+// All of them are planned together and removed in a single transaction.
+void inspect_events_and_resolve(const std::vector<OutputEvent>* events, IssueType isstype) {
+    std::vector<std::string> roots;
+
+    for (const auto& event : *events) {
+        if (event.type != isstype) {
+            continue;
+        }
+        if (isstype == IssueType::DEPENDENCY_UNSATISFY) {
+            printf("\n[DEPENDENCY UNSATISFIED] >> %s required by %s\n", event.first.c_str(), event.second.c_str());
+            roots.push_back(event.second);
+        } else if (isstype == IssueType::TARGET_NOT_FOUND) {
+            printf("\n[TARGET NOT FOUND] >> %s - Desinstalling...\n", event.first.c_str());
+            roots.push_back(event.first);
+        }
+    }
+    if (roots.empty()) {
+        return;
+    }
+
+    if (remove_packages(roots) == "ERROR") {
+        exit_removal_failed();
+    }
+
+    for (const auto& pkge : roots) {
+        if (isstype == IssueType::DEPENDENCY_UNSATISFY) {
+            printf("\n[DEPENDENCY UNSATISFY RESOLVED] >> %s has been removed to resolve the unsatisfied dependency.\n", pkge.c_str());
+            removed_pkges.erase(pkge); // Removing from removed packages set to avoid reinstalling it later
+            log_package(log_dependency_unsatisfy_removed, "dependency_unsatisfy_removed", pkge);
+            journal_append({"unsatisfied_removed\t" + pkge});
+        } else {
+            log_package(log_not_found_in_repos, "not_found_in_repos", pkge);
+            journal_append({"not_in_repos\t" + pkge});
+        }
+    }
+}
+
+
+// Function to remove a package and its dependents
+std::string remove_package(std::string packageName) {
+    // Using the local database graph when available. The whole removal order is known at once,
+    // so no pacman -Qi is needed, and the package and all its dependents are removed in one transaction.
+    if (ensure_local_database()) {
+        printf("\n[CHECKING DEPENDENCIES FOR] >> %s\n\n", packageName.c_str());
+
+        std::string rm_output = remove_packages({packageName});
+        if (rm_output == "NOT_INSTALLED") {
+            printf("[PACKAGE NOT INSTALLED] >> %s was not found in the system.\n", packageName.c_str());
+        } else if (rm_output == "OK") {
+            printf("[PACKAGE REMOVED] >> %s and its dependents were removed successfully.\n", packageName.c_str());
+        }
+        return rm_output;
+    }
+
+    // Fallback when the local database cannot be read: asking pacman -Qi for the package and its dependents,
+    // level by level. The queries of a level are read-only and run concurrently; the packages are then
+    // removed one by one, dependents first.
+    std::regex pattern_rgx_removing(R"(Required By\s+:\s+(.+))"); // To capture packages that require the target package
+    std::smatch match;
+    std::unordered_map<std::string, std::vector<std::string>> required_by_graph; // Installed package -> packages requiring it
+    std::vector<std::string> level = {packageName};
+    std::set<std::string> seen = {packageName};
+
+    printf("\n[CHECKING DEPENDENCIES FOR] >> %s\n\n", packageName.c_str());
+
+    while (!level.empty()) {
+        std::vector<std::string> required_by_outputs = query_packages(level, false); // Getting packages info
+        std::vector<std::string> next_level;
+
+        for (size_t i = 0; i < level.size(); ++i) {
+            // Checking if package is installed, if not, it is not removed
+            if (has_event(classify_output(required_by_outputs[i]), IssueType::PACKAGE_NOT_FOUND)) {
+                if (level[i] == packageName) {
+                    printf("[PACKAGE NOT INSTALLED] >> %s was not found in the system.\n", packageName.c_str());
+                    return "NOT_INSTALLED";
+                }
+                continue;
+            }
+
+            // Checking for packages that require the package being removed
+            if (!std::regex_search(required_by_outputs[i], match, pattern_rgx_removing)) {
+                // Not the package information (pacman failed)
+                printf("[FAILED GETTING PACKAGE INFO] >> %s\n", level[i].c_str());
+                return "ERROR";
+            }
+
+            std::vector<std::string>& dependents = required_by_graph[level[i]];
+            std::string required_by = match.str(1); // Getting the required by packages
+            if (required_by != "None") {
+                std::istringstream iss(required_by);
+                std::string word;
+                // Splitting the required by string into individual package names
+                while (iss >> word) {
+                    dependents.push_back(word);
+                    if (seen.insert(word).second) {
+                        printf("**** Marking package for removal: %s\n\n", word.c_str());
+                        next_level.push_back(word);
+                    }
+                }
+            }
+        }
+        level = std::move(next_level);
+    }
+
+    // Dependents first (post-order over the required by graph). The packages in a cycle
+    // keep their dependents and fail to be removed, as they did with the recursive removal.
+    std::vector<std::string> removed_pkges_requiredby;
+    std::set<std::string> visited = {packageName};
+    std::vector<std::pair<std::string, size_t>> stack = {{packageName, 0}};
+    while (!stack.empty()) {
+        auto& [pkge, next_dependent] = stack.back();
+        const std::vector<std::string>& dependents = required_by_graph[pkge];
+        if (next_dependent < dependents.size()) {
+            const std::string& dependent = dependents[next_dependent++];
+            if (required_by_graph.count(dependent) && visited.insert(dependent).second) {
+                stack.push_back({dependent, 0});
+            }
+            continue;
+        }
+        removed_pkges_requiredby.push_back(pkge);
+        stack.pop_back();
+    }
+
+    for (const auto& pkge : removed_pkges_requiredby) {
+        printf("[REMOVING] >> No packages depending on: %s\n\n", pkge.c_str());
+        std::string rm_output = remove_single_package(pkge);
+        if (pkge == packageName && rm_output != "OK") {
+            return rm_output;
+        }
+    }
+    printf("[PACKAGE REMOVED] >> %s and its dependents were removed successfully.\n", packageName.c_str());
+    return "OK";
+}
+
+
+// Function to print how many transactions and how much time batching saved.
+// The per-package removal ran pacman -R twice per package, the saved time is estimated
+// with the average duration of the transactions that actually ran.
+void print_transaction_report() {
+    int removal_saved = stats_removal_transactions_per_package - stats_removal_transactions;
+    double average_seconds = stats_removal_transactions > 0 ? stats_removal_seconds / stats_removal_transactions : 0;
+
+    printf("\n[TRANSACTIONS] >> Removal: %d run (%.1f s), %d with per-package removal, %d saved (~%.1f s)\n",
+           stats_removal_transactions, stats_removal_seconds, stats_removal_transactions_per_package,
+           removal_saved, removal_saved * average_seconds);
+    printf("[TRANSACTIONS] >> Reinstall: %d run (%.1f s), %d package(s) from their archive (%d cached, %d rebuilt)\n",
+           stats_reinstall_transactions, stats_reinstall_seconds, stats_archives_reinstalled, stats_archives_cached, stats_archives_rebuilt);
+    printf("[TRANSACTIONS] >> Reinstall bisections: %d, package(s) failing alone: %d\n", stats_reinstall_bisections, stats_reinstall_failed);
+    printf("[TRANSACTIONS] >> Prefetch: %d run(s), %d package(s) downloaded in the background (%.1f s, %d failed), %.1f s waited for them\n",
+           stats_prefetch_runs, stats_prefetch_packages, stats_prefetch_seconds, stats_prefetch_failed, stats_prefetch_wait_seconds);
+    printf("[RESOLVER] >> pacman runs: %d, avoided as the package state had not changed: %d\n", stats_pacman_runs, stats_pacman_runs_avoided);
+    printf("[RESOLVER] >> Full system upgrade runs: %d, targeted re-checks of touched packages: %d\n", stats_full_checks, stats_targeted_checks);
+    printf("[RESOLVER] >> Sync database refreshes: %d, main loop cycles: %d\n", stats_sync_refreshes, stats_cycles);
+    printf("[RESOLVER] >> Packages removed: %d, removal plans of the global solver: %d\n", stats_packages_removed, stats_solver_plans);
+    printf("[RESOLVER] >> File conflicts: %d unowned file(s) overwritten, %d resolution(s) of owning packages\n",
+           stats_files_overwritten, stats_file_owners_resolved);
+    printf("[RESOLVER] >> Recipes replayed: %d, removal transactions replayed: %d\n", stats_recipes_replayed, stats_recipe_removals);
+}
+
+
+// Function to get the package name of a token from pacman messages.
+// The final report of conflicts names the packages with their version ("foo-1.2-1 and bar-2:0.5-3 are in conflict").
+// A known package name is kept as is, otherwise "-pkgver-pkgrel" is cut when pkgrel is numeric.
+std::string package_name_of(const std::string& token) {
+    if (local_pkges_index.count(token) > 0 || sync_pkges_index.count(token) > 0) {
+        return token;
+    }
+    size_t rel = token.rfind('-');
+    if (rel == std::string::npos || rel == 0) {
+        return token;
+    }
+    size_t ver = token.rfind('-', rel - 1);
+    if (ver == std::string::npos || ver == 0) {
+        return token;
+    }
+    std::string pkgrel = token.substr(rel + 1);
+    if (pkgrel.empty() || !isdigit(static_cast<unsigned char>(pkgrel[0])) || pkgrel.find_first_not_of("0123456789.") != std::string::npos) {
+        return token;
+    }
+    return token.substr(0, ver);
+}
+
+
+// Function to compare two version strings segment by segment, as rpmvercmp (used by pacman) does.
+// Digits and letters are separate segments, numeric segments are newer than alphabetic ones.
+static int compare_version_segments(const std::string& a, const std::string& b) {
+    size_t i = 0;
+    size_t j = 0;
+
+    if (a == b) {
+        return 0;
+    }
+    while (i < a.size() && j < b.size()) {
+        size_t separator_i = i;
+        size_t separator_j = j;
+        while (i < a.size() && !isalnum(static_cast<unsigned char>(a[i]))) {
+            ++i;
+        }
+        while (j < b.size() && !isalnum(static_cast<unsigned char>(b[j]))) {
+            ++j;
+        }
+        if (i == a.size() || j == b.size()) {
+            break;
+        }
+        if (i - separator_i != j - separator_j) {
+            return i - separator_i < j - separator_j ? -1 : 1;
+        }
+
+        bool numeric = isdigit(static_cast<unsigned char>(a[i]));
+        size_t end_i = i;
+        size_t end_j = j;
+        auto same_kind = [numeric](char c) {
+            return numeric ? isdigit(static_cast<unsigned char>(c)) : isalpha(static_cast<unsigned char>(c));
+        };
+        while (end_i < a.size() && same_kind(a[end_i])) {
+            ++end_i;
+        }
+        while (end_j < b.size() && same_kind(b[end_j])) {
+            ++end_j;
+        }
+        if (end_j == j) {
+            return numeric ? 1 : -1; // Segments of different kinds
+        }
+
+        std::string_view segment_a(a.data() + i, end_i - i);
+        std::string_view segment_b(b.data() + j, end_j - j);
+        if (numeric) {
+            segment_a.remove_prefix(std::min(segment_a.find_first_not_of('0'), segment_a.size()));
+            segment_b.remove_prefix(std::min(segment_b.find_first_not_of('0'), segment_b.size()));
+            if (segment_a.size() != segment_b.size()) {
+                return segment_a.size() < segment_b.size() ? -1 : 1;
+            }
+        }
+        int result = segment_a.compare(segment_b);
+        if (result != 0) {
+            return result < 0 ? -1 : 1;
+        }
+        i = end_i;
+        j = end_j;
+    }
+
+    if (i == a.size() && j == b.size()) {
+        return 0;
+    }
+    // The version with a remaining alphabetic segment is older ("1.0alpha" < "1.0"), otherwise the longer one is newer
+    if ((i == a.size() && !isalpha(static_cast<unsigned char>(b[j]))) || (i < a.size() && isalpha(static_cast<unsigned char>(a[i])))) {
+        return -1;
+    }
+    return 1;
+}
+
+
+// Function to compare two package versions ([epoch:]pkgver[-pkgrel]) as pacman (vercmp) does.
+// It returns -1, 0 or 1. pkgrel is only compared when both versions have it.
+int compare_versions(const std::string& version_a, const std::string& version_b) {
+    auto split = [](const std::string& version, std::string* epoch, std::string* pkgver, std::string* pkgrel) {
+        size_t colon = version.find(':');
+        size_t start = 0;
+        *epoch = "0";
+        if (colon != std::string::npos && version.find_first_not_of("0123456789") == colon) {
+            *epoch = version.substr(0, colon);
+            start = colon + 1;
+        }
+        size_t dash = version.rfind('-');
+        if (dash != std::string::npos && dash >= start) {
+            *pkgver = version.substr(start, dash - start);
+            *pkgrel = version.substr(dash + 1);
+        } else {
+            *pkgver = version.substr(start);
+            pkgrel->clear();
+        }
+    };
+
+    if (version_a == version_b) {
+        return 0;
+    }
+    std::string epoch_a, pkgver_a, pkgrel_a;
+    std::string epoch_b, pkgver_b, pkgrel_b;
+    split(version_a, &epoch_a, &pkgver_a, &pkgrel_a);
+    split(version_b, &epoch_b, &pkgver_b, &pkgrel_b);
+
+    int result = compare_version_segments(epoch_a, epoch_b);
+    if (result == 0) {
+        result = compare_version_segments(pkgver_a, pkgver_b);
+    }
+    if (result == 0 && !pkgrel_a.empty() && !pkgrel_b.empty()) {
+        result = compare_version_segments(pkgrel_a, pkgrel_b);
+    }
+    return result;
+}
+
+
+// Function to check if a package satisfies a dependency ("name", "name>=1.0", ...), by its name or its provides.
+// A provide without version does not satisfy a versioned dependency, as in pacman.
+bool depend_satisfied_by(const std::string& depend, const PackageDesc& pkge) {
+    size_t pos = depend.find_first_of("<>=");
+    std::string name = depend.substr(0, pos);
+    std::string operation;
+    std::string version;
+    if (pos != std::string::npos) {
+        size_t version_pos = depend.find_first_not_of("<>=", pos);
+        operation = depend.substr(pos, version_pos - pos);
+        version = version_pos == std::string::npos ? "" : depend.substr(version_pos);
+    }
+
+    auto version_matches = [&](const std::string& candidate) {
+        if (operation.empty()) {
+            return true;
+        }
+        int result = compare_versions(candidate, version);
+        return (operation == "=" && result == 0) || (operation == ">=" && result >= 0) || (operation == "<=" && result <= 0)
+               || (operation == ">" && result > 0) || (operation == "<" && result < 0);
+    };
+
+    if (pkge.name == name && version_matches(pkge.version)) {
+        return true;
+    }
+    for (const auto& provide : pkge.provides) {
+        size_t equal = provide.find('=');
+        if (provide.substr(0, equal) != name) {
+            continue;
+        }
+        if (operation.empty() || (equal != std::string::npos && version_matches(provide.substr(equal + 1)))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// PacmanBackend: every operation is a pacman command built with pacman_command()
+
+std::string PacmanBackend::source() const {
+    return pacman_dbpath;
+}
+
+
+bool PacmanBackend::refresh() {
+    int exit_code;
+    command_exec(pacman_command({"-Sy"}, true), &exit_code);
+    return exit_code == 0;
+}
+
+
+StreamResult PacmanBackend::upgrade(const std::vector<std::string>& targets) {
+    std::vector<std::string> arguments = {sync_operation(targets.empty() ? "uv" : "v"), "--needed", "--noconfirm"};
+    for (const auto& argument : overwrite_arguments()) {
+        arguments.push_back(argument);
+    }
+    arguments.insert(arguments.end(), targets.begin(), targets.end());
+    return stream_exec(pacman_command(arguments, true), true);
+}
+
+
+// Prompts are answered yes, so conflicts pacman can solve by itself are solved by the probe
+StreamResult PacmanBackend::probe(const std::string& packageName) {
+    std::vector<std::string> arguments = {sync_operation("v")};
+    for (const auto& argument : overwrite_arguments()) {
+        arguments.push_back(argument);
+    }
+    arguments.push_back(packageName);
+    return stream_exec(pacman_command(arguments, true), true, true);
+}
+
+
+std::string PacmanBackend::remove(const std::vector<std::string>& packageNames, bool nodeps, int* exit_code) {
+    std::vector<std::string> arguments = {nodeps ? "-Rdd" : "-R", "--noconfirm"};
+    arguments.insert(arguments.end(), packageNames.begin(), packageNames.end());
+    return command_exec(pacman_command(arguments, true), exit_code);
+}
+
+
+std::string PacmanBackend::install(const std::vector<std::string>& packageNames, int* exit_code) {
+    std::vector<std::string> arguments = {sync_operation(""), "--noconfirm"};
+    for (const auto& argument : overwrite_arguments()) {
+        arguments.push_back(argument);
+    }
+    arguments.insert(arguments.end(), packageNames.begin(), packageNames.end());
+    return command_exec(pacman_command(arguments, true), exit_code);
+}
+
+
+std::string PacmanBackend::query_local(const std::string& packageName) {
+    return command_read(pacman_command({"-Qi", packageName}, false), true);
+}
+
+
+std::string PacmanBackend::query_sync(const std::string& packageName) {
+    return command_read(pacman_command({"-Si", packageName}, false), true);
+}
+
+
+// pacman adds and removes entries of the local directory on every transaction, its mtime is the generation
+std::string PacmanBackend::local_generation() {
+    std::error_code ec;
+    auto mtime = std::filesystem::last_write_time(pacman_dbpath + "/local", ec);
+    if (ec) {
+        return "";
+    }
+    return std::to_string(mtime.time_since_epoch().count());
+}
+
+
+std::string PacmanBackend::sync_generation() {
+    return sync_databases_generation(pacman_dbpath);
+}
+
+
+// Installed packages from <dbpath>/local/*/desc
+bool PacmanBackend::read_local(std::vector<PackageDesc>* pkges) {
+    std::error_code ec;
+
+    for (const auto& entry : std::filesystem::directory_iterator(pacman_dbpath + "/local", ec)) {
+        FILE *desc_file = fopen((entry.path() / "desc").c_str(), "r");
+        if (!desc_file) {
+            continue; // ALPM_DB_VERSION file or an incomplete entry
+        }
+        char data[8192];
+        std::string content;
+        size_t bytes_read;
+        while ((bytes_read = fread(data, 1, sizeof(data), desc_file)) > 0) {
+            content.append(data, bytes_read);
+        }
+        fclose(desc_file);
+        parse_desc_entries(content, pkges);
+    }
+    return !ec;
+}
+
+
+// Files of the installed packages from <dbpath>/local/<name>-<pkgver>-<pkgrel>/files.
+// The paths are relative to the root, directories end with a slash.
+bool PacmanBackend::read_local_files(std::vector<PackageFiles>* pkges) {
+    std::error_code ec;
+
+    for (const auto& entry : std::filesystem::directory_iterator(pacman_dbpath + "/local", ec)) {
+        std::ifstream files_file(entry.path() / "files");
+        if (!files_file) {
+            continue;
+        }
+        // The name is the directory name without "-pkgver-pkgrel", neither of them holds a dash
+        std::string name = entry.path().filename().string();
+        for (int i = 0; i < 2 && name.rfind('-') != std::string::npos; ++i) {
+            name.erase(name.rfind('-'));
+        }
+        PackageFiles pkge{name, {}};
+        bool in_files = false;
+        for (std::string line; std::getline(files_file, line); ) {
+            if (line.size() > 2 && line.front() == '%' && line.back() == '%') {
+                in_files = line == "%FILES%";
+            } else if (in_files && !line.empty() && line.back() != '/') {
+                pkge.files.push_back("/" + line);
+            }
+        }
+        pkges->push_back(std::move(pkge));
+    }
+    return !ec;
+}
+
+
+std::string PacmanBackend::preserve_archive(const PackageDesc& pkge, bool* rebuilt) {
+    std::string archive = find_cached_archive(pkge);
+    *rebuilt = archive.empty();
+    return archive.empty() ? rebuild_archive(pkge) : archive;
+}
+
+
+std::string PacmanBackend::install_archives(const std::vector<std::string>& archives, int* exit_code) {
+    std::vector<std::string> arguments = {"-U", "--noconfirm"};
+    for (const auto& argument : overwrite_arguments()) {
+        arguments.push_back(argument);
+    }
+    arguments.insert(arguments.end(), archives.begin(), archives.end());
+    return command_exec(pacman_command(arguments, true), exit_code);
+}
+
+
+// Downloads with pacman -Sw into the prefetch cache
+std::string PacmanBackend::prefetch(const std::vector<std::string>& packageNames, int* exit_code) {
+    return prefetch_with_pacman(packageNames, exit_code);
+}
+
+
+// Repository packages from <dbpath>/sync/*.db
+// The databases are tar archives compressed with gzip or zstd, bsdtar (libarchive, a pacman dependency)
+// extracts every desc file to stdout in a single call per repository.
+bool PacmanBackend::read_sync(std::vector<PackageDesc>* pkges, size_t* databases) {
+    std::vector<std::string> db_files;
+    std::error_code ec;
+
+    for (const auto& entry : std::filesystem::directory_iterator(pacman_dbpath + "/sync", ec)) {
+        if (entry.path().extension() == ".db") {
+            db_files.push_back(entry.path().string());
+        }
+    }
+    if (ec || db_files.empty()) {
+        printf("[SYNC DB NOT AVAILABLE] >> %s/sync. Using pacman -Si instead.\n", pacman_dbpath.c_str());
+        return false;
+    }
+    std::sort(db_files.begin(), db_files.end());
+
+    for (const auto& db_file : db_files) {
+        parse_desc_entries(command_read({"bsdtar", "-xOf", db_file}, false), pkges);
+    }
+    *databases = db_files.size();
+    return true;
+}
+
+
+// ScriptedBackend: a package universe replayed in-process
+
+// Function to load the package universe file
+bool ScriptedBackend::load(const std::string& filename) {
+    FILE *universe = fopen(filename.c_str(), "r");
+    if (!universe) {
+        return false;
+    }
+    char data[8192];
+    std::string content;
+    size_t bytes_read;
+    while ((bytes_read = fread(data, 1, sizeof(data), universe)) > 0) {
+        content.append(data, bytes_read);
+    }
+    fclose(universe);
+    return load_text(content, filename);
+}
+
+
+// Function to load a package universe from its text, named for messages
+bool ScriptedBackend::load_text(const std::string& content, const std::string& name) {
+    std::istringstream lines(content);
+    std::string line;
+    int line_number = 0;
+    while (std::getline(lines, line)) {
+        ++line_number;
+        std::istringstream fields(line);
+        std::string kind;
+        PackageDesc pkge;
+        std::vector<std::string> files;
+
+        if (!(fields >> kind) || kind[0] == '#') {
+            continue;
+        }
+        if (kind == "file") {
+            std::string path;
+            if (fields >> path) {
+                orphan_files.insert(path);
+            }
+            continue;
+        }
+        if (kind == "cached") {
+            if (fields >> pkge.name >> pkge.version) {
+                cached.insert(pkge.name + "-" + pkge.version);
+            }
+            continue;
+        }
+        if (kind == "corrupted") {
+            if (fields >> pkge.name) {
+                corrupted.insert(pkge.name);
+            }
+            continue;
+        }
+        if ((kind != "installed" && kind != "repo") || !(fields >> pkge.name >> pkge.version)) {
+            std::cerr << name << ":" << line_number << ": expected 'installed|repo <name> <version> [key=a,b]...'\n";
+            return false;
+        }
+
+        std::string field;
+        while (fields >> field) {
+            size_t equal = field.find('=');
+            std::string key = field.substr(0, equal);
+            std::vector<std::string>* values = key == "depends" ? &pkge.depends
+                                             : key == "provides" ? &pkge.provides
+                                             : key == "conflicts" ? &pkge.conflicts
+                                             : key == "replaces" ? &pkge.replaces
+                                             : key == "files" ? &files : nullptr;
+            if (equal == std::string::npos || !values) {
+                std::cerr << name << ":" << line_number << ": unknown field '" << field << "'\n";
+                return false;
+            }
+            std::istringstream list(field.substr(equal + 1));
+            std::string value;
+            while (std::getline(list, value, ',')) {
+                if (!value.empty()) {
+                    values->push_back(value);
+                }
+            }
+        }
+        pkge.arch = "any";
+
+        if (kind == "installed") {
+            install_package(pkge, files);
+        } else {
+            for (const auto& provide : pkge.provides) {
+                repo_provides[strip_version_constraint(provide)].insert(pkge.name);
+            }
+            std::string pkge_name = pkge.name;
+            repo[pkge_name] = std::move(pkge);
+            repo_files[pkge_name] = std::move(files);
+        }
+    }
+
+    universe_file = name;
+    return true;
+}
+
+
+std::string ScriptedBackend::source() const {
+    return universe_file;
+}
+
+
+bool ScriptedBackend::refresh() {
+    ++operations;
+    Output out;
+    out.emit(":: Synchronizing package databases...");
+    out.emit(" scripted is up to date");
+    return true;
+}
+
+
+StreamResult ScriptedBackend::upgrade(const std::vector<std::string>& targets) {
+    ++operations;
+    return transaction(targets, targets.empty(), true, false).result;
+}
+
+
+StreamResult ScriptedBackend::probe(const std::string& packageName) {
+    ++operations;
+    return transaction({packageName}, false, false, true).result;
+}
+
+
+// -Rdd removes the packages as they are, -R fails if an installed package left depends on them
+std::string ScriptedBackend::remove(const std::vector<std::string>& packageNames, bool nodeps, int* exit_code) {
+    ++operations;
+    Output out;
+    std::set<std::string> removing(packageNames.begin(), packageNames.end());
+
+    for (const auto& pkge : packageNames) {
+        if (installed.count(pkge) == 0) {
+            out.emit("error: target not found: " + pkge);
+            out.result.exit_code = 1;
+        }
+    }
+    if (out.result.exit_code == 0 && !nodeps) {
+        std::vector<std::string> broken;
+        for (const auto& [name, pkge] : installed) {
+            if (removing.count(name) > 0) {
+                continue;
+            }
+            for (const auto& depend : pkge.depends) {
+                std::string current = find_satisfier(installed, installed_provides, depend);
+                if (removing.count(current) > 0) {
+                    broken.push_back(":: removing " + current + " breaks dependency '" + depend + "' required by " + name);
+                }
+            }
+        }
+        if (!broken.empty()) {
+            out.emit("error: failed to prepare transaction (could not satisfy dependencies)");
+            for (const auto& line : broken) {
+                out.emit(line);
+            }
+            out.result.exit_code = 1;
+        }
+    }
+    if (out.result.exit_code == 0) {
+        for (const auto& pkge : packageNames) {
+            out.emit("removing " + pkge + "...");
+            uninstall_package(pkge);
+        }
+        ++changes;
+    }
+
+    if (exit_code) {
+        *exit_code = out.result.exit_code;
+    }
+    return out.text;
+}
+
+
+std::string ScriptedBackend::install(const std::vector<std::string>& packageNames, int* exit_code) {
+    ++operations;
+    Output out = transaction(packageNames, false, false, false);
+    if (exit_code) {
+        *exit_code = out.result.exit_code;
+    }
+    return out.text;
+}
+
+
+std::string ScriptedBackend::query_local(const std::string& packageName) {
+    ++operations;
+    std::string text; // Not echoed, the queries may run concurrently
+    auto pkge = installed.find(packageName);
+    if (pkge == installed.end()) {
+        text += "error: package '" + packageName + "' was not found\n";
+        return text;
+    }
+
+    std::string required_by;
+    for (const auto& [name, dependent] : installed) {
+        for (const auto& depend : dependent.depends) {
+            if (name != packageName && find_satisfier(installed, installed_provides, depend) == packageName) {
+                required_by += (required_by.empty() ? "" : "  ") + name;
+                break;
+            }
+        }
+    }
+    text += "Name            : " + packageName + "\n";
+    text += "Version         : " + pkge->second.version + "\n";
+    text += "Required By     : " + (required_by.empty() ? std::string("None") : required_by) + "\n";
+    return text;
+}
+
+
+std::string ScriptedBackend::query_sync(const std::string& packageName) {
+    ++operations;
+    std::string text; // Not echoed, the queries may run concurrently
+    auto pkge = repo.find(packageName);
+    if (pkge == repo.end()) {
+        text += "error: package '" + packageName + "' was not found\n";
+        return text;
+    }
+    text += "Repository      : scripted\n";
+    text += "Name            : " + packageName + "\n";
+    text += "Version         : " + pkge->second.version + "\n";
+    return text;
+}
+
+
+std::string ScriptedBackend::local_generation() {
+    return "scripted:" + std::to_string(changes);
+}
+
+
+std::string ScriptedBackend::sync_generation() {
+    return "scripted:" + universe_file;
+}
+
+
+bool ScriptedBackend::read_local(std::vector<PackageDesc>* pkges) {
+    for (const auto& [name, pkge] : installed) {
+        pkges->push_back(pkge);
+    }
+    return true;
+}
+
+
+bool ScriptedBackend::read_local_files(std::vector<PackageFiles>* pkges) {
+    for (const auto& [name, files] : installed_files) {
+        pkges->push_back({name, files});
+    }
+    return true;
+}
+
+
+// The archive keeps the installed package as it is. Archives of the "cached" lines are found in the package cache,
+// the others are rebuilt.
+std::string ScriptedBackend::preserve_archive(const PackageDesc& pkge, bool* rebuilt) {
+    auto current = installed.find(pkge.name);
+    if (current == installed.end() || current->second.version != pkge.version) {
+        return "";
+    }
+    std::string version = pkge.name + "-" + pkge.version;
+    *rebuilt = cached.count(version) == 0;
+    std::string archive = (*rebuilt ? archives_dir : std::string("/var/cache/pacman/pkg")) + "/" + version + "-any.pkg.tar.zst";
+    archives[archive] = {current->second, installed_files[pkge.name]};
+    return archive;
+}
+
+
+std::string ScriptedBackend::install_archives(const std::vector<std::string>& archive_files, int* exit_code) {
+    ++operations;
+    std::vector<const Archive*> archived;
+    for (const auto& file : archive_files) {
+        auto archive = archives.find(file);
+        if (archive == archives.end()) {
+            Output out;
+            out.emit("error: '" + file + "': could not find or read package");
+            *exit_code = 1;
+            return out.text;
+        }
+        archived.push_back(&archive->second);
+    }
+    Output out = transaction({}, false, false, false, archived);
+    *exit_code = out.result.exit_code;
+    return out.text;
+}
+
+
+// Only the repository is read, it does not change during a run
+std::string ScriptedBackend::prefetch(const std::vector<std::string>& packageNames, int* exit_code) {
+    ++operations;
+    std::string output;
+    *exit_code = 0;
+    for (const auto& pkge : packageNames) {
+        auto candidate = repo.find(pkge);
+        if (candidate == repo.end()) {
+            output += "error: target not found: " + pkge + "\n";
+            *exit_code = 1;
+        } else {
+            output += "downloading " + pkge + "-" + candidate->second.version + "-any.pkg.tar.zst...\n";
+        }
+    }
+    return output;
+}
+
+
+bool ScriptedBackend::read_sync(std::vector<PackageDesc>* pkges, size_t* databases) {
+    for (const auto& [name, pkge] : repo) {
+        pkges->push_back(pkge);
+    }
+    *databases = 1;
+    return true;
+}
+
+
+// Each line is echoed and classified as stream_exec does with pacman output
+void ScriptedBackend::Output::emit(const std::string& line) {
+    printf("%s\n", line.c_str());
+    auto classify_start = std::chrono::steady_clock::now();
+    classify_line(line, &result.events);
+    result.classify_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - classify_start).count();
+    result.bytes_read += line.size() + 1;
+    text += line + "\n";
+}
+
+
+// Function to run a sync transaction (-S) over the universe, as pacman would:
+// targets not found stop it, up to date targets are skipped (needed) or reinstalled, missing dependencies are pulled
+// from the repos, conflicts with installed packages are prompts (accepted only when accept_prompts, removing them)
+// and installed packages whose dependencies would be broken stop it. Nothing changes unless it succeeds.
+ScriptedBackend::Output ScriptedBackend::transaction(const std::vector<std::string>& targets, bool sysupgrade, bool needed, bool accept_prompts,
+                                                     const std::vector<const Archive*>& archived) {
+    Output out;
+    std::vector<std::string> adds; // Repository packages installed or upgraded, in transaction order
+    std::set<std::string> in_adds;
+    std::map<std::string, const Archive*> local_adds; // Packages installed from an archive (-U)
+    bool not_found = false;
+
+    auto add = [&](const std::string& name) {
+        if (in_adds.insert(name).second) {
+            adds.push_back(name);
+        }
+    };
+    auto desc_of = [&](const std::string& name) -> const PackageDesc& {
+        auto local = local_adds.find(name);
+        return local != local_adds.end() ? local->second->pkge : repo.at(name);
+    };
+    auto files_of = [&](const std::string& name) -> const std::vector<std::string>& {
+        auto local = local_adds.find(name);
+        return local != local_adds.end() ? local->second->files : repo_files[name];
+    };
+
+    if (!archived.empty()) {
+        out.emit("loading packages...");
+        for (const Archive* archive : archived) {
+            local_adds[archive->pkge.name] = archive;
+            add(archive->pkge.name);
+        }
+    }
+    auto fail = [&](const std::string& reason, const std::vector<std::string>& lines) {
+        out.emit("error: failed to prepare transaction (" + reason + ")");
+        for (const auto& line : lines) {
+            out.emit(line);
+        }
+        out.result.exit_code = 1;
+    };
+
+    if (sysupgrade) {
+        out.emit(":: Starting full system upgrade...");
+        for (const auto& [name, pkge] : installed) {
+            auto candidate = repo.find(name);
+            if (candidate != repo.end() && compare_versions(candidate->second.version, pkge.version) > 0) {
+                add(name);
+            }
+        }
+    }
+    for (const auto& target : targets) {
+        std::string name = find_satisfier(repo, repo_provides, target);
+        if (name.empty()) {
+            out.emit("error: target not found: " + target);
+            not_found = true;
+            continue;
+        }
+        auto current = installed.find(name);
+        if (current != installed.end() && compare_versions(current->second.version, repo.at(name).version) == 0) {
+            out.emit("warning: " + name + "-" + current->second.version + " is up to date -- " + (needed ? "skipping" : "reinstalling"));
+            if (needed) {
+                continue;
+            }
+        }
+        add(name);
+    }
+    if (not_found) {
+        out.result.exit_code = 1;
+        return out;
+    }
+    if (adds.empty()) {
+        out.emit(" there is nothing to do");
+        return out;
+    }
+
+    // Dependencies: kept installed if not upgraded, otherwise pulled from the repos
+    out.emit("resolving dependencies...");
+    std::vector<std::string> unsatisfied;
+    for (size_t i = 0; i < adds.size(); ++i) {
+        for (const auto& depend : desc_of(adds[i]).depends) {
+            std::string satisfier = find_satisfier(repo, repo_provides, depend);
+            if (!satisfier.empty() && in_adds.count(satisfier) > 0) {
+                continue;
+            }
+            std::string current = find_satisfier(installed, installed_provides, depend);
+            if (!current.empty() && in_adds.count(current) == 0) {
+                continue;
+            }
+            if (!satisfier.empty()) {
+                add(satisfier);
+                continue;
+            }
+            unsatisfied.push_back(":: unable to satisfy dependency '" + depend + "' required by " + adds[i]);
+        }
+    }
+    if (!unsatisfied.empty()) {
+        fail("could not satisfy dependencies", unsatisfied);
+        return out;
+    }
+
+    // Conflicts declared by the new packages, or by installed packages against them
+    out.emit("looking for conflicting packages...");
+    std::set<std::pair<std::string, std::string>> conflicts; // New package and installed package in conflict
+    for (const auto& name : adds) {
+        const PackageDesc& pkge = desc_of(name);
+        for (const auto& conflict : pkge.conflicts) {
+            std::string other = find_satisfier(installed, installed_provides, conflict);
+            if (!other.empty() && other != name && in_adds.count(other) == 0) {
+                conflicts.insert({name, other});
+            }
+        }
+        std::vector<std::string> provided = {name};
+        for (const auto& provide : pkge.provides) {
+            provided.push_back(strip_version_constraint(provide));
+        }
+        for (const auto& provide : provided) {
+            auto declaring = installed_conflicts.find(provide);
+            if (declaring == installed_conflicts.end()) {
+                continue;
+            }
+            for (const auto& other : declaring->second) {
+                if (other == name || in_adds.count(other) > 0) {
+                    continue;
+                }
+                for (const auto& conflict : installed.at(other).conflicts) {
+                    if (strip_version_constraint(conflict) == provide && depend_satisfied_by(conflict, pkge)) {
+                        conflicts.insert({name, other});
+                    }
+                }
+            }
+        }
+    }
+
+    std::set<std::string> removals; // Installed packages removed by accepted conflict prompts
+    for (const auto& [name, other] : conflicts) {
+        out.emit(":: " + name + " and " + other + " are in conflict. Remove " + other + "? [y/N] " + (accept_prompts ? "y" : ""));
+        if (accept_prompts) {
+            removals.insert(other);
+        }
+    }
+    if (!conflicts.empty() && !accept_prompts) {
+        std::vector<std::string> lines;
+        for (const auto& [name, other] : conflicts) {
+            lines.push_back(":: " + name + "-" + desc_of(name).version + " and " + other + "-" + installed.at(other).version + " are in conflict");
+        }
+        out.emit("error: unresolvable package conflicts detected");
+        fail("conflicting dependencies", lines);
+        return out;
+    }
+
+    // Installed packages left whose dependency is upgraded to a version not satisfying it, or removed.
+    // Only the packages depending on a name provided by a touched package are checked.
+    std::vector<std::string> touched(removals.begin(), removals.end());
+    for (const auto& name : adds) {
+        if (installed.count(name) > 0) {
+            touched.push_back(name);
+        }
+    }
+    std::set<std::string> checked;
+    std::vector<std::string> broken;
+    for (const auto& touched_name : touched) {
+        std::vector<std::string> provided = {touched_name};
+        for (const auto& provide : installed.at(touched_name).provides) {
+            provided.push_back(strip_version_constraint(provide));
+        }
+        for (const auto& provide : provided) {
+            auto dependents = installed_dependents.find(provide);
+            if (dependents == installed_dependents.end()) {
+                continue;
+            }
+            for (const auto& name : dependents->second) {
+                if (in_adds.count(name) > 0 || removals.count(name) > 0 || !checked.insert(name + "\n" + provide).second) {
+                    continue;
+                }
+                for (const auto& depend : installed.at(name).depends) {
+                    if (strip_version_constraint(depend) != provide) {
+                        continue;
+                    }
+                    std::string current = find_satisfier(installed, installed_provides, depend);
+                    if (current.empty() || (in_adds.count(current) == 0 && removals.count(current) == 0)) {
+                        continue;
+                    }
+                    std::string satisfier = find_satisfier(repo, repo_provides, depend);
+                    if (!satisfier.empty() && in_adds.count(satisfier) > 0) {
+                        continue;
+                    }
+                    if (removals.count(current) > 0) {
+                        broken.push_back(":: removing " + current + " breaks dependency '" + depend + "' required by " + name);
+                    } else {
+                        broken.push_back(":: installing " + current + " (" + desc_of(current).version + ") breaks dependency '" + depend + "' required by " + name);
+                    }
+                }
+            }
+        }
+    }
+    if (!broken.empty()) {
+        fail("could not satisfy dependencies", broken);
+        return out;
+    }
+
+    out.emit(":: Proceed with installation? [Y/n] ");
+
+    // Corrupted packages fail the whole transaction, as pacman checks every package before installing any
+    out.emit("checking package integrity...");
+    std::vector<std::string> invalid;
+    for (const auto& name : adds) {
+        if (corrupted.count(name) > 0) {
+            invalid.push_back("error: " + name + ": signature from \"Scripted Universe\" is invalid");
+        }
+    }
+    if (!invalid.empty()) {
+        for (const auto& line : invalid) {
+            out.emit(line);
+        }
+        out.emit("error: failed to commit transaction (invalid or corrupted package (PGP signature))");
+        out.emit("Errors occurred, no packages were upgraded.");
+        out.result.exit_code = 1;
+        return out;
+    }
+
+    // Files of the new packages already on disk, owned by a package the transaction leaves installed or by none
+    out.emit("checking for file conflicts...");
+    std::vector<std::string> file_conflicts;
+    for (const auto& name : adds) {
+        for (const auto& path : files_of(name)) {
+            auto owner = file_owners.find(path);
+            bool owned = owner != file_owners.end() && owner->second != name && in_adds.count(owner->second) == 0
+                         && removals.count(owner->second) == 0;
+            if ((owned || (owner == file_owners.end() && orphan_files.count(path) > 0)) && !overwrite_allowed(path)) {
+                file_conflicts.push_back(name + ": " + path + " exists in filesystem" + (owned ? " (owned by " + owner->second + ")" : ""));
+            }
+        }
+    }
+    if (!file_conflicts.empty()) {
+        out.emit("error: failed to commit transaction (conflicting files)");
+        for (const auto& line : file_conflicts) {
+            out.emit(line);
+        }
+        out.emit("Errors occurred, no packages were upgraded.");
+        out.result.exit_code = 1;
+        return out;
+    }
+
+    for (const auto& name : removals) {
+        out.emit("removing " + name + "...");
+        uninstall_package(name);
+    }
+    for (const auto& name : adds) {
+        auto current = installed.find(name);
+        bool same_version = current != installed.end() && current->second.version == desc_of(name).version;
+        out.emit((current == installed.end() ? "installing " : same_version ? "reinstalling " : "upgrading ") + name + "...");
+        install_package(desc_of(name), files_of(name));
+    }
+    ++changes;
+    return out;
+}
+
+
+// Function to find the package satisfying a dependency, by name first and then by provides
+std::string ScriptedBackend::find_satisfier(const std::map<std::string, PackageDesc>& pkges,
+                                            const std::unordered_map<std::string, std::set<std::string>>& provides,
+                                            const std::string& depend) const {
+    std::string name = strip_version_constraint(depend);
+    auto pkge = pkges.find(name);
+    if (pkge != pkges.end() && depend_satisfied_by(depend, pkge->second)) {
+        return name;
+    }
+    auto providers = provides.find(name);
+    if (providers != provides.end()) {
+        for (const auto& provider : providers->second) {
+            auto candidate = pkges.find(provider);
+            if (candidate != pkges.end() && depend_satisfied_by(depend, candidate->second)) {
+                return provider;
+            }
+        }
+    }
+    return "";
+}
+
+
+void ScriptedBackend::install_package(const PackageDesc& pkge, const std::vector<std::string>& files) {
+    uninstall_package(pkge.name);
+    for (const auto& path : files) {
+        file_owners[path] = pkge.name; // Overwritten files change owner
+        orphan_files.erase(path);
+    }
+    installed_files[pkge.name] = files;
+    for (const auto& provide : pkge.provides) {
+        installed_provides[strip_version_constraint(provide)].insert(pkge.name);
+    }
+    for (const auto& depend : pkge.depends) {
+        installed_dependents[strip_version_constraint(depend)].insert(pkge.name);
+    }
+    for (const auto& conflict : pkge.conflicts) {
+        installed_conflicts[strip_version_constraint(conflict)].insert(pkge.name);
+    }
+    installed[pkge.name] = pkge;
+}
+
+
+void ScriptedBackend::uninstall_package(const std::string& packageName) {
+    auto pkge = installed.find(packageName);
+    if (pkge == installed.end()) {
+        return;
+    }
+    for (const auto& provide : pkge->second.provides) {
+        installed_provides[strip_version_constraint(provide)].erase(packageName);
+    }
+    for (const auto& depend : pkge->second.depends) {
+        installed_dependents[strip_version_constraint(depend)].erase(packageName);
+    }
+    for (const auto& conflict : pkge->second.conflicts) {
+        installed_conflicts[strip_version_constraint(conflict)].erase(packageName);
+    }
+    for (const auto& path : installed_files[packageName]) {
+        auto owner = file_owners.find(path);
+        if (owner != file_owners.end() && owner->second == packageName) {
+            file_owners.erase(owner);
+        }
+    }
+    installed_files.erase(packageName);
+    installed.erase(pkge);
+}
+
+
+// Function to generate a synthetic package universe for the benchmark, in the --fake-universe format.
+// Every level holds a library whose new version replaces an obsolete package (it conflicts with it and provides it),
+// and a tool depending on the obsolete package: each level adds a conflict to resolve, a package replaced and a tool
+// removed with it and reinstalled after the upgrade. Libraries pin the exact version of the libraries they depend on,
+// so they are upgraded together:
+//   chain    levels in a line, each library depending on the one below
+//   diamond  levels of two libraries, each one depending on both libraries of the level below
+//   fanout   one library, every other package is a tool of its obsolete package
+//   cycle    one library, the tools are rings of 4 requiring each other, the first one of each ring the obsolete package
+// A level is 3 packages. The result is empty for an unknown shape.
+std::string generate_universe(const std::string& shape, int packages) {
+    std::string universe;
+    auto pkge = [&shape](const std::string& kind, int index) {
+        return shape + "-" + kind + std::to_string(index);
+    };
+    auto add_library = [&](int index, const std::vector<int>& depends) {
+        std::string installed_depends;
+        std::string repo_depends;
+        for (int depend : depends) {
+            installed_depends += (installed_depends.empty() ? "" : ",") + pkge("lib", depend) + "=1.0-1";
+            repo_depends += (repo_depends.empty() ? "" : ",") + pkge("lib", depend) + "=2.0-1";
+        }
+        std::string obsolete = pkge("old", index);
+        universe += "installed " + pkge("lib", index) + " 1.0-1" + (depends.empty() ? "" : " depends=" + installed_depends) + "\n";
+        universe += "repo " + pkge("lib", index) + " 2.0-1" + (depends.empty() ? "" : " depends=" + repo_depends)
+                    + " conflicts=" + obsolete + " provides=" + obsolete + "\n";
+        universe += "installed " + obsolete + " 1.0-1\n";
+    };
+    auto add_tool = [&](int index, const std::vector<std::string>& depends) {
+        std::string list;
+        for (const auto& depend : depends) {
+            list += (list.empty() ? "" : ",") + depend;
+        }
+        universe += "installed " + pkge("tool", index) + " 1.0-1 depends=" + list + "\n";
+        universe += "repo " + pkge("tool", index) + " 1.0-1 depends=" + list + "\n";
+    };
+
+    int levels = std::max(1, packages / 3);
+    if (shape == "chain") {
+        for (int i = 1; i <= levels; ++i) {
+            add_library(i, i > 1 ? std::vector<int>{i - 1} : std::vector<int>{});
+            add_tool(i, {pkge("old", i)});
+        }
+    } else if (shape == "diamond") {
+        for (int i = 1; i <= std::max(2, levels); ++i) {
+            int level_start = i - (i - 1) % 2; // First library of the level (2 libraries per level)
+            add_library(i, level_start > 1 ? std::vector<int>{level_start - 2, level_start - 1} : std::vector<int>{});
+            add_tool(i, {pkge("old", i)});
+        }
+    } else if (shape == "fanout") {
+        add_library(1, {});
+        for (int i = 1; i <= std::max(1, packages - 2); ++i) {
+            add_tool(i, {pkge("old", 1)});
+        }
+    } else if (shape == "cycle") {
+        add_library(1, {});
+        for (int ring = 0; ring + 4 <= std::max(4, packages - 2); ring += 4) {
+            for (int i = 0; i < 4; ++i) {
+                std::vector<std::string> depends = {pkge("tool", ring + (i + 1) % 4 + 1)};
+                if (i == 0) {
+                    depends.push_back(pkge("old", 1));
+                }
+                add_tool(ring + i + 1, depends);
+            }
+        }
+    }
+    return universe;
+}
+
+
+// Function to benchmark the resolver on synthetic package universes.
+// Every scenario runs the whole main loop against the scripted backend in a child process, so each one starts
+// from a clean state and its peak RSS is its own. One JSON object per scenario is printed on stdout:
+// pacman_calls are the backend operations that would each have been a pacman process.
+int run_resolver_benchmark(const std::vector<std::string>& shapes, const std::vector<int>& sizes) {
+    const unsigned int timeout_seconds = 600; // A scenario not finishing in time is reported as such
+    int failed = 0;
+
+    for (const auto& shape : shapes) {
+        for (int size : sizes) {
+            std::string universe = generate_universe(shape, size);
+            if (universe.empty()) {
+                std::cerr << "Unknown universe shape: " << shape << " (chain, diamond, fanout, cycle)\n";
+                return EXIT_FAILURE;
+            }
+
+            int result_fds[2];
+            if (pipe(result_fds) == -1) {
+                std::cerr << "Failed to run the benchmark\n";
+                return EXIT_FAILURE;
+            }
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == -1) {
+                std::cerr << "Failed to run the benchmark\n";
+                return EXIT_FAILURE;
+            }
+            if (pid == 0) {
+                // The resolver output is not part of the result
+                close(result_fds[0]);
+                int null_fd = open("/dev/null", O_WRONLY);
+                dup2(null_fd, STDOUT_FILENO);
+                close(null_fd);
+                alarm(timeout_seconds);
+
+                auto scripted = std::make_unique<ScriptedBackend>();
+                scripted->load_text(universe, shape + "-" + std::to_string(size));
+                ScriptedBackend* counters = scripted.get();
+                backend = std::move(scripted);
+
+#ifdef FC_COUNT_ALLOCS
+                unsigned long allocations_before = stats_allocations.load();
+#endif
+                auto start = std::chrono::steady_clock::now();
+                refresh_sync_databases();
+                ProceedureStatus status = run_fix_loop();
+                int exit_code = fix_exit_code(status); // What run_fix would exit with
+                double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+#ifdef FC_COUNT_ALLOCS
+                std::string allocations = std::to_string(stats_allocations.load() - allocations_before);
+#else
+                std::string allocations = "null"; // Not counted without -DFC_COUNT_ALLOCS
+#endif
+
+                char result[1024];
+                int length = snprintf(result, sizeof(result),
+                    "{\"shape\":\"%s\",\"packages\":%d,\"status\":\"%s\",\"cycles\":%d,\"pacman_calls\":%lu,"
+                    "\"pacman_runs\":%d,\"pacman_runs_avoided\":%d,\"full_checks\":%d,\"targeted_checks\":%d,"
+                    "\"removal_transactions\":%d,\"reinstall_transactions\":%d,\"packages_removed\":%d,\"removed_not_reinstalled\":%zu,"
+                    "\"reinstall_failed\":%zu,\"unsatisfied_removed\":%zu,\"elapsed_ms\":%.3f,\"allocations\":%s",
+                    shape.c_str(), size, exit_code == 0 ? "ok" : exit_code == 2 ? "incomplete" : "error", stats_cycles, counters->operations.load(),
+                    stats_pacman_runs, stats_pacman_runs_avoided, stats_full_checks, stats_targeted_checks,
+                    stats_removal_transactions, stats_reinstall_transactions, stats_packages_removed, log_removed_not_reinstalled.size(),
+                    log_reinstall_failed.size(), log_dependency_unsatisfy_removed.size(), elapsed_ms, allocations.c_str());
+                ssize_t written = write(result_fds[1], result, std::min<size_t>(length, sizeof(result) - 1));
+                _exit(written > 0 ? 0 : EXIT_FAILURE);
+            }
+            close(result_fds[1]);
+
+            std::string result;
+            char data[1024];
+            ssize_t bytes_read;
+            while ((bytes_read = read(result_fds[0], data, sizeof(data))) != 0) {
+                if (bytes_read == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    break;
+                }
+                result.append(data, bytes_read);
+            }
+            close(result_fds[0]);
+
+            int child_status;
+            struct rusage usage;
+            while (wait4(pid, &child_status, 0, &usage) == -1 && errno == EINTR) {
+            }
+
+            if (result.empty()) {
+                const char* reason = WIFSIGNALED(child_status) && WTERMSIG(child_status) == SIGALRM ? "timeout" : "crashed";
+                result = "{\"shape\":\"" + shape + "\",\"packages\":" + std::to_string(size) + ",\"status\":\"" + reason + "\"";
+                ++failed;
+            } else if (result.find("\"status\":\"ok\"") == std::string::npos) {
+                ++failed;
+            }
+            printf("%s,\"peak_rss_kb\":%ld}\n", result.c_str(), usage.ru_maxrss);
+            fflush(stdout);
+        }
+    }
+    return failed == 0 ? 0 : EXIT_FAILURE;
+}
+
+
+TraceScope::TraceScope(const std::string& category, const std::string& name) {
+    start = std::chrono::steady_clock::now();
+    cpu_start_us = stats_child_cpu_us.load();
+    span = trace_spans.size();
+    trace_spans.push_back({category, name, std::chrono::duration<double, std::micro>(start - trace_epoch).count(), 0, 0, 0, 0, trace_worklist_depth});
+}
+
+
+TraceScope::~TraceScope() {
+    if (!ended) {
+        end(0, 0);
+    }
+}
+
+
+void TraceScope::end(int exit_code, size_t bytes, double classify_seconds) {
+    TraceSpan& trace_span = trace_spans[span];
+    trace_span.duration_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    trace_span.exit_code = exit_code;
+    trace_span.bytes = bytes;
+    trace_span.classify_us = classify_seconds * 1e6;
+    trace_span.cpu_us = stats_child_cpu_us.load() - cpu_start_us;
+    ended = true;
+}
+
+
+// Totals of the spans of one operation
+struct TraceTotals {
+    int count = 0;
+    int failed = 0;
+    double total_us = 0;
+    double max_us = 0;
+    double classify_us = 0;
+    double cpu_us = 0;
+    size_t bytes = 0;
+};
+
+
+// Function to add up the spans per operation, in the order operations were first seen
+static std::vector<std::pair<std::string, TraceTotals>> trace_totals() {
+    std::vector<std::pair<std::string, TraceTotals>> totals;
+    std::unordered_map<std::string, size_t> position;
+
+    for (const auto& trace_span : trace_spans) {
+        auto found = position.find(trace_span.category);
+        if (found == position.end()) {
+            found = position.emplace(trace_span.category, totals.size()).first;
+            totals.push_back({trace_span.category, TraceTotals()});
+        }
+        TraceTotals& total = totals[found->second].second;
+        ++total.count;
+        total.failed += trace_span.exit_code != 0;
+        total.total_us += trace_span.duration_us;
+        total.max_us = std::max(total.max_us, trace_span.duration_us);
+        total.classify_us += trace_span.classify_us;
+        total.cpu_us += trace_span.cpu_us;
+        total.bytes += trace_span.bytes;
+    }
+    return totals;
+}
+
+
+// Function to print the time spent per operation (count, total, mean and max wall time, failures, output read)
+void print_trace_summary() {
+    double classify_us = 0;
+
+    printf("\n[TRACE SUMMARY]\n");
+    printf("  %-18s %7s %10s %10s %10s %7s %12s %9s\n", "operation", "count", "total s", "mean ms", "max ms", "failed", "bytes", "cpu s");
+    for (const auto& [category, total] : trace_totals()) {
+        printf("  %-18s %7d %10.3f %10.3f %10.3f %7d %12zu %9.3f\n", category.c_str(), total.count, total.total_us / 1e6,
+               total.total_us / 1e3 / total.count, total.max_us / 1e3, total.failed, total.bytes, total.cpu_us / 1e6);
+        classify_us += total.classify_us;
+    }
+    printf("  %-18s %7s %10.3f\n", "(classifier)", "", classify_us / 1e6);
+    if (stats_child_max_rss_kb > 0 || stats_command_timeouts > 0) {
+        printf("  commands: peak memory %.1f MiB, %d killed on timeout\n", stats_child_max_rss_kb / 1024.0, stats_command_timeouts.load());
+    }
+}
+
+
+// Function to escape a string for JSON. Control characters are escaped, not dropped, so the value reads back the same.
+static std::string json_escape(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else if (c == '\t') {
+            escaped += "\\t";
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned char>(c));
+            escaped += code;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+
+// Function to export the spans as a Chrome trace-event JSON file (chrome://tracing, Perfetto).
+// Every span is a complete event ("ph":"X") with its exit code, output bytes, classifier time and worklist depth.
+bool write_trace_file(const std::string& filename) {
+    FILE *trace = fopen(filename.c_str(), "w");
+    if (!trace) {
+        std::cerr << "Failed to create trace file: " << filename << "\n";
+        return false;
+    }
+
+    fprintf(trace, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (size_t i = 0; i < trace_spans.size(); ++i) {
+        const TraceSpan& trace_span = trace_spans[i];
+        fprintf(trace, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.1f,\"dur\":%.1f,\"pid\":%d,\"tid\":1,"
+                       "\"args\":{\"exit_code\":%d,\"bytes\":%zu,\"classify_us\":%.1f,\"cpu_us\":%.1f,\"depth\":%d}}%s\n",
+                json_escape(trace_span.name).c_str(), json_escape(trace_span.category).c_str(), trace_span.start_us,
+                trace_span.duration_us, static_cast<int>(getpid()), trace_span.exit_code, trace_span.bytes,
+                trace_span.classify_us, trace_span.cpu_us, trace_span.depth, i + 1 < trace_spans.size() ? "," : "");
+    }
+    fprintf(trace, "]}\n");
+    fclose(trace);
+    return true;
+}
+
+
+// Function to export the counters in the Prometheus textfile format (node_exporter textfile collector).
+// The file is written aside and renamed, so the collector never reads a partial file.
+bool write_metrics_file(const std::string& filename) {
+    std::string temporary = filename + ".tmp";
+    FILE *metrics = fopen(temporary.c_str(), "w");
+    if (!metrics) {
+        std::cerr << "Failed to create metrics file: " << filename << "\n";
+        return false;
+    }
+
+    auto totals = trace_totals();
+    auto per_operation = [&](const char* metric, const char* help, auto value) {
+        fprintf(metrics, "# HELP %s %s\n# TYPE %s counter\n", metric, help, metric);
+        for (const auto& [category, total] : totals) {
+            fprintf(metrics, "%s{operation=\"%s\"} %s\n", metric, category.c_str(), value(total).c_str());
+        }
+    };
+    auto counter = [&](const char* metric, const char* help, const char* type, double value) {
+        fprintf(metrics, "# HELP %s %s\n# TYPE %s %s\n%s %.6g\n", metric, help, metric, type, metric, value);
+    };
+
+    per_operation("fixconflicts_operations_total", "Package manager operations run, by operation.",
+                  [](const TraceTotals& total) { return std::to_string(total.count); });
+    per_operation("fixconflicts_operation_seconds_total", "Wall time spent in package manager operations, by operation.",
+                  [](const TraceTotals& total) { return std::to_string(total.total_us / 1e6); });
+    per_operation("fixconflicts_operation_failures_total", "Operations exiting with a non-zero code, by operation.",
+                  [](const TraceTotals& total) { return std::to_string(total.failed); });
+    per_operation("fixconflicts_operation_output_bytes_total", "Output bytes read from operations, by operation.",
+                  [](const TraceTotals& total) { return std::to_string(total.bytes); });
+
+    double classify_us = 0;
+    for (const auto& [category, total] : totals) {
+        classify_us += total.classify_us;
+    }
+    counter("fixconflicts_classifier_seconds_total", "Time spent classifying package manager output.", "counter", classify_us / 1e6);
+    counter("fixconflicts_command_cpu_seconds_total", "CPU time of the commands run.", "counter", stats_child_cpu_us / 1e6);
+    counter("fixconflicts_command_max_rss_bytes", "Peak resident memory of the largest command run.", "gauge", stats_child_max_rss_kb * 1024.0);
+    counter("fixconflicts_command_timeouts_total", "Commands killed on timeout.", "counter", stats_command_timeouts);
+    counter("fixconflicts_pacman_runs_total", "Upgrades and probes run by the resolver.", "counter", stats_pacman_runs);
+    counter("fixconflicts_pacman_runs_avoided_total", "Probes skipped as the package state had not changed.", "counter", stats_pacman_runs_avoided);
+    counter("fixconflicts_removal_transactions_total", "Removal transactions run.", "counter", stats_removal_transactions);
+    counter("fixconflicts_reinstall_transactions_total", "Reinstall transactions run.", "counter", stats_reinstall_transactions);
+    counter("fixconflicts_reinstall_bisections_total", "Failed reinstall batches split to isolate the packages failing.", "counter", stats_reinstall_bisections);
+    counter("fixconflicts_reinstall_failed_total", "Packages that failed to reinstall alone.", "counter", stats_reinstall_failed);
+    counter("fixconflicts_main_loop_cycles_total", "Cycles of the main loop.", "counter", stats_cycles);
+    counter("fixconflicts_packages_removed_total", "Packages removed.", "counter", stats_packages_removed);
+    counter("fixconflicts_solver_plans_total", "Removal plans applied by the global solver.", "counter", stats_solver_plans);
+    counter("fixconflicts_archives_rebuilt_total", "Archives of removed packages rebuilt from their files.", "counter", stats_archives_rebuilt);
+    counter("fixconflicts_archives_reinstalled_total", "Packages reinstalled from their archive.", "counter", stats_archives_reinstalled);
+    counter("fixconflicts_recipes_replayed_total", "Recorded resolutions replayed.", "counter", stats_recipes_replayed);
+    counter("fixconflicts_prefetch_packages_total", "Packages downloaded in the background.", "counter", stats_prefetch_packages);
+    counter("fixconflicts_prefetch_seconds_total", "Time spent downloading in the background.", "counter", stats_prefetch_seconds);
+    counter("fixconflicts_prefetch_wait_seconds_total", "Time the transactions waited for the background downloads.", "counter", stats_prefetch_wait_seconds);
+    counter("fixconflicts_packages_removed_not_reinstalled", "Packages removed and not reinstalled (not in the repositories, or their reinstall failed).", "gauge",
+            log_removed_not_reinstalled.size());
+    counter("fixconflicts_last_run_timestamp_seconds", "Time the run finished.", "gauge",
+            std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count());
+    fclose(metrics);
+
+    if (rename(temporary.c_str(), filename.c_str()) != 0) {
+        std::cerr << "Failed to create metrics file: " << filename << "\n";
+        return false;
+    }
+    return true;
+}
+
+
+// Function to write the --trace and --metrics files. Registered with atexit, so a run failing halfway is traced too.
+void write_trace_outputs() {
+    if (!trace_file.empty() && write_trace_file(trace_file)) {
+        printf("[TRACE FILE WRITTEN] >> %s\n", trace_file.c_str());
+    }
+    if (!metrics_file.empty() && write_metrics_file(metrics_file)) {
+        printf("[METRICS FILE WRITTEN] >> %s\n", metrics_file.c_str());
+    }
+}
+
+
+// Function to open the journal. A journal holding an unfinished run is only continued with --resume,
+// starting over would forget the packages it removed. Otherwise it is truncated for the new run.
+bool journal_open(bool resume) {
+    std::vector<std::string> records;
+    std::ifstream journal_in(journal_file);
+    for (std::string line; std::getline(journal_in, line); ) {
+        if (!line.empty()) {
+            records.push_back(line);
+        }
+    }
+    bool unfinished = !records.empty() && records.back() != "finished";
+
+    if (unfinished && !resume) {
+        printf("\n[JOURNAL] >> %s holds an unfinished run. Continue it with --resume, or delete it to start over.\n\n",
+               journal_file.c_str());
+        return false;
+    }
+
+    int flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (unfinished ? 0 : O_TRUNC);
+    journal_fd = open(journal_file.c_str(), flags, 0644);
+    if (journal_fd < 0) {
+        std::cerr << "Failed to open the journal: " << journal_file << "\n";
+        return false;
+    }
+
+    if (unfinished) {
+        journal_replay(records);
+    } else if (resume) {
+        printf("\n[RESUME] >> No unfinished run in %s, starting a new one.\n\n", journal_file.c_str());
+    }
+    journal_append({"run\t" + std::to_string(std::time(nullptr)) + "\t" + std::to_string(getpid())});
+    return true;
+}
+
+
+// Function to restore the state of an unfinished run from its journal records:
+// the packages removed and not reinstalled yet, the packages found resolved and the issues found.
+// Every package it touched is re-checked first, so no full rediscovery is needed.
+// A removal planned without its commit record may or may not have happened, the local database tells.
+void journal_replay(const std::vector<std::string>& records) {
+    std::set<std::string> planned;
+    std::set<std::string> removed;
+    size_t issues = 0;
+    int runs = 0;
+
+    for (const auto& record : records) {
+        std::vector<std::string> fields;
+        std::istringstream iss(record);
+        for (std::string field; std::getline(iss, field, '\t'); ) {
+            fields.push_back(field);
+        }
+        const std::string& kind = fields[0];
+
+        if (kind == "run") {
+            ++runs;
+        } else if (fields.size() < 2) {
+            continue;
+        } else if (kind == "planned") {
+            planned.insert(fields[1]);
+            pkge_resolved.erase(fields[1]);
+        } else if (kind == "removed") {
+            planned.erase(fields[1]);
+            removed.insert(fields[1]);
+        } else if (kind == "reinstalled") {
+            removed.erase(fields[1]);
+            log_package(log_removed_reinstalled, "removed_reinstalled", fields[1]);
+        } else if (kind == "not_reinstalled") {
+            removed.erase(fields[1]);
+            log_package(log_removed_not_reinstalled, "removed_not_reinstalled", fields[1]);
+        } else if (kind == "reinstall_failed") {
+            log_package(log_reinstall_failed, "reinstall_failed", fields[1]);
+        } else if (kind == "not_in_repos") {
+            log_package(log_not_found_in_repos, "not_found_in_repos", fields[1]);
+        } else if (kind == "unsatisfied_removed") {
+            removed.erase(fields[1]);
+            log_package(log_dependency_unsatisfy_removed, "dependency_unsatisfy_removed", fields[1]);
+        } else if (kind == "resolved") {
+            pkge_resolved.insert(fields[1]);
+        } else if (kind == "archive" && fields.size() > 2) {
+            preserved_archives[fields[1]] = fields[2];
+        } else if ((kind == "conflict" || kind == "required_by") && fields.size() > 2) {
+            bool conflict = kind == "conflict";
+            log_package(conflict ? log_conflicts_resolved : log_requiredby_resolved, conflict ? "conflict_resolved" : "requiredby_resolved", fields[1]);
+            log_package(conflict ? log_conflicts_resolved : log_requiredby_resolved, conflict ? "conflict_resolved" : "requiredby_resolved", fields[2]);
+            mark_dirty(fields[1]);
+            mark_dirty(fields[2]);
+            ++issues;
+        }
+    }
+
+    // Removals interrupted before their commit record
+    if (!planned.empty()) {
+        std::vector<std::string> unconfirmed(planned.begin(), planned.end());
+        std::vector<bool> still_installed(unconfirmed.size());
+        if (ensure_local_database()) {
+            for (size_t i = 0; i < unconfirmed.size(); ++i) {
+                still_installed[i] = local_pkges_index.count(unconfirmed[i]) > 0;
+            }
+        } else {
+            std::vector<std::string> infos = query_packages(unconfirmed, false);
+            for (size_t i = 0; i < unconfirmed.size(); ++i) {
+                still_installed[i] = !has_event(classify_output(infos[i]), IssueType::PACKAGE_NOT_FOUND);
+            }
+        }
+        std::vector<std::string> removed_records;
+        for (size_t i = 0; i < unconfirmed.size(); ++i) {
+            mark_dirty(unconfirmed[i]);
+            if (!still_installed[i]) {
+                removed.insert(unconfirmed[i]);
+                removed_records.push_back("removed\t" + unconfirmed[i]);
+            }
+        }
+        journal_append(removed_records);
+    }
+
+    removed_pkges.clear();
+    for (const auto& pkge : removed) {
+        removed_pkges.insert(pkge);
+        mark_dirty(pkge);
+    }
+
+    printf("\n[RESUME] >> Continuing the run recorded in %s (%d run(s)): %zu issue(s) found, %zu package(s) resolved, "
+           "%zu package(s) removed and not reinstalled yet\n", journal_file.c_str(), runs, issues, pkge_resolved.size(), removed_pkges.size());
+    for (const auto& pkge : removed_pkges) {
+        printf("  - %s\n", pkge.c_str());
+    }
+    printf("\n");
+}
+
+
+// Function to append records to the journal and sync them to disk.
+// A record is a line of tab separated fields, its kind first.
+void journal_append(const std::vector<std::string>& records) {
+    if (journal_fd < 0 || records.empty()) {
+        return;
+    }
+
+    std::string data;
+    for (const auto& record : records) {
+        data += record + "\n";
+    }
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t bytes = write(journal_fd, data.data() + written, data.size() - written);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Failed to write the journal: " << journal_file << "\n";
+            return;
+        }
+        written += bytes;
+    }
+    fsync(journal_fd);
+}
+
+
+// Function to create the event log of this run. The name holds the date, time and pid, so it is unique
+// without looking for the previous logs; O_EXCL makes sure an existing file is never reused.
+bool open_event_log() {
+    char date[32];
+    std::time_t now = std::time(nullptr);
+    std::tm local_time;
+    localtime_r(&now, &local_time);
+    strftime(date, sizeof(date), "%Y%m%d-%H%M%S", &local_time);
+
+    event_log_name = std::string("fixConflicts_") + date + "_" + std::to_string(getpid()) + ".jsonl";
+    event_log_fd = open(event_log_name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+    if (event_log_fd < 0) {
+        std::cerr << "Failed to create log file: " << event_log_name << "\n";
+        return false;
+    }
+    return true;
+}
+
+
+// Function to append an event to the event log: one JSON object per line with its UTC timestamp,
+// the event and one key/value pair. Each line is a single write, appended as a whole.
+void log_event(const std::string& event, const std::string& key, const std::string& value) {
+    if (event_log_fd < 0) {
+        return;
+    }
+
+    auto now = std::chrono::system_clock::now();
+    std::time_t seconds = std::chrono::system_clock::to_time_t(now);
+    long millis = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() % 1000;
+    std::tm utc_time;
+    gmtime_r(&seconds, &utc_time);
+    char timestamp[40];
+    size_t length = strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &utc_time);
+    snprintf(timestamp + length, sizeof(timestamp) - length, ".%03ldZ", millis);
+
+    std::string line = std::string("{\"ts\":\"") + timestamp + "\",\"event\":\"" + json_escape(event) + "\",\""
+                     + json_escape(key) + "\":\"" + json_escape(value) + "\"}\n";
+    if (write(event_log_fd, line.data(), line.size()) < 0) {
+        std::cerr << "Failed to write log file: " << event_log_name << "\n";
+    }
+}
+
+
+// Function to log a package in its log set and, the first time only, in the event log
+void log_package(PackageSet& log_set, const std::string& event, const std::string& package) {
+    if (log_set.insert(package)) {
+        log_event(event, "package", package);
+    }
+}
+
+
+// Function to get a string field of a JSON line written by log_event
+static std::string json_string_field(const std::string& line, const std::string& key) {
+    std::string marker = "\"" + key + "\":\"";
+    size_t pos = line.find(marker);
+    if (pos == std::string::npos) {
+        return "";
+    }
+
+    std::string value;
+    for (pos += marker.size(); pos < line.size() && line[pos] != '"'; ++pos) {
+        if (line[pos] != '\\' || pos + 1 >= line.size()) {
+            value += line[pos];
+            continue;
+        }
+        char escaped = line[++pos];
+        if (escaped == 'n') {
+            value += '\n';
+        } else if (escaped == 't') {
+            value += '\t';
+        } else if (escaped == 'u') {
+            // Four hex digits, read by hand: a truncated or malformed escape is skipped, it does not stop the reader
+            int code = 0;
+            int digits = 0;
+            for (; digits < 4 && pos + 1 + digits < line.size() && std::isxdigit(static_cast<unsigned char>(line[pos + 1 + digits])); ++digits) {
+                char digit = line[pos + 1 + digits];
+                code = code * 16 + (std::isdigit(static_cast<unsigned char>(digit)) ? digit - '0' : std::tolower(digit) - 'a' + 10);
+            }
+            if (digits == 4) {
+                value += static_cast<char>(code);
+                pos += 4;
+            }
+        } else {
+            value += escaped;
+        }
+    }
+    return value;
+}
+
+
+// Function to render the summary of an event log, as the log file was written before:
+// the packages of every section, sorted, and the time the run started.
+bool render_event_log(const std::string& filename, FILE* out) {
+    std::ifstream events(filename);
+    if (!events) {
+        std::cerr << "Failed to read log file: " << filename << "\n";
+        return false;
+    }
+
+    const std::vector<std::pair<std::string, std::string>> sections = {
+        {"removed_reinstalled", "PACKAGES REMOVED AND REINSTALLED"},
+        {"removed_not_reinstalled", "PACKAGES REMOVED BUT NOT REINSTALLED"},
+        {"reinstall_failed", "PACKAGES WHOSE REINSTALL FAILED"},
+        {"conflict_resolved", "PACKAGES IN CONFLICT AND RESOLVED"},
+        {"requiredby_resolved", "PACKAGES REQUIRED-BY AND RESOLVED"},
+        {"not_found_in_repos", "PACKAGES NOT FOUND IN REPOS"},
+        {"dependency_unsatisfy_removed", "DEPENDENCIES UNSATISFIED AS NOT FOUND IN REPOS"},
+    };
+    std::unordered_map<std::string, std::set<std::string>> pkges_per_event;
+    std::string started;
+    for (std::string line; std::getline(events, line); ) {
+        std::string event = json_string_field(line, "event");
+        if (event == "run_started" && started.empty()) {
+            started = json_string_field(line, "ts");
+        } else if (line.find("\"package\":") != std::string::npos) {
+            pkges_per_event[event].insert(json_string_field(line, "package"));
+        }
+    }
+
+    fprintf(out, "=== Package Conflict Resolution Log ===\n");
+    fprintf(out, "Date: %s\n\n", started.empty() ? "(unknown)" : started.c_str());
+    for (const auto& [event, title] : sections) {
+        fprintf(out, "[%s]\n", title.c_str());
+        const std::set<std::string>& pkges = pkges_per_event[event];
+        if (pkges.empty()) {
+            fprintf(out, "  (none)\n");
+        }
+        for (const auto& pkg : pkges) {
+            fprintf(out, "  - %s\n", pkg.c_str());
+        }
+        fprintf(out, "\n");
+    }
+    fprintf(out, "=== End of Log ===\n");
+    return true;
+}
+
+
+// Function to get the id of a package name, giving it the next id the first time it is seen
+PackageId intern_package(const std::string& packageName) {
+    auto [entry, added] = package_ids.try_emplace(packageName, static_cast<PackageId>(package_names.size()));
+    if (added) {
+        package_names.push_back(packageName);
+    }
+    return entry->second;
+}
+
+
+bool PackageSet::insert(const std::string& packageName) {
+    PackageId id = intern_package(packageName);
+    if (id / 64 >= words.size()) {
+        words.resize(id / 64 + 1, 0);
+    }
+    uint64_t bit = uint64_t(1) << (id % 64);
+    if (words[id / 64] & bit) {
+        return false;
+    }
+    words[id / 64] |= bit;
+    ++members;
+    return true;
+}
+
+
+bool PackageSet::erase(const std::string& packageName) {
+    auto entry = package_ids.find(packageName);
+    if (entry == package_ids.end() || entry->second / 64 >= words.size()) {
+        return false;
+    }
+    PackageId id = entry->second;
+    uint64_t bit = uint64_t(1) << (id % 64);
+    if (!(words[id / 64] & bit)) {
+        return false;
+    }
+    words[id / 64] &= ~bit;
+    --members;
+    return true;
+}
+
+
+size_t PackageSet::count(const std::string& packageName) const {
+    auto entry = package_ids.find(packageName);
+    if (entry == package_ids.end() || entry->second / 64 >= words.size()) {
+        return 0;
+    }
+    return (words[entry->second / 64] >> (entry->second % 64)) & 1;
+}
+
+
+void PackageSet::clear() {
+    std::fill(words.begin(), words.end(), 0);
+    members = 0;
+}
+
+
+size_t PackageSet::next_id(size_t from) const {
+    for (size_t word = from / 64; word < words.size(); ++word) {
+        uint64_t bits = words[word];
+        if (word == from / 64) {
+            bits &= ~uint64_t(0) << (from % 64);
+        }
+        if (bits) {
+            return word * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return words.size() * 64;
+}
+
+
+#ifdef WITH_ALPM
+AlpmBackend::~AlpmBackend() {
+    if (handle) {
+        alpm_release(handle);
+    }
+}
+
+
+// Function to initialize libalpm as pacman does: root, database path, log file, GnuPG and hook
+// directories under the root, then the options and repositories of pacman.conf (Include files too).
+bool AlpmBackend::open() {
+    std::string root = pacman_root.empty() ? "/" : pacman_root;
+    std::string prefix = root == "/" ? "" : root;
+    alpm_errno_t err;
+    handle = alpm_initialize(root.c_str(), pacman_dbpath.c_str(), &err);
+    if (!handle) {
+        std::cerr << "Failed to initialize libalpm: " << alpm_strerror(err) << "\n";
+        return false;
+    }
+    alpm_option_set_questioncb(handle, &AlpmBackend::answer_question, this);
+    alpm_option_set_logfile(handle, (prefix + "/var/log/pacman.log").c_str());
+    alpm_option_set_gpgdir(handle, (prefix + "/etc/pacman.d/gnupg/").c_str());
+    alpm_option_add_hookdir(handle, (prefix + "/usr/share/libalpm/hooks/").c_str());
+    alpm_option_add_hookdir(handle, (prefix + "/etc/pacman.d/hooks/").c_str());
+
+    struct Repository {
+        std::string name;
+        std::string siglevel;
+        std::vector<std::string> servers;
+    };
+    std::vector<Repository> repositories;
+    std::vector<std::string> cachedirs;
+    std::string architecture = "auto";
+    int default_siglevel = ALPM_SIG_PACKAGE | ALPM_SIG_DATABASE | ALPM_SIG_DATABASE_OPTIONAL; // pacman default: Required DatabaseOptional
+    std::string section;
+
+    auto trim = [](const std::string& text) {
+        size_t first = text.find_first_not_of(" \t\r");
+        size_t last = text.find_last_not_of(" \t\r");
+        return first == std::string::npos ? std::string() : text.substr(first, last - first + 1);
+    };
+    std::function<bool(const std::string&)> read_config = [&](const std::string& filename) {
+        std::ifstream config(filename);
+        if (!config) {
+            std::cerr << "Failed to read pacman configuration: " << filename << "\n";
+            return false;
+        }
+        for (std::string line; std::getline(config, line); ) {
+            line = trim(line.substr(0, line.find('#')));
+            if (line.empty()) {
+                continue;
+            }
+            if (line.front() == '[' && line.back() == ']') {
+                section = line.substr(1, line.size() - 2);
+                if (section != "options") {
+                    repositories.push_back({section, "", {}});
+                }
+                continue;
+            }
+            size_t equal = line.find('=');
+            std::string key = trim(line.substr(0, equal));
+            std::string value = equal == std::string::npos ? "" : trim(line.substr(equal + 1));
+
+            if (key == "Include") {
+                read_config(value);
+            } else if (section == "options") {
+                if (key == "CacheDir") {
+                    cachedirs.push_back(value);
+                } else if (key == "Architecture") {
+                    architecture = value.substr(0, value.find(' '));
+                } else if (key == "SigLevel") {
+                    default_siglevel = parse_siglevel(value, default_siglevel);
+                }
+            } else if (!repositories.empty()) {
+                if (key == "Server") {
+                    repositories.back().servers.push_back(value);
+                } else if (key == "SigLevel") {
+                    repositories.back().siglevel = value;
+                }
+            }
+        }
+        return true;
+    };
+    if (!read_config(pacman_config.empty() ? "/etc/pacman.conf" : pacman_config)) {
+        return false;
+    }
+
+    if (!pacman_cachedirs.empty()) {
+        cachedirs = pacman_cachedirs; // --cachedir wins over pacman.conf, as with pacman
+    }
+    if (cachedirs.empty()) {
+        cachedirs.push_back(prefix + "/var/cache/pacman/pkg/");
+    }
+    pacman_cachedirs = cachedirs; // Searched for the archives of the packages removed
+    for (const auto& cachedir : prefetch_cachedirs()) {
+        alpm_option_add_cachedir(handle, cachedir.c_str());
+    }
+    if (architecture == "auto") {
+        struct utsname system_name;
+        uname(&system_name);
+        architecture = system_name.machine;
+    }
+    alpm_option_add_architecture(handle, architecture.c_str());
+    alpm_option_set_default_siglevel(handle, default_siglevel);
+
+    for (const auto& repository : repositories) {
+        int siglevel = repository.siglevel.empty() ? ALPM_SIG_USE_DEFAULT : parse_siglevel(repository.siglevel, default_siglevel);
+        alpm_db_t* db = alpm_register_syncdb(handle, repository.name.c_str(), siglevel);
+        if (!db) {
+            std::cerr << "Failed to register repository " << repository.name << ": " << alpm_strerror(alpm_errno(handle)) << "\n";
+            continue;
+        }
+        for (std::string server : repository.servers) {
+            for (const auto& [variable, value] : {std::pair<std::string, std::string>{"$repo", repository.name}, {"$arch", architecture}}) {
+                for (size_t pos; (pos = server.find(variable)) != std::string::npos; ) {
+                    server.replace(pos, variable.size(), value);
+                }
+            }
+            alpm_db_add_server(db, server.c_str());
+        }
+    }
+    return true;
+}
+
+
+// Function to turn a SigLevel value of pacman.conf into libalpm flags, applied over the given level.
+// Each option may be prefixed with Package or Database to apply it to one of them only.
+int AlpmBackend::parse_siglevel(const std::string& value, int level) {
+    std::istringstream options(value);
+    for (std::string option; options >> option; ) {
+        bool package = true;
+        bool database = true;
+        if (option.rfind("Package", 0) == 0) {
+            database = false;
+            option = option.substr(7);
+        } else if (option.rfind("Database", 0) == 0) {
+            package = false;
+            option = option.substr(8);
+        }
+        auto apply = [&](int check, int optional, int marginal_ok, int unknown_ok) {
+            if (option == "Never") {
+                level &= ~(check | optional);
+            } else if (option == "Optional") {
+                level |= check | optional;
+            } else if (option == "Required") {
+                level |= check;
+                level &= ~optional;
+            } else if (option == "TrustedOnly") {
+                level &= ~(marginal_ok | unknown_ok);
+            } else if (option == "TrustAll") {
+                level |= marginal_ok | unknown_ok;
+            }
+        };
+        if (package) {
+            apply(ALPM_SIG_PACKAGE, ALPM_SIG_PACKAGE_OPTIONAL, ALPM_SIG_PACKAGE_MARGINAL_OK, ALPM_SIG_PACKAGE_UNKNOWN_OK);
+        }
+        if (database) {
+            apply(ALPM_SIG_DATABASE, ALPM_SIG_DATABASE_OPTIONAL, ALPM_SIG_DATABASE_MARGINAL_OK, ALPM_SIG_DATABASE_UNKNOWN_OK);
+        }
+    }
+    return level;
+}
+
+
+void AlpmBackend::Report::emit(const std::string& line) {
+    printf("%s\n", line.c_str());
+    result.bytes_read += line.size() + 1;
+    text += line + "\n";
+}
+
+
+void AlpmBackend::Report::emit(const std::string& line, const OutputEvent& event) {
+    emit(line);
+    result.events.push_back(event);
+}
+
+
+// Function to answer the questions of libalpm, as pacman --noconfirm would, or "yes | pacman" for probes:
+// conflicting packages are only removed when accepting prompts, replacements are always accepted.
+void AlpmBackend::answer_question(void* ctx, alpm_question_t* question) {
+    AlpmBackend* alpm = static_cast<AlpmBackend*>(ctx);
+    if (question->type == ALPM_QUESTION_CONFLICT_PKG) {
+        std::string pkge_a = alpm_pkg_get_name(question->conflict.conflict->package1);
+        std::string pkge_b = alpm_pkg_get_name(question->conflict.conflict->package2);
+        question->conflict.remove = alpm->accept_prompts ? 1 : 0;
+        if (alpm->current_report) {
+            alpm->current_report->emit(":: " + pkge_a + " and " + pkge_b + " are in conflict. Remove " + pkge_b + "? [y/N] "
+                                       + (alpm->accept_prompts ? "y" : "n"));
+        }
+    } else if (question->type == ALPM_QUESTION_REPLACE_PKG) {
+        question->replace.replace = 1;
+    }
+}
+
+
+// Function to get the "name-version" token of a package, as pacman prints it in its messages
+std::string AlpmBackend::package_token(alpm_pkg_t* pkge) {
+    return std::string(alpm_pkg_get_name(pkge)) + "-" + alpm_pkg_get_version(pkge);
+}
+
+
+// Function to get the metadata of a package as the database indexes keep it
+PackageDesc AlpmBackend::describe(alpm_pkg_t* pkge) {
+    PackageDesc desc;
+    desc.name = alpm_pkg_get_name(pkge);
+    desc.version = alpm_pkg_get_version(pkge);
+    desc.arch = alpm_pkg_get_arch(pkge) ? alpm_pkg_get_arch(pkge) : "";
+
+    auto depend_strings = [](alpm_list_t* depends, std::vector<std::string>* entries) {
+        for (alpm_list_t* item = depends; item; item = alpm_list_next(item)) {
+            char* entry = alpm_dep_compute_string(static_cast<alpm_depend_t*>(item->data));
+            if (entry) {
+                entries->push_back(entry);
+                free(entry);
+            }
+        }
+    };
+    depend_strings(alpm_pkg_get_depends(pkge), &desc.depends);
+    depend_strings(alpm_pkg_get_provides(pkge), &desc.provides);
+    depend_strings(alpm_pkg_get_conflicts(pkge), &desc.conflicts);
+    depend_strings(alpm_pkg_get_replaces(pkge), &desc.replaces);
+    return desc;
+}
+
+
+std::string AlpmBackend::source() const {
+    return "libalpm:" + (pacman_root.empty() ? std::string("/") : pacman_root) + ":" + pacman_dbpath;
+}
+
+
+bool AlpmBackend::refresh() {
+    std::lock_guard<std::mutex> lock(handle_lock);
+    printf(":: Synchronizing package databases...\n");
+    if (alpm_db_update(handle, alpm_get_syncdbs(handle), 0) < 0) {
+        printf("error: failed to synchronize all databases (%s)\n", alpm_strerror(alpm_errno(handle)));
+        return false;
+    }
+    ++sync_updates;
+    return true;
+}
+
+
+// Function to run a sync transaction: targets not found and packages already up to date are reported
+// as pacman does, then the transaction is prepared and committed.
+AlpmBackend::Report AlpmBackend::transaction(const std::vector<std::string>& targets, bool sysupgrade, bool needed, bool accept) {
+    std::lock_guard<std::mutex> lock(handle_lock);
+    Report report;
+    accept_prompts = accept;
+    current_report = &report;
+
+    // Only the files allowed to be overwritten, as pacman --overwrite
+    alpm_option_set_overwrite_files(handle, nullptr);
+    for (const auto& glob : overwrite_all ? std::vector<std::string>{"/*"} : overwrite_globs) {
+        alpm_option_add_overwrite_file(handle, glob.c_str());
+    }
+
+    if (alpm_trans_init(handle, needed ? ALPM_TRANS_FLAG_NEEDED : 0) != 0) {
+        report.emit(std::string("error: failed to init transaction (") + alpm_strerror(alpm_errno(handle)) + ")");
+        report.result.exit_code = 1;
+        current_report = nullptr;
+        return report;
+    }
+
+    alpm_db_t* localdb = alpm_get_localdb(handle);
+    bool targets_found = true;
+    for (const auto& target : targets) {
+        alpm_pkg_t* pkge = alpm_find_dbs_satisfier(handle, alpm_get_syncdbs(handle), target.c_str());
+        if (!pkge) {
+            report.emit("error: target not found: " + target, {IssueType::TARGET_NOT_FOUND, target, ""});
+            targets_found = false;
+            continue;
+        }
+        alpm_pkg_t* installed = alpm_db_get_pkg(localdb, alpm_pkg_get_name(pkge));
+        if (installed && alpm_pkg_vercmp(alpm_pkg_get_version(installed), alpm_pkg_get_version(pkge)) == 0) {
+            if (needed) {
+                report.emit("warning: " + package_token(installed) + " is up to date -- skipping");
+                continue;
+            }
+            report.emit("warning: " + package_token(installed) + " is up to date -- reinstalling",
+                        {IssueType::UP_TO_DATE, package_token(installed), ""});
+        }
+        if (alpm_add_pkg(handle, pkge) != 0) {
+            report.emit("warning: '" + target + "': " + alpm_strerror(alpm_errno(handle)));
+        }
+    }
+
+    if (!targets_found) {
+        report.result.exit_code = 1;
+    } else if (sysupgrade && alpm_sync_sysupgrade(handle, 0) != 0) {
+        report.emit(std::string("error: ") + alpm_strerror(alpm_errno(handle)));
+        report.result.exit_code = 1;
+    } else if (!alpm_trans_get_add(handle) && !alpm_trans_get_remove(handle)) {
+        report.emit(" there is nothing to do", {IssueType::NOTHING_TO_FIX, "", ""});
+    } else {
+        commit_transaction(&report, "installing");
+    }
+
+    alpm_trans_release(handle);
+    current_report = nullptr;
+    return report;
+}
+
+
+// Function to prepare and commit the transaction initialized. Missing dependencies and conflicts
+// come from the error data of libalpm, they are echoed with pacman wording and reported as issues.
+void AlpmBackend::commit_transaction(Report* report, const std::string& verb) {
+    alpm_list_t* data = nullptr;
+
+    if (alpm_trans_prepare(handle, &data) != 0) {
+        alpm_errno_t err = alpm_errno(handle);
+        report->emit(std::string("error: failed to prepare transaction (") + alpm_strerror(err) + ")");
+        for (alpm_list_t* item = data; item; item = alpm_list_next(item)) {
+            if (err == ALPM_ERR_UNSATISFIED_DEPS) {
+                alpm_depmissing_t* missing = static_cast<alpm_depmissing_t*>(item->data);
+                char* depend_string = alpm_dep_compute_string(missing->depend);
+                std::string depend = depend_string ? depend_string : "";
+                free(depend_string);
+                if (missing->causingpkg) {
+                    // An installed package requires what the transaction upgrades or removes
+                    report->emit(":: " + verb + " " + missing->causingpkg + " breaks dependency '" + depend + "' required by " + missing->target,
+                                 {IssueType::REQUIRED_BY, "'" + depend + "'", missing->target});
+                } else {
+                    report->emit(":: unable to satisfy dependency '" + depend + "' required by " + missing->target,
+                                 {IssueType::DEPENDENCY_UNSATISFY, depend, missing->target});
+                }
+                alpm_depmissing_free(missing);
+            } else if (err == ALPM_ERR_CONFLICTING_DEPS) {
+                alpm_conflict_t* conflict = static_cast<alpm_conflict_t*>(item->data);
+                std::string pkge_a = package_token(conflict->package1);
+                std::string pkge_b = package_token(conflict->package2);
+                report->emit(":: " + pkge_a + " and " + pkge_b + " are in conflict", {IssueType::CONFLICT, pkge_a, pkge_b});
+                alpm_conflict_free(conflict);
+            } else {
+                free(item->data);
+            }
+        }
+        alpm_list_free(data);
+        report->result.exit_code = 1;
+        return;
+    }
+
+    std::string packages;
+    size_t count = 0;
+    for (alpm_list_t* item : {alpm_trans_get_remove(handle), alpm_trans_get_add(handle)}) {
+        for (; item; item = alpm_list_next(item), ++count) {
+            packages += " " + package_token(static_cast<alpm_pkg_t*>(item->data));
+        }
+    }
+    report->emit("\nPackages (" + std::to_string(count) + ")" + packages + "\n");
+
+    if (alpm_trans_commit(handle, &data) != 0) {
+        alpm_errno_t err = alpm_errno(handle);
+        report->emit(std::string("error: failed to commit transaction (") + alpm_strerror(err) + ")");
+        for (alpm_list_t* item = data; item; item = alpm_list_next(item)) {
+            if (err == ALPM_ERR_FILE_CONFLICTS) {
+                alpm_fileconflict_t* conflict = static_cast<alpm_fileconflict_t*>(item->data);
+                if (conflict->type == ALPM_FILECONFLICT_TARGET) {
+                    report->emit(std::string(conflict->file) + " exists in both '" + conflict->target + "' and '" + conflict->ctarget + "'");
+                } else {
+                    report->emit(std::string(conflict->target) + ": " + conflict->file + " exists in filesystem",
+                                 {IssueType::CONFLICT_FILES, conflict->target, conflict->file});
+                }
+                alpm_fileconflict_free(conflict);
+            } else {
+                free(item->data);
+            }
+        }
+        alpm_list_free(data);
+        report->result.exit_code = 1;
+    }
+    ++local_changes; // Even a failed commit may have changed packages
+}
+
+
+StreamResult AlpmBackend::upgrade(const std::vector<std::string>& targets) {
+    if (refresh_each_run) {
+        ++stats_sync_refreshes;
+        refresh();
+    }
+    return transaction(targets, targets.empty(), true, false).result;
+}
+
+
+StreamResult AlpmBackend::probe(const std::string& packageName) {
+    if (refresh_each_run) {
+        ++stats_sync_refreshes;
+        refresh();
+    }
+    return transaction({packageName}, false, false, true).result;
+}
+
+
+std::string AlpmBackend::install(const std::vector<std::string>& packageNames, int* exit_code) {
+    Report report = transaction(packageNames, false, false, false);
+    if (exit_code) {
+        *exit_code = report.result.exit_code;
+    }
+    return report.text;
+}
+
+
+std::string AlpmBackend::remove(const std::vector<std::string>& packageNames, bool nodeps, int* exit_code) {
+    std::lock_guard<std::mutex> lock(handle_lock);
+    Report report;
+    accept_prompts = false;
+    current_report = &report;
+
+    if (alpm_trans_init(handle, nodeps ? ALPM_TRANS_FLAG_NODEPS : 0) != 0) {
+        report.emit(std::string("error: failed to init transaction (") + alpm_strerror(alpm_errno(handle)) + ")");
+        report.result.exit_code = 1;
+    } else {
+        alpm_db_t* localdb = alpm_get_localdb(handle);
+        bool targets_found = true;
+        for (const auto& pkge : packageNames) {
+            alpm_pkg_t* installed = alpm_db_get_pkg(localdb, pkge.c_str());
+            if (!installed) {
+                report.emit("error: target not found: " + pkge, {IssueType::TARGET_NOT_FOUND, pkge, ""});
+                targets_found = false;
+            } else {
+                alpm_remove_pkg(handle, installed);
+            }
+        }
+        if (targets_found) {
+            commit_transaction(&report, "removing");
+        } else {
+            report.result.exit_code = 1;
+        }
+        alpm_trans_release(handle);
+    }
+
+    current_report = nullptr;
+    if (exit_code) {
+        *exit_code = report.result.exit_code;
+    }
+    return report.text;
+}
+
+
+std::string AlpmBackend::query_local(const std::string& packageName) {
+    std::lock_guard<std::mutex> lock(handle_lock);
+    alpm_pkg_t* pkge = alpm_db_get_pkg(alpm_get_localdb(handle), packageName.c_str());
+    if (!pkge) {
+        return "error: package '" + packageName + "' was not found\n";
+    }
+
+    std::string required_by;
+    alpm_list_t* requiring = alpm_pkg_compute_requiredby(pkge);
+    for (alpm_list_t* item = requiring; item; item = alpm_list_next(item)) {
+        required_by += (required_by.empty() ? "" : "  ") + std::string(static_cast<char*>(item->data));
+    }
+    FREELIST(requiring);
+    return "Name            : " + packageName + "\n"
+           "Version         : " + alpm_pkg_get_version(pkge) + "\n"
+           "Required By     : " + (required_by.empty() ? std::string("None") : required_by) + "\n";
+}
+
+
+std::string AlpmBackend::query_sync(const std::string& packageName) {
+    std::lock_guard<std::mutex> lock(handle_lock);
+    for (alpm_list_t* item = alpm_get_syncdbs(handle); item; item = alpm_list_next(item)) {
+        alpm_db_t* db = static_cast<alpm_db_t*>(item->data);
+        alpm_pkg_t* pkge = alpm_db_get_pkg(db, packageName.c_str());
+        if (pkge) {
+            return "Repository      : " + std::string(alpm_db_get_name(db)) + "\n"
+                   "Name            : " + packageName + "\n"
+                   "Version         : " + alpm_pkg_get_version(pkge) + "\n";
+        }
+    }
+    return "error: package '" + packageName + "' was not found\n";
+}
+
+
+std::string AlpmBackend::local_generation() {
+    return "alpm:" + std::to_string(local_changes);
+}
+
+
+std::string AlpmBackend::sync_generation() {
+    return "alpm:" + std::to_string(sync_updates);
+}
+
+
+bool AlpmBackend::read_local(std::vector<PackageDesc>* pkges) {
+    std::lock_guard<std::mutex> lock(handle_lock);
+    for (alpm_list_t* item = alpm_db_get_pkgcache(alpm_get_localdb(handle)); item; item = alpm_list_next(item)) {
+        pkges->push_back(describe(static_cast<alpm_pkg_t*>(item->data)));
+    }
+    return true;
+}
+
+
+bool AlpmBackend::read_local_files(std::vector<PackageFiles>* pkges) {
+    std::lock_guard<std::mutex> lock(handle_lock);
+    for (alpm_list_t* item = alpm_db_get_pkgcache(alpm_get_localdb(handle)); item; item = alpm_list_next(item)) {
+        alpm_pkg_t* pkge = static_cast<alpm_pkg_t*>(item->data);
+        alpm_filelist_t* filelist = alpm_pkg_get_files(pkge);
+        PackageFiles files{alpm_pkg_get_name(pkge), {}};
+        for (size_t i = 0; filelist && i < filelist->count; ++i) {
+            std::string path = filelist->files[i].name;
+            if (!path.empty() && path.back() != '/') {
+                files.files.push_back("/" + path);
+            }
+        }
+        pkges->push_back(std::move(files));
+    }
+    return true;
+}
+
+
+std::string AlpmBackend::preserve_archive(const PackageDesc& pkge, bool* rebuilt) {
+    std::string archive = find_cached_archive(pkge);
+    *rebuilt = archive.empty();
+    return archive.empty() ? rebuild_archive(pkge) : archive;
+}
+
+
+// Archives are loaded with the signature level of local files, as pacman -U does
+std::string AlpmBackend::install_archives(const std::vector<std::string>& archives, int* exit_code) {
+    std::lock_guard<std::mutex> lock(handle_lock);
+    Report report;
+    accept_prompts = false;
+    current_report = &report;
+
+    alpm_option_set_overwrite_files(handle, nullptr);
+    for (const auto& glob : overwrite_all ? std::vector<std::string>{"/*"} : overwrite_globs) {
+        alpm_option_add_overwrite_file(handle, glob.c_str());
+    }
+
+    if (alpm_trans_init(handle, 0) != 0) {
+        report.emit(std::string("error: failed to init transaction (") + alpm_strerror(alpm_errno(handle)) + ")");
+        report.result.exit_code = 1;
+    } else {
+        report.emit("loading packages...");
+        for (const auto& archive : archives) {
+            alpm_pkg_t* pkge = nullptr;
+            if (alpm_pkg_load(handle, archive.c_str(), 1, alpm_option_get_local_file_siglevel(handle), &pkge) != 0 || !pkge) {
+                report.emit("error: '" + archive + "': " + alpm_strerror(alpm_errno(handle)));
+                report.result.exit_code = 1;
+                break;
+            }
+            if (alpm_add_pkg(handle, pkge) != 0) {
+                report.emit("error: '" + archive + "': " + alpm_strerror(alpm_errno(handle)));
+                alpm_pkg_free(pkge);
+                report.result.exit_code = 1;
+                break;
+            }
+        }
+        if (report.result.exit_code == 0) {
+            commit_transaction(&report, "installing");
+        }
+        alpm_trans_release(handle);
+    }
+    current_report = nullptr;
+    *exit_code = report.result.exit_code;
+    return report.text;
+}
+
+
+// The handle is locked by the transactions of the run, the downloads go through a pacman process of their own
+std::string AlpmBackend::prefetch(const std::vector<std::string>& packageNames, int* exit_code) {
+    return prefetch_with_pacman(packageNames, exit_code);
+}
+
+
+bool AlpmBackend::read_sync(std::vector<PackageDesc>* pkges, size_t* databases) {
+    std::lock_guard<std::mutex> lock(handle_lock);
+    *databases = 0;
+    for (alpm_list_t* db = alpm_get_syncdbs(handle); db; db = alpm_list_next(db), ++*databases) {
+        for (alpm_list_t* item = alpm_db_get_pkgcache(static_cast<alpm_db_t*>(db->data)); item; item = alpm_list_next(item)) {
+            pkges->push_back(describe(static_cast<alpm_pkg_t*>(item->data)));
+        }
+    }
+    return *databases > 0;
+}
+#endif
+
+
+// Function to get the key identifying an issue, the same whether it was reported by pacman or predicted
+static std::string solver_issue_key(IssueType type, const std::string& first, const std::string& second) {
+    if (type == IssueType::CONFLICT) {
+        return "conflict\t" + std::min(first, second) + "\t" + std::max(first, second);
+    }
+    return std::to_string(static_cast<int>(type)) + "\t" + first + "\t" + second;
+}
+
+
+// Function to get the installed packages whose removal solves a conflict between an incoming package and another one.
+// It is the installed package the incoming one replaces, unless both are upgraded: then either of them can go.
+static std::vector<std::string> conflict_candidates(const std::string& pkge_a, const std::string& pkge_b, const std::set<std::string>& upgraded) {
+    std::vector<std::string> candidates = {pkge_b};
+    if (upgraded.count(pkge_b) > 0 && upgraded.count(pkge_a) > 0) {
+        candidates.push_back(pkge_a);
+    }
+    return candidates;
+}
+
+
+// Function to predict a full system upgrade from the database indexes, without running pacman.
+// %VERSION% and %REPLACES% of the sync databases give the packages upgraded and replaced, then %DEPENDS%,
+// %CONFLICTS% and %PROVIDES% of the new packages are checked against the installed packages left:
+// unsatisfiable dependencies, conflicts, and installed packages whose dependency the upgrade breaks.
+// Every lookup goes through the hashed indexes, so it runs in milliseconds for a whole repository.
+UpgradePrediction predict_upgrade() {
+    TraceScope trace("predict", "full upgrade prediction");
+    UpgradePrediction prediction;
+    std::set<std::string> seen;
+
+    std::unordered_map<std::string, const PackageDesc*> final_pkges; // Installed package -> metadata after the upgrade
+    std::set<std::string> incoming; // Packages installed or upgraded by the upgrade
+    std::set<std::string> outgoing; // Installed packages upgraded or replaced (their installed version goes away)
+    for (const auto& [name, pkge] : local_pkges_index) {
+        auto candidate = sync_pkges_index.find(name);
+        if (candidate != sync_pkges_index.end() && compare_versions(candidate->second.version, pkge.version) > 0) {
+            prediction.upgraded.insert(name);
+            incoming.insert(name);
+            outgoing.insert(name);
+            final_pkges[name] = &candidate->second;
+        } else {
+            final_pkges[name] = &pkge;
+        }
+        if (!is_in_sync_repos(name)) {
+            prediction.not_in_repos.push_back(name);
+        }
+    }
+
+    // Repository packages replacing installed ones: pacman replaces them (the default answer is yes)
+    for (const auto& [name, pkge] : sync_pkges_index) {
+        for (const auto& replace : pkge.replaces) {
+            auto replaced = local_pkges_index.find(strip_version_constraint(replace));
+            if (replaced == local_pkges_index.end() || replaced->first == name || !depend_satisfied_by(replace, replaced->second)) {
+                continue;
+            }
+            prediction.replacements.push_back({replaced->first, name});
+            outgoing.insert(replaced->first);
+            // A package upgraded and replaced at once is removed, not upgraded
+            prediction.upgraded.erase(replaced->first);
+            incoming.erase(replaced->first);
+            final_pkges.erase(replaced->first);
+            incoming.insert(name);
+            final_pkges[name] = &pkge;
+        }
+    }
+    std::sort(prediction.not_in_repos.begin(), prediction.not_in_repos.end());
+
+    std::unordered_map<std::string, std::vector<std::string>> final_provides; // Provided name -> packages providing it after the upgrade
+    std::unordered_map<std::string, std::vector<std::string>> final_conflicts; // Conflict name -> packages declaring it after the upgrade
+    for (const auto& [name, pkge] : final_pkges) {
+        for (const auto& provide : pkge->provides) {
+            final_provides[strip_version_constraint(provide)].push_back(name);
+        }
+        for (const auto& conflict : pkge->conflicts) {
+            final_conflicts[strip_version_constraint(conflict)].push_back(name);
+        }
+    }
+
+    auto add_issue = [&](IssueType type, const std::string& first, const std::string& second, const std::vector<std::string>& candidates) {
+        if (seen.insert(solver_issue_key(type, first, second)).second) {
+            prediction.issues.push_back({type, first, second, candidates, true});
+        }
+    };
+    // Packages satisfying a dependency after the upgrade
+    auto satisfiers_after = [&](const std::string& depend) {
+        std::vector<std::string> satisfiers;
+        std::string name = strip_version_constraint(depend);
+        auto pkge = final_pkges.find(name);
+        if (pkge != final_pkges.end() && depend_satisfied_by(depend, *pkge->second)) {
+            satisfiers.push_back(name);
+        }
+        auto providers = final_provides.find(name);
+        if (providers != final_provides.end()) {
+            for (const auto& provider : providers->second) {
+                if (provider != name && depend_satisfied_by(depend, *final_pkges.at(provider))) {
+                    satisfiers.push_back(provider);
+                }
+            }
+        }
+        return satisfiers;
+    };
+    // Repository package pacman would pull in for a dependency
+    auto satisfied_by_repos = [&](const std::string& depend) {
+        std::string name = strip_version_constraint(depend);
+        auto pkge = sync_pkges_index.find(name);
+        if (pkge != sync_pkges_index.end() && depend_satisfied_by(depend, pkge->second)) {
+            return true;
+        }
+        auto providers = sync_provides_index.find(name);
+        if (providers != sync_provides_index.end()) {
+            for (const auto& provider : providers->second) {
+                if (depend_satisfied_by(depend, sync_pkges_index.at(provider))) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    };
+
+    for (const auto& name : incoming) {
+        const PackageDesc& pkge = *final_pkges.at(name);
+
+        // New dependencies no installed or repository package satisfies
+        for (const auto& depend : pkge.depends) {
+            if (satisfiers_after(depend).empty() && !satisfied_by_repos(depend)) {
+                add_issue(IssueType::DEPENDENCY_UNSATISFY, depend, name, {name});
+            }
+        }
+
+        // Conflicts declared by the new package, or by installed packages against it
+        for (const auto& conflict : pkge.conflicts) {
+            for (const auto& other : satisfiers_after(conflict)) {
+                if (other != name) {
+                    add_issue(IssueType::CONFLICT, name, other, conflict_candidates(name, other, prediction.upgraded));
+                }
+            }
+        }
+        std::vector<std::string> provided = {name};
+        for (const auto& provide : pkge.provides) {
+            provided.push_back(strip_version_constraint(provide));
+        }
+        for (const auto& provide : provided) {
+            auto declaring = final_conflicts.find(provide);
+            if (declaring == final_conflicts.end()) {
+                continue;
+            }
+            for (const auto& other : declaring->second) {
+                for (const auto& conflict : final_pkges.at(other)->conflicts) {
+                    if (other != name && strip_version_constraint(conflict) == provide && depend_satisfied_by(conflict, pkge)) {
+                        add_issue(IssueType::CONFLICT, name, other, conflict_candidates(name, other, prediction.upgraded));
+                    }
+                }
+            }
+        }
+    }
+
+    // Installed packages left whose dependency is satisfied today by a package the upgrade changes, and not after
+    for (const auto& [name, pkge] : local_pkges_index) {
+        if (outgoing.count(name) > 0) {
+            continue;
+        }
+        for (const auto& depend : pkge.depends) {
+            bool satisfied_by_outgoing = false;
+            for (const auto& current : resolve_local_depend(depend)) {
+                if (outgoing.count(current) > 0 && depend_satisfied_by(depend, local_pkges_index.at(current))) {
+                    satisfied_by_outgoing = true;
+                }
+            }
+            if (satisfied_by_outgoing && satisfiers_after(depend).empty()) {
+                add_issue(IssueType::REQUIRED_BY, "'" + depend + "'", name, {name});
+            }
+        }
+    }
+    return prediction;
+}
+
+
+// Function to collect the issues of a failed full system upgrade: the ones pacman reported, then the ones
+// predicted from the databases (pacman stops at the first kind of issue, the prediction sees them all).
+std::vector<SolverIssue> collect_upgrade_issues(const std::vector<OutputEvent>& events) {
+    UpgradePrediction prediction = predict_upgrade();
+    std::vector<SolverIssue> issues;
+    std::set<std::string> seen;
+
+    for (const auto& event : events) {
+        std::string first = event.first;
+        std::string second = event.second;
+        std::vector<std::string> candidates = {second};
+        if (event.type == IssueType::CONFLICT) {
+            first = package_name_of(event.first);
+            second = package_name_of(event.second);
+            candidates = conflict_candidates(first, second, prediction.upgraded);
+        } else if (event.type != IssueType::REQUIRED_BY && event.type != IssueType::DEPENDENCY_UNSATISFY) {
+            continue;
+        }
+        if (seen.insert(solver_issue_key(event.type, first, second)).second) {
+            issues.push_back({event.type, first, second, candidates, false});
+        }
+    }
+    for (const auto& issue : prediction.issues) {
+        if (seen.insert(solver_issue_key(issue.type, issue.first, issue.second)).second) {
+            issues.push_back(issue);
+        }
+    }
+    return issues;
+}
+
+
+// Function to print what a full system upgrade would meet, predicted from the databases without running pacman (--predict):
+// replacements, conflicts, broken dependents, unsatisfiable dependencies and installed packages in no repository,
+// then the removal set the global solver would choose. It fails when the upgrade is predicted to fail.
+int run_prediction() {
+    auto start = std::chrono::steady_clock::now();
+    if (!load_sync_databases()) {
+        std::cerr << "Failed to load sync databases from: " << backend->source() << "\n";
+        return EXIT_FAILURE;
+    }
+    if (!load_local_database()) {
+        std::cerr << "Failed to load local database from: " << backend->source() << "\n";
+        return EXIT_FAILURE;
+    }
+    auto loaded = std::chrono::steady_clock::now();
+    UpgradePrediction prediction = predict_upgrade();
+    auto predicted = std::chrono::steady_clock::now();
+
+    printf("\n[PREDICTION] >> %zu installed, %zu in the repositories: %zu upgrade(s), %zu replacement(s), %zu issue(s)\n\n",
+           local_pkges_index.size(), sync_pkges_index.size(), prediction.upgraded.size(), prediction.replacements.size(),
+           prediction.issues.size());
+    for (const auto& [replaced, replacer] : prediction.replacements) {
+        printf("[REPLACE] >> %s with %s\n", replaced.c_str(), replacer.c_str());
+    }
+    for (const auto& issue : prediction.issues) {
+        if (issue.type == IssueType::CONFLICT) {
+            printf("[CONFLICT BETWEEN] >> %s and %s\n", issue.first.c_str(), issue.second.c_str());
+        } else if (issue.type == IssueType::REQUIRED_BY) {
+            printf("[REQUIRED BY] >> %s required by %s\n", issue.first.c_str(), issue.second.c_str());
+        } else {
+            printf("[DEPENDENCY UNSATISFIED] >> %s required by %s\n", issue.first.c_str(), issue.second.c_str());
+        }
+    }
+    for (const auto& pkge : prediction.not_in_repos) {
+        printf("[NOT IN REPOS] >> %s (target not found if it is removed and reinstalled)\n", pkge.c_str());
+    }
+
+    if (!prediction.issues.empty()) {
+        std::vector<std::string> removals = solve_removal_set(prediction.issues);
+        printf("\n[REMOVAL SET] >> %zu package(s) would solve all the issues, %zu with their dependents:",
+               removals.size(), removal_order(removals).size());
+        for (const auto& pkge : removals) {
+            printf(" %s", pkge.c_str());
+        }
+        printf("\n");
+    }
+    printf("\n[PREDICTION TIME] >> databases loaded in %.1f ms, upgrade predicted in %.1f ms\n\n",
+           std::chrono::duration<double, std::milli>(loaded - start).count(),
+           std::chrono::duration<double, std::milli>(predicted - loaded).count());
+    return prediction.issues.empty() ? 0 : EXIT_FAILURE;
+}
+
+
+// Function to choose the packages to remove to solve all the issues. Removing a package removes its dependents
+// too, so an issue is solved as soon as one of its candidates is in the removal set. Issues with a single
+// candidate are taken first, then the candidate removing the fewest new packages per issue it solves is chosen
+// until every issue is solved (greedy set cover). Candidates not installed are ignored.
+std::vector<std::string> solve_removal_set(const std::vector<SolverIssue>& issues) {
+    std::vector<std::string> removals;
+    PackageSet planned; // Packages the removals take away, dependents included
+    std::vector<bool> solved(issues.size(), false);
+
+    auto is_solved = [&](const SolverIssue& issue) {
+        for (const auto& candidate : issue.candidates) {
+            if (planned.count(candidate) > 0) {
+                return true;
+            }
+        }
+        return false;
+    };
+    auto choose = [&](const std::string& pkge) {
+        removals.push_back(pkge);
+        for (const auto& removed : removal_order({pkge})) {
+            planned.insert(removed);
+        }
+        for (size_t i = 0; i < issues.size(); ++i) {
+            solved[i] = solved[i] || is_solved(issues[i]);
+        }
+    };
+    auto installed = [](const std::string& pkge) {
+        return local_pkges_index.count(pkge) > 0;
+    };
+
+    for (size_t i = 0; i < issues.size(); ++i) {
+        std::vector<std::string> candidates;
+        std::copy_if(issues[i].candidates.begin(), issues[i].candidates.end(), std::back_inserter(candidates), installed);
+        if (candidates.empty()) {
+            solved[i] = true; // Left to the per-issue resolution
+        } else if (candidates.size() == 1 && !solved[i]) {
+            choose(candidates.front());
+        }
+    }
+
+    while (std::find(solved.begin(), solved.end(), false) != solved.end()) {
+        std::unordered_map<std::string, size_t> gains; // Candidate -> unsolved issues it solves
+        for (size_t i = 0; i < issues.size(); ++i) {
+            if (!solved[i]) {
+                for (const auto& candidate : issues[i].candidates) {
+                    if (installed(candidate)) {
+                        ++gains[candidate];
+                    }
+                }
+            }
+        }
+        std::string best;
+        size_t best_cost = 0;
+        size_t best_gain = 0;
+        for (const auto& [candidate, gain] : gains) {
+            size_t cost = 0;
+            for (const auto& removed : removal_order({candidate})) {
+                cost += planned.count(removed) == 0;
+            }
+            if (best.empty() || cost * best_gain < best_cost * gain || (cost * best_gain == best_cost * gain && candidate < best)) {
+                best = candidate;
+                best_cost = cost;
+                best_gain = gain;
+            }
+        }
+        choose(best);
+    }
+    return removals;
+}
+
+
+// Function to solve every issue of a failed full system upgrade in one removal transaction, then run it again.
+// Packages in conflict with an upgraded package are replaced by it and packages whose dependencies cannot be
+// satisfied anymore are dropped: neither is reinstalled. The other removed packages are reinstalled by the main loop,
+// unless their repository version could not be installed after the upgrade (that would fail the whole reinstall).
+// CONTINUE_PROCESSING is returned when the databases cannot be read or nothing can be planned.
+ProceedureStatus solve_upgrade_issues(const std::vector<OutputEvent>& events) {
+    ensure_sync_databases();
+    if (!sync_db_loaded || !ensure_local_database()) {
+        return CONTINUE_PROCESSING;
+    }
+
+    std::vector<SolverIssue> issues = collect_upgrade_issues(events);
+    std::vector<std::string> removals = solve_removal_set(issues);
+    if (removals.empty()) {
+        return CONTINUE_PROCESSING;
+    }
+    std::vector<std::string> order = removal_order(removals);
+
+    size_t predicted = std::count_if(issues.begin(), issues.end(), [](const SolverIssue& issue) { return issue.predicted; });
+    printf("\n[GLOBAL SOLVER] >> %zu issue(s), %zu reported by pacman and %zu predicted from the databases\n",
+           issues.size(), issues.size() - predicted, predicted);
+
+    PackageSet replaced; // Removed in favour of the upgraded package in conflict with them
+    PackageSet dropped; // Removed for good, their dependencies cannot be satisfied
+    for (const auto& issue : issues) {
+        if (issue.type == IssueType::CONFLICT) {
+            printf("\n[CONFLICT BETWEEN] >> %s and %s\n", issue.first.c_str(), issue.second.c_str());
+            journal_append({"conflict\t" + issue.first + "\t" + issue.second});
+            log_package(log_conflicts_resolved, "conflict_resolved", issue.first);
+            log_package(log_conflicts_resolved, "conflict_resolved", issue.second);
+            for (const auto& candidate : issue.candidates) {
+                if (std::find(removals.begin(), removals.end(), candidate) != removals.end()) {
+                    replaced.insert(candidate);
+                }
+            }
+        } else if (issue.type == IssueType::REQUIRED_BY) {
+            printf("\n[REQUIRED BY] >> %s required by %s\n", issue.first.c_str(), issue.second.c_str());
+            journal_append({"required_by\t" + issue.first + "\t" + issue.second});
+            log_package(log_requiredby_resolved, "requiredby_resolved", issue.first);
+            log_package(log_requiredby_resolved, "requiredby_resolved", issue.second);
+        } else {
+            printf("\n[DEPENDENCY UNSATISFIED] >> %s required by %s\n", issue.first.c_str(), issue.second.c_str());
+            if (local_pkges_index.count(issue.second) > 0) {
+                dropped.insert(issue.second);
+            }
+        }
+        mark_dirty(issue.first);
+        mark_dirty(issue.second);
+    }
+
+    // Packages to reinstall whose repository version has a dependency nothing available after the upgrade satisfies.
+    // Dropping one can leave others without it, so it is repeated until nothing changes.
+    PackageSet in_plan;
+    for (const auto& pkge : order) {
+        in_plan.insert(pkge);
+    }
+    auto available = [&](const std::string& pkge, const std::string& depend) {
+        if (replaced.count(pkge) > 0 || dropped.count(pkge) > 0) {
+            return false;
+        }
+        auto local = local_pkges_index.find(pkge);
+        auto sync = sync_pkges_index.find(pkge);
+        bool kept = local != local_pkges_index.end() && in_plan.count(pkge) == 0
+                    && (sync == sync_pkges_index.end() || compare_versions(sync->second.version, local->second.version) <= 0);
+        if (kept) {
+            return depend_satisfied_by(depend, local->second);
+        }
+        return sync != sync_pkges_index.end() && depend_satisfied_by(depend, sync->second);
+    };
+    auto satisfiable = [&](const std::string& depend) {
+        std::string name = strip_version_constraint(depend);
+        if (available(name, depend)) {
+            return true;
+        }
+        for (const auto* providers : {&local_provides_index, &sync_provides_index}) {
+            auto provider = providers->find(name);
+            if (provider != providers->end()) {
+                for (const auto& pkge : provider->second) {
+                    if (available(pkge, depend)) {
+                        return true;
+                    }
+                }
+            }
+        }
+        return false;
+    };
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (const auto& pkge : order) {
+            auto sync = sync_pkges_index.find(pkge);
+            if (replaced.count(pkge) > 0 || dropped.count(pkge) > 0 || sync == sync_pkges_index.end()) {
+                continue; // Packages not in the repositories are skipped by the reinstall
+            }
+            for (const auto& depend : sync->second.depends) {
+                if (!satisfiable(depend)) {
+                    printf("\n[DEPENDENCY UNSATISFIED] >> %s required by %s, it cannot be reinstalled after the upgrade\n",
+                           depend.c_str(), pkge.c_str());
+                    dropped.insert(pkge);
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    printf("\n[REMOVAL SET] >> %zu package(s) solve all the issues, %zu with their dependents:", removals.size(), order.size());
+    for (const auto& pkge : removals) {
+        printf(" %s", pkge.c_str());
+    }
+    printf("\n");
+    if (remove_packages(removals) == "ERROR") {
+        exit_removal_failed();
+    }
+    ++stats_solver_plans;
+
+    std::vector<std::string> records;
+    for (const auto& pkge : order) {
+        if (dropped.count(pkge) > 0) {
+            printf("\n[DEPENDENCY UNSATISFY RESOLVED] >> %s has been removed to resolve the unsatisfied dependency.\n", pkge.c_str());
+            removed_pkges.erase(pkge);
+            log_package(log_dependency_unsatisfy_removed, "dependency_unsatisfy_removed", pkge);
+            records.push_back("unsatisfied_removed\t" + pkge);
+        } else if (replaced.count(pkge) > 0) {
+            printf("\n[REPLACED] >> %s has been removed, the package in conflict with it replaces it.\n", pkge.c_str());
+            removed_pkges.erase(pkge);
+            log_package(log_removed_not_reinstalled, "removed_not_reinstalled", pkge);
+            records.push_back("not_reinstalled\t" + pkge);
+        }
+    }
+    journal_append(records);
+
+    // The upgrade runs again before anything is reinstalled, the packages removed were blocking it
+    printf("\n[RESOLVING ALL CONFLICTS AUTOMATICALLY]\n\n");
+    ++stats_full_checks;
+    return run_and_resolve({});
+}
+
+
+FileOwnerIndex::~FileOwnerIndex() {
+    release();
+}
+
+
+void FileOwnerIndex::release() {
+    if (mapping) {
+        munmap(mapping, mapping_length);
+        mapping = nullptr;
+        mapping_length = 0;
+    }
+    image.clear();
+    header = nullptr;
+    owner_offsets = nullptr;
+    entries = nullptr;
+    names = nullptr;
+    paths = nullptr;
+    loaded_generation.clear();
+}
+
+
+// Function to point the index at a table, in memory or mapped, after checking it is complete and for this generation
+bool FileOwnerIndex::attach(const char* data, size_t length, const std::string& generation) {
+    if (length < sizeof(Header)) {
+        return false;
+    }
+    const Header* table = reinterpret_cast<const Header*>(data);
+    if (std::memcmp(table->magic, "FCFILES1", sizeof(table->magic)) != 0) {
+        return false;
+    }
+    size_t expected = sizeof(Header) + sizeof(uint32_t) * (size_t(table->owners) + 1) + sizeof(Entry) * size_t(table->entries)
+                      + table->generation_bytes + table->names_bytes + table->paths_bytes;
+    if (expected != length) {
+        return false;
+    }
+    const char* position = data + sizeof(Header);
+    const uint32_t* offsets = reinterpret_cast<const uint32_t*>(position);
+    position += sizeof(uint32_t) * (size_t(table->owners) + 1);
+    const Entry* table_entries = reinterpret_cast<const Entry*>(position);
+    position += sizeof(Entry) * size_t(table->entries);
+    if (std::string_view(position, table->generation_bytes) != generation || offsets[table->owners] != table->names_bytes) {
+        return false;
+    }
+    position += table->generation_bytes;
+
+    // Every offset is checked once here, owner() trusts them: a damaged file of the right length is rebuilt
+    for (uint32_t owner = 0; owner < table->owners; ++owner) {
+        if (offsets[owner] > offsets[owner + 1]) {
+            return false;
+        }
+    }
+    const char* table_paths = position + table->names_bytes;
+    for (uint32_t i = 0; i < table->entries; ++i) {
+        const Entry& entry = table_entries[i];
+        if (entry.owner >= table->owners || size_t(entry.path_offset) + entry.path_bytes > table->paths_bytes) {
+            return false;
+        }
+        // Sorted by path, or the binary search of owner() would miss files
+        if (i > 0 && std::string_view(table_paths + table_entries[i - 1].path_offset, table_entries[i - 1].path_bytes)
+                         >= std::string_view(table_paths + entry.path_offset, entry.path_bytes)) {
+            return false;
+        }
+    }
+
+    header = table;
+    owner_offsets = offsets;
+    entries = table_entries;
+    names = position;
+    paths = position + table->names_bytes;
+    loaded_generation = generation;
+    return true;
+}
+
+
+// Function to build the index from the files of the installed packages and save it to be mapped by the next runs.
+// The file is written aside and renamed, a run mapping the previous one is not affected.
+bool FileOwnerIndex::build(const std::vector<PackageFiles>& pkges, const std::string& generation, const std::string& filename) {
+    release();
+
+    struct Row {
+        std::string_view path;
+        uint32_t owner;
+    };
+    std::vector<Row> rows;
+    Header table{};
+    std::memcpy(table.magic, "FCFILES1", sizeof(table.magic));
+    table.generation_bytes = generation.size();
+    table.owners = pkges.size();
+    for (uint32_t owner = 0; owner < pkges.size(); ++owner) {
+        for (const auto& path : pkges[owner].files) {
+            rows.push_back({path, owner});
+        }
+        table.names_bytes += pkges[owner].name.size();
+    }
+    // A path owned twice keeps its first owner, as pacman -Qo reports it
+    std::stable_sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) { return a.path < b.path; });
+    rows.erase(std::unique(rows.begin(), rows.end(), [](const Row& a, const Row& b) { return a.path == b.path; }), rows.end());
+    table.entries = rows.size();
+
+    std::vector<uint32_t> offsets;
+    std::string names_blob;
+    for (const auto& pkge : pkges) {
+        offsets.push_back(names_blob.size());
+        names_blob += pkge.name;
+    }
+    offsets.push_back(names_blob.size());
+    std::vector<Entry> table_entries;
+    std::string paths_blob;
+    for (const auto& row : rows) {
+        table_entries.push_back({uint32_t(paths_blob.size()), uint32_t(row.path.size()), row.owner});
+        paths_blob += row.path;
+    }
+    table.paths_bytes = paths_blob.size();
+
+    image.append(reinterpret_cast<const char*>(&table), sizeof(table));
+    image.append(reinterpret_cast<const char*>(offsets.data()), sizeof(uint32_t) * offsets.size());
+    image.append(reinterpret_cast<const char*>(table_entries.data()), sizeof(Entry) * table_entries.size());
+    image += generation;
+    image += names_blob;
+    image += paths_blob;
+    if (!attach(image.data(), image.size(), generation)) {
+        release();
+        return false;
+    }
+
+    if (!filename.empty()) {
+        std::string temporary = filename + ".tmp";
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        if (!out.write(image.data(), image.size()) || (out.close(), !out)) {
+            std::remove(temporary.c_str());
+            return true; // Still usable for this run
+        }
+        std::rename(temporary.c_str(), filename.c_str());
+    }
+    return true;
+}
+
+
+// Function to map a saved index read-only, only when it was built for this generation of the local database
+bool FileOwnerIndex::map(const std::string& filename, const std::string& generation) {
+    release();
+
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+    void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    mapping = data;
+    mapping_length = info.st_size;
+    if (!attach(static_cast<const char*>(data), mapping_length, generation)) {
+        release();
+        return false;
+    }
+    return true;
+}
+
+
+// Function to find the package owning a file: binary search over the sorted paths
+std::string_view FileOwnerIndex::owner(std::string_view path) const {
+    if (!header) {
+        return {};
+    }
+    const Entry* end = entries + header->entries;
+    const Entry* found = std::lower_bound(entries, end, path, [this](const Entry& entry, std::string_view key) {
+        return std::string_view(paths + entry.path_offset, entry.path_bytes) < key;
+    });
+    if (found == end || std::string_view(paths + found->path_offset, found->path_bytes) != path || found->owner >= header->owners) {
+        return {};
+    }
+    return std::string_view(names + owner_offsets[found->owner], owner_offsets[found->owner + 1] - owner_offsets[found->owner]);
+}
+
+
+// Function to get the file ownership index for the installed packages as they are now.
+// The saved index is mapped while the local database does not change, else it is built again from the files entries.
+bool ensure_files_index() {
+    std::string generation = backend->local_generation();
+    if (generation.empty()) {
+        return false;
+    }
+    if (files_index.size() > 0 && files_index.generation() == generation) {
+        return true;
+    }
+
+    // Generations of the in-process backends (scripted:, alpm:) only hold within a run, only pacman's is saved
+    bool persistent = generation.find(':') == std::string::npos;
+    TraceScope trace("files_index", "file ownership index");
+    if (persistent && files_index.map(files_index_file, generation)) {
+        trace.end(0, files_index.size());
+        printf("\n[FILES INDEX] >> %zu files mapped from %s\n", files_index.size(), files_index_file.c_str());
+        return true;
+    }
+    std::vector<PackageFiles> pkges;
+    if (!backend->read_local_files(&pkges) || !files_index.build(pkges, generation, persistent ? files_index_file : "")) {
+        trace.end(1, 0);
+        return false;
+    }
+    trace.end(0, files_index.size());
+    printf("\n[FILES INDEX] >> %zu files of %zu installed packages indexed\n", files_index.size(), pkges.size());
+    return true;
+}
+
+
+// Function to build the --overwrite options of pacman: the globs given and the unowned files found so far
+std::vector<std::string> overwrite_arguments() {
+    if (overwrite_all) {
+        return {"--overwrite", "/*"};
+    }
+    std::vector<std::string> arguments;
+    for (const auto& glob : overwrite_globs) {
+        arguments.insert(arguments.end(), {"--overwrite", glob});
+    }
+    return arguments;
+}
+
+
+// Function to check a conflicting file against the globs pacman would get with --overwrite
+bool overwrite_allowed(const std::string& path) {
+    if (overwrite_all) {
+        return true;
+    }
+    for (const auto& glob : overwrite_globs) {
+        if (fnmatch(glob.c_str(), path.c_str(), 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Function to turn a path into a glob matching only that path
+static std::string escape_glob(const std::string& path) {
+    std::string glob;
+    for (char c : path) {
+        if (c == '*' || c == '?' || c == '[' || c == ']' || c == '\\') {
+            glob += '\\';
+        }
+        glob += c;
+    }
+    return glob;
+}
+
+
+// Function to resolve the files of a transaction already on disk, attributed in one pass with the file ownership index.
+// A file no package owns is left over (a package removed with its files kept, a file copied by hand): it is overwritten.
+// A file owned by another package moved between packages: the owner is resolved first, its new version usually drops
+// the file. If it was already resolved and still owns the file, it is removed, the new package takes its place.
+// Returns false when nothing could be done, the conflicts would come back unchanged.
+bool resolve_file_conflicts(const std::vector<OutputEvent>& events) {
+    static PackageSet owners_resolving; // Owners being resolved, a file conflict back to one of them does not recurse
+    bool progress = false;
+
+    if (!ensure_files_index()) {
+        printf("\n[FILES INDEX UNAVAILABLE] >> File conflicts cannot be attributed to their owners.\n");
+        return false;
+    }
+
+    std::vector<std::string> owners; // Owners to resolve, once each
+    std::vector<std::string> replaced; // Owners already resolved that still own the files
+    for (const auto& event : events) {
+        if (event.type != IssueType::CONFLICT_FILES) {
+            continue;
+        }
+        std::string pkge = package_name_of(event.first);
+        std::string path = event.second;
+        if (!pacman_root.empty() && pacman_root != "/" && path.compare(0, pacman_root.size(), pacman_root) == 0) {
+            path.erase(0, pacman_root.size());
+            if (path.empty() || path.front() != '/') {
+                path.insert(0, "/");
+            }
+        }
+
+        std::string owner(files_index.owner(path));
+        if (owner.empty()) {
+            if (!overwrite_allowed(path)) {
+                printf("\n[UNOWNED FILE] >> %s (installed by %s) is owned by no package. It is overwritten.\n", path.c_str(), pkge.c_str());
+                overwrite_globs.push_back(escape_glob(path));
+                log_event("file_overwritten", pkge, path);
+                ++stats_files_overwritten;
+                progress = true;
+            }
+            continue;
+        }
+        if (owner == pkge) {
+            continue;
+        }
+
+        printf("\n[FILE CONFLICT] >> %s of %s is owned by %s\n", path.c_str(), pkge.c_str(), owner.c_str());
+        if (std::find(owners.begin(), owners.end(), owner) != owners.end()
+            || std::find(replaced.begin(), replaced.end(), owner) != replaced.end()) {
+            continue;
+        }
+        journal_append({"conflict\t" + pkge + "\t" + owner});
+        log_package(log_conflicts_resolved, "conflict_resolved", pkge);
+        log_package(log_conflicts_resolved, "conflict_resolved", owner);
+        mark_dirty(pkge);
+        mark_dirty(owner);
+        if (pkge_resolved.count(owner) == 0 && owners_resolving.count(owner) == 0) {
+            owners.push_back(owner);
+        } else {
+            replaced.push_back(owner);
+        }
+    }
+
+    for (const auto& owner : owners) {
+        owners_resolving.insert(owner);
+        resolve_package(owner);
+        owners_resolving.erase(owner);
+        ++stats_file_owners_resolved;
+        progress = true;
+    }
+
+    if (!replaced.empty()) {
+        if (remove_packages(replaced) == "ERROR") {
+            exit_removal_failed();
+        }
+        std::vector<std::string> records;
+        for (const auto& owner : replaced) {
+            printf("\n[REPLACED] >> %s has been removed, the files it owned belong to the package installed now.\n", owner.c_str());
+            removed_pkges.erase(owner);
+            log_package(log_removed_not_reinstalled, "removed_not_reinstalled", owner);
+            records.push_back("not_reinstalled\t" + owner);
+            ++stats_file_owners_resolved;
+        }
+        journal_append(records);
+        progress = true;
+    }
+    return progress;
+}
+
+
+// Function to keep the archive of the installed version of packages about to be removed, to reinstall that same
+// version without downloading it. Packages without an archive are reinstalled from the repositories as before.
+void preserve_archives(const std::vector<std::string>& packageNames) {
+    if (!ensure_local_database()) {
+        return;
+    }
+    int cached = 0;
+    int rebuilt = 0;
+    std::vector<std::string> missing;
+    std::vector<std::string> records;
+    for (const auto& pkge : packageNames) {
+        auto local = local_pkges_index.find(pkge);
+        if (local == local_pkges_index.end() || preserved_archives.count(pkge) > 0) {
+            continue;
+        }
+        bool archive_rebuilt = false;
+        TraceScope trace("archive", pkge);
+        std::string archive = backend->preserve_archive(local->second, &archive_rebuilt);
+        trace.end(archive.empty() ? 1 : 0, 0);
+        if (archive.empty()) {
+            missing.push_back(pkge);
+            continue;
+        }
+        ++(archive_rebuilt ? rebuilt : cached);
+        preserved_archives[pkge] = archive;
+        records.push_back("archive\t" + pkge + "\t" + archive);
+    }
+    journal_append(records);
+    stats_archives_cached += cached;
+    stats_archives_rebuilt += rebuilt;
+
+    if (cached + rebuilt > 0 || !missing.empty()) {
+        printf("\n[ARCHIVES] >> %d from the package cache, %d rebuilt from the installed files", cached, rebuilt);
+        for (size_t i = 0; i < missing.size(); ++i) {
+            printf("%s%s", i == 0 ? ", none for: " : " ", missing[i].c_str());
+        }
+        printf("\n");
+    }
+}
+
+
+// Function to find the archive of a package version in the package cache.
+// The cache is indexed once by "<name>-<version>" from the file names (<name>-<pkgver>-<pkgrel>-<arch>.pkg.tar.*).
+std::string find_cached_archive(const PackageDesc& pkge) {
+    static std::unordered_map<std::string, std::string> cache_index;
+    static bool cache_indexed = false;
+
+    if (!cache_indexed) {
+        cache_indexed = true;
+        std::vector<std::string> cachedirs = pacman_cachedirs;
+        if (cachedirs.empty()) {
+            cachedirs.push_back(pacman_root + "/var/cache/pacman/pkg");
+        }
+        for (const auto& cachedir : cachedirs) {
+            std::error_code ec;
+            for (const auto& entry : std::filesystem::directory_iterator(cachedir, ec)) {
+                std::string filename = entry.path().filename().string();
+                size_t extension = filename.find(".pkg.tar");
+                if (extension == std::string::npos || (filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".sig") == 0)) {
+                    continue;
+                }
+                size_t arch = filename.rfind('-', extension);
+                if (arch != std::string::npos) {
+                    cache_index.emplace(filename.substr(0, arch), entry.path().string());
+                }
+            }
+        }
+    }
+
+    auto found = cache_index.find(pkge.name + "-" + pkge.version);
+    std::error_code ec;
+    if (found == cache_index.end() || std::filesystem::file_size(found->second, ec) == 0 || ec) {
+        return "";
     }
-    fprintf(logFile, "\n");
+    return found->second;
+}
+
 
-    // Packages required-by and resolved
-    fprintf(logFile, "[PACKAGES REQUIRED-BY AND RESOLVED]\n");
-    if (!log_requiredby_resolved.empty()) {
-        for (const auto& pkg : log_requiredby_resolved) {
-            fprintf(logFile, "  - %s\n", pkg.c_str());
+// Function to rebuild the archive of an installed package from its files, as bacman does: the .PKGINFO is written
+// from the local database entry, its mtree and install script are kept, and the files are taken from the root.
+// Files changed since the package was installed are taken as they are.
+std::string rebuild_archive(const PackageDesc& pkge) {
+    static const std::vector<std::pair<std::string, std::string>> fields = {
+        {"%NAME%", "pkgname"}, {"%BASE%", "pkgbase"}, {"%VERSION%", "pkgver"}, {"%DESC%", "pkgdesc"}, {"%URL%", "url"},
+        {"%BUILDDATE%", "builddate"}, {"%PACKAGER%", "packager"}, {"%SIZE%", "size"}, {"%ARCH%", "arch"},
+        {"%LICENSE%", "license"}, {"%GROUPS%", "group"}, {"%REPLACES%", "replaces"}, {"%DEPENDS%", "depend"},
+        {"%OPTDEPENDS%", "optdepend"}, {"%CONFLICTS%", "conflict"}, {"%PROVIDES%", "provides"},
+    };
+    std::string version = pkge.name + "-" + pkge.version;
+    std::filesystem::path local = std::filesystem::path(pacman_dbpath) / "local" / version;
+
+    std::ifstream desc(local / "desc");
+    std::ifstream files(local / "files");
+    if (!desc || !files) {
+        return "";
+    }
+    std::string pkginfo = "# Rebuilt by fixConflicts from the local database\n";
+    std::string key;
+    for (std::string line; std::getline(desc, line); ) {
+        if (line.size() > 2 && line.front() == '%' && line.back() == '%') {
+            auto field = std::find_if(fields.begin(), fields.end(), [&](const auto& entry) { return entry.first == line; });
+            key = field == fields.end() ? "" : field->second;
+        } else if (!line.empty() && !key.empty()) {
+            pkginfo += key + " = " + line + "\n";
         }
-    } else {
-        fprintf(logFile, "  (none)\n");
     }
-    fprintf(logFile, "\n");
+    std::string paths;
+    std::string section;
+    for (std::string line; std::getline(files, line); ) {
+        if (line.size() > 2 && line.front() == '%' && line.back() == '%') {
+            section = line;
+        } else if (!line.empty() && section == "%FILES%") {
+            paths += line + "\n";
+        } else if (!line.empty() && section == "%BACKUP%") {
+            pkginfo += "backup = " + line.substr(0, line.find('\t')) + "\n";
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::path directory = std::filesystem::absolute(archives_dir, ec);
+    std::filesystem::path staging = directory / ("." + version);
+    std::filesystem::create_directories(staging, ec);
+    if (ec) {
+        return "";
+    }
+    // The names list of bsdtar: the metadata from the staging directory, then the files from the root
+    std::ofstream(staging / ".PKGINFO") << pkginfo;
+    std::string names = "-C\n" + staging.string() + "\n.PKGINFO\n";
+    if (std::filesystem::copy_file(local / "mtree", staging / ".MTREE", std::filesystem::copy_options::overwrite_existing, ec)) {
+        names += ".MTREE\n";
+    }
+    if (std::filesystem::copy_file(local / "install", staging / ".INSTALL", std::filesystem::copy_options::overwrite_existing, ec)) {
+        names += ".INSTALL\n";
+    }
+    std::ofstream(staging / ".names") << names << "-C\n" << (pacman_root.empty() ? "/" : pacman_root) << "\n" << paths;
+
+    std::string archive = (directory / (version + "-" + (pkge.arch.empty() ? "any" : pkge.arch) + ".pkg.tar.zst")).string();
+    int exit_code;
+    command_exec({"bsdtar", "-c", "--zstd", "--no-recursion", "-f", archive, "-T", (staging / ".names").string()}, &exit_code);
+    std::filesystem::remove_all(staging, ec);
+    if (exit_code != 0) {
+        std::remove(archive.c_str());
+        return "";
+    }
+    return archive;
+}
+
+
+// Function to check if a removed package is reinstalled from the repositories: it has no archive,
+// or --prefer-repo is given and the repositories still have it
+bool reinstalls_from_repo(const std::string& packageName) {
+    return preserved_archives.count(packageName) == 0 || (prefer_repo && is_in_sync_repos(packageName));
+}
+
+
+// Function to list the package caches passed to the transactions: the ones given (--cachedir, or pacman.conf with --alpm)
+// and the prefetch cache last. pacman downloads into the first one, the prefetch cache is only searched.
+std::vector<std::string> prefetch_cachedirs() {
+    std::vector<std::string> cachedirs = pacman_cachedirs;
+    if (!prefetch_enabled) {
+        return cachedirs;
+    }
+    if (cachedirs.empty()) {
+        cachedirs.push_back(pacman_root + "/var/cache/pacman/pkg/");
+    }
+    std::error_code ec;
+    cachedirs.push_back((std::filesystem::absolute(prefetch_dir, ec) / "pkg").string() + "/");
+    return cachedirs;
+}
+
+
+// Function to download packages with pacman -Sw into the prefetch cache. pacman runs with a database path of its own
+// (<prefetch dir>/db, an empty local database and the sync databases of the system), so the lock it takes is not the
+// one of the system database and the removals run meanwhile. Dependencies are not resolved (-dd): only the packages
+// asked are downloaded, the transactions download the rest. The other caches are searched, what they hold is not downloaded again.
+std::string prefetch_with_pacman(const std::vector<std::string>& packageNames, int* exit_code) {
+    std::error_code ec;
+    std::filesystem::path directory = std::filesystem::absolute(prefetch_dir, ec);
+    std::filesystem::path dbpath = prefetch_dbpath.empty() ? directory / "db" : std::filesystem::absolute(prefetch_dbpath, ec);
+    std::filesystem::create_directories(dbpath / "local", ec);
+    std::filesystem::create_directories(directory / "pkg", ec);
+    if (!std::filesystem::is_symlink(dbpath / "sync", ec)) {
+        std::filesystem::create_directory_symlink(std::filesystem::absolute(pacman_dbpath, ec) / "sync", dbpath / "sync", ec);
+    }
+
+    std::vector<std::string> cachedirs = prefetch_cachedirs();
+    std::vector<std::string> command = {"sudo", "pacman"};
+    if (!pacman_config.empty()) {
+        command.insert(command.end(), {"--config", pacman_config});
+    }
+    command.insert(command.end(), {"--dbpath", dbpath.string(), "--cachedir", cachedirs.back()});
+    for (size_t i = 0; i + 1 < cachedirs.size(); ++i) {
+        command.insert(command.end(), {"--cachedir", cachedirs[i]});
+    }
+    command.insert(command.end(), {"-Swdd", "--noconfirm"});
+    command.insert(command.end(), packageNames.begin(), packageNames.end());
+
+    // The cache may be shared by the targets of a fleet: one download at a time, the next finds what the previous fetched
+    int lock_fd = open((directory / "lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd != -1) {
+        while (flock(lock_fd, LOCK_EX) == -1 && errno == EINTR && !cancel_requested) {
+        }
+    }
+
+    SpawnOptions options;
+    options.echo = false; // The transactions of the main thread are echoing
+    options.timeout_seconds = command_timeout;
+    SpawnResult result = spawn_exec(command, options);
+    if (lock_fd != -1) {
+        close(lock_fd);
+    }
+    *exit_code = result.exit_code;
+    return std::string(result.output);
+}
+
+
+// Function to queue packages for the background prefetch. Only packages of the sync databases are queued
+// (a target not found fails the whole pacman -Sw), each one once per run. Called from the main thread only.
+void start_prefetch(const std::vector<std::string>& packageNames) {
+    if (!prefetch_enabled || !ensure_sync_databases()) {
+        return;
+    }
+    std::vector<std::string> queued;
+    for (const auto& pkge : packageNames) {
+        if (is_in_sync_repos(pkge) && prefetch_requested.insert(pkge).second) {
+            queued.push_back(pkge);
+        }
+    }
+    if (queued.empty()) {
+        return;
+    }
+    printf("\n[PREFETCH] >> Downloading %zu package(s) in the background\n", queued.size());
+
+    std::lock_guard<std::mutex> lock(prefetch_mutex);
+    prefetch_queue.insert(prefetch_queue.end(), queued.begin(), queued.end());
+    if (!prefetch_active) {
+        prefetch_active = true;
+        if (prefetch_thread.joinable()) {
+            prefetch_thread.join(); // Finished, it only had to return
+        }
+        prefetch_thread = std::thread(prefetch_worker);
+    }
+}
+
+
+// Function to run the queued prefetches, in the prefetch thread. Packages queued while pacman -Sw runs
+// go in the next run. A failed run is only counted, the transactions download its packages.
+void prefetch_worker() {
+    while (true) {
+        std::vector<std::string> batch;
+        {
+            std::lock_guard<std::mutex> lock(prefetch_mutex);
+            if (prefetch_queue.empty()) {
+                prefetch_active = false;
+                return;
+            }
+            batch.swap(prefetch_queue);
+        }
+
+        int exit_code;
+        auto prefetch_start = std::chrono::steady_clock::now();
+        backend->prefetch(batch, &exit_code);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - prefetch_start).count();
+
+        std::lock_guard<std::mutex> lock(prefetch_mutex);
+        ++stats_prefetch_runs;
+        stats_prefetch_seconds += seconds;
+        if (exit_code == 0) {
+            stats_prefetch_packages += batch.size();
+        } else {
+            ++stats_prefetch_failed;
+        }
+    }
+}
+
+
+// Function to prefetch the packages of the full system upgrade predicted from the databases: the packages upgraded
+// and the ones replacing installed packages. Done once, before the first full system upgrade.
+void prefetch_upgrade() {
+    static bool prefetched = false;
+    if (prefetched || !prefetch_enabled || !ensure_sync_databases() || !ensure_local_database()) {
+        return;
+    }
+    prefetched = true;
+
+    UpgradePrediction prediction = predict_upgrade();
+    std::vector<std::string> targets(prediction.upgraded.begin(), prediction.upgraded.end());
+    for (const auto& replacement : prediction.replacements) {
+        targets.push_back(replacement.second);
+    }
+    start_prefetch(targets);
+}
+
+
+// Function to wait for the prefetch before a transaction that downloads, so no package is downloaded twice
+void wait_prefetch() {
+    if (!prefetch_thread.joinable()) {
+        return;
+    }
+    TraceScope trace("prefetch_wait", "wait for the background downloads");
+    auto wait_start = std::chrono::steady_clock::now();
+    prefetch_thread.join();
+    double waited = std::chrono::duration<double>(std::chrono::steady_clock::now() - wait_start).count();
+    trace.end(0, 0);
+
+    std::lock_guard<std::mutex> lock(prefetch_mutex);
+    stats_prefetch_wait_seconds += waited;
+    printf("\n[PREFETCH] >> %d package(s) downloaded in the background so far, %d failed run(s), waited %.1f s\n",
+           stats_prefetch_packages, stats_prefetch_failed, waited);
+}
+
 
-    // Packages not found in repos
-    fprintf(logFile, "[PACKAGES NOT FOUND IN REPOS]\n");
-    if (!log_not_found_in_repos.empty()) {
-        for (const auto& pkg : log_not_found_in_repos) {
-            fprintf(logFile, "  - %s\n", pkg.c_str());
+// Function to create the package backend chosen by the options: libalpm (--alpm), a scripted universe (--fake-universe) or pacman
+bool open_backend(bool use_alpm, const std::string& fake_universe) {
+    if (use_alpm) {
+#ifdef WITH_ALPM
+        auto alpm = std::make_unique<AlpmBackend>();
+        if (!alpm->open()) {
+            return false;
         }
+        backend = std::move(alpm);
+#else
+        std::cerr << "--alpm needs a build with libalpm: g++ -DWITH_ALPM ... -lalpm" << "\n";
+        return false;
+#endif
+    } else if (fake_universe.empty()) {
+        backend = std::make_unique<PacmanBackend>();
     } else {
-        fprintf(logFile, "  (none)\n");
+        auto scripted = std::make_unique<ScriptedBackend>();
+        if (!scripted->load(fake_universe)) {
+            std::cerr << "Failed to load the package universe from: " << fake_universe << "\n";
+            return false;
+        }
+        backend = std::move(scripted);
+    }
+    return true;
+}
+
+
+// Function to fix the system with the backend opened: event log, journal, sync refresh, main loop and reports.
+// The status of the main loop is returned in status, the exit code of the program is returned.
+int run_fix(bool resume, ProceedureStatus* status) {
+    printf("\nRunning pacman to see packages in conflict...:\n\n");
+
+    if (!trace_file.empty() || !metrics_file.empty()) {
+        atexit(write_trace_outputs);
+    }
+
+    // Creating the event log of this run. Its name is unique (date, time and pid), no previous log is looked up.
+    if (!open_event_log()) {
+        *status = ERROR_OCCURRED;
+        return EXIT_FAILURE;
+    }
+    log_event("run_started", "pid", std::to_string(getpid()));
+
+    // Opening the journal. With --resume, the removed packages and the issues found by the unfinished run are restored.
+    if (!journal_open(resume)) {
+        *status = ERROR_OCCURRED;
+        return EXIT_FAILURE;
+    }
+
+    // Ctrl+C interrupts the running command (in its own process group, it does not get it) and stops the run after it
+    struct sigaction cancel_action = {};
+    cancel_action.sa_handler = [](int) { cancel_requested = true; };
+    sigemptyset(&cancel_action.sa_mask);
+    sigaction(SIGINT, &cancel_action, nullptr);
+    sigaction(SIGTERM, &cancel_action, nullptr);
+
+    // Refreshing the sync databases once. Every pacman run below goes without -y.
+    if (!refresh_each_run) {
+        refresh_sync_databases();
     }
-    fprintf(logFile, "\n");
 
-    // Dependencies unsatisfied
-    fprintf(logFile, "[DEPENDENCIES UNSATISFIED AS NOT FOUND IN REPOS]\n");
+    // A resolution recorded for the same system is replayed first, the main loop checks it.
+    // A resumed run already holds the state of its resolution, it is neither replayed nor recorded.
+    std::string fingerprint = recipes_enabled && !resume ? system_fingerprint() : "";
+    replay_recipe(fingerprint);
+
+    // Main loop to inspect and resolve packages and reinstall removed packages
+    *status = run_fix_loop();
+    wait_prefetch();
+    if (*status == NOTHING_TO_DO) {
+        record_recipe(fingerprint);
+        journal_append({"finished"});
+    }
+    log_event("run_finished", "status", *status == NOTHING_TO_DO ? "done" : "error");
+
+    // Human-readable summary, rendered once from the event log
+    std::string summary_name = event_log_name.substr(0, event_log_name.size() - 6) + ".log";
+    FILE *summary = fopen(summary_name.c_str(), "w");
+    if (summary && render_event_log(event_log_name, summary)) {
+        printf("\n[LOG FILE UPDATED] >> %s (events: %s)\n", summary_name.c_str(), event_log_name.c_str());
+    }
+    if (summary) {
+        fclose(summary);
+    }
+
+    print_transaction_report();
+    print_trace_summary();
+    if (*status == ERROR_OCCURRED) {
+        printf("\n[FAILED]. The run stopped on an error, see the output above and the log.\n\n");
+    } else {
+        printf("\n[FINISHED]. All conflicts and required packages processed.\n\n");
+    }
+    // Packages replaced by the upgrade are not reinstalled on purpose. The ones whose reinstall failed, and the ones
+    // removed as their dependencies cannot be satisfied after the upgrade, are gone with nothing in their place.
+    if (log_reinstall_failed.empty() && log_dependency_unsatisfy_removed.empty()) {
+        printf("If any package was removed, it has been reinstalled or replaced.\n");
+    }
+    if (!log_reinstall_failed.empty()) {
+        printf("[NOT REINSTALLED] >> %zu package(s) removed and not reinstalled, reinstall them by hand:", log_reinstall_failed.size());
+        for (const auto& pkge : log_reinstall_failed) {
+            printf(" %s", pkge.c_str());
+        }
+        printf("\n");
+    }
     if (!log_dependency_unsatisfy_removed.empty()) {
-        for (const auto& pkg : log_dependency_unsatisfy_removed) {
-            fprintf(logFile, "  - %s\n", pkg.c_str());
+        printf("[NOT REINSTALLED] >> %zu package(s) removed as their dependencies cannot be satisfied after the upgrade:",
+               log_dependency_unsatisfy_removed.size());
+        for (const auto& pkge : log_dependency_unsatisfy_removed) {
+            printf(" %s", pkge.c_str());
+        }
+        printf("\n");
+    }
+    printf("Execute the program again if there are still conflicts.\n\n");
+    printf("[FILES STILL IN CONFLICT? Run again with --overwrite <glob> for the paths known to be safe, or --overwrite-all]\n");
+    printf("[YOU MIGHT WANT TO EXECUTE pacman -Syu --needed blackarch to install all tools]\n\n");
+
+    return fix_exit_code(*status);
+}
+
+
+// Function to get the exit code of a fix from the status of its main loop: 1 when it failed, 2 when it finished
+// with removed packages lost (reinstall failed, or dependencies unsatisfiable after the upgrade), else 0
+int fix_exit_code(ProceedureStatus status) {
+    if (status == ERROR_OCCURRED) {
+        return EXIT_FAILURE;
+    }
+    return log_reinstall_failed.empty() && log_dependency_unsatisfy_removed.empty() ? 0 : 2;
+}
+
+
+// Function to read the targets of a fleet. Each line is a target, a name followed by its settings:
+//   <name> [root=<dir>] [dbpath=<dir>] [config=<pacman.conf>] [universe=<file>]
+// Paths are made absolute, as each target works in its own directory. Lines starting with # are comments.
+bool read_fleet_targets(const std::string& filename, std::vector<FleetTarget>* targets) {
+    std::ifstream input(filename);
+    if (!input) {
+        std::cerr << "Failed to open the fleet targets: " << filename << "\n";
+        return false;
+    }
+    std::set<std::string> names;
+    std::string line;
+    int line_number = 0;
+    while (std::getline(input, line)) {
+        ++line_number;
+        std::istringstream fields(line);
+        FleetTarget target;
+        if (!(fields >> target.name) || target.name[0] == '#') {
+            continue;
+        }
+        if (target.name.find('/') != std::string::npos || target.name == "." || target.name == ".." || !names.insert(target.name).second) {
+            std::cerr << filename << ":" << line_number << ": invalid or repeated target name: " << target.name << "\n";
+            return false;
+        }
+        std::string field;
+        while (fields >> field) {
+            size_t equal = field.find('=');
+            std::string key = field.substr(0, equal);
+            std::string value = equal == std::string::npos ? "" : field.substr(equal + 1);
+            std::error_code ec;
+            if (!value.empty()) {
+                value = std::filesystem::absolute(value, ec).string();
+            }
+            if (key == "root" && !value.empty()) {
+                target.root = value;
+            } else if (key == "dbpath" && !value.empty()) {
+                target.dbpath = value;
+            } else if (key == "config" && !value.empty()) {
+                target.config = value;
+            } else if (key == "universe" && !value.empty()) {
+                target.universe = value;
+            } else {
+                std::cerr << filename << ":" << line_number << ": unknown target setting: " << field << "\n";
+                return false;
+            }
+        }
+        if (target.dbpath.empty() && !target.root.empty()) {
+            target.dbpath = target.root + "/var/lib/pacman";
+        }
+        targets->push_back(target);
+    }
+    return true;
+}
+
+
+// Function to write the report of a fleet target (report.json in its directory), read back by the fleet
+void write_target_report(const FleetTarget& target, const std::string& status, double elapsed_seconds) {
+    FILE* report = fopen("report.json", "w");
+    if (!report) {
+        return;
+    }
+    fprintf(report, "{\"target\":\"%s\",\"root\":\"%s\",\"status\":\"%s\",\"elapsed_s\":%.3f,\"cycles\":%d,\"pacman_runs\":%d,"
+                    "\"removal_transactions\":%d,\"reinstall_transactions\":%d,\"packages_removed\":%d,\"removed_not_reinstalled\":%zu,"
+                    "\"archives_reinstalled\":%d,\"prefetch_packages\":%d,\"event_log\":\"%s\"}\n",
+            json_escape(target.name).c_str(), json_escape(target.root.empty() ? "/" : target.root).c_str(), status.c_str(),
+            elapsed_seconds, stats_cycles, stats_pacman_runs, stats_removal_transactions, stats_reinstall_transactions,
+            stats_packages_removed, log_removed_not_reinstalled.size(), stats_archives_reinstalled, stats_prefetch_packages,
+            json_escape(event_log_name).c_str());
+    fclose(report);
+}
+
+
+// Function to fix every target of a fleet, at most --fleet-jobs at once. Each target is fixed by a child process
+// in <fleet dir>/<target>, where its output (output.txt), event log, journal, archives and report are written.
+// The downloads go to one cache shared by the fleet. A Ctrl+C stops every running target (each one resumable
+// with --resume) and no other target is started. The reports of the targets are gathered in <fleet dir>/fleet.json.
+int run_fleet(const std::string& filename, bool use_alpm, bool resume) {
+    std::vector<FleetTarget> targets;
+    if (!read_fleet_targets(filename, &targets)) {
+        return EXIT_FAILURE;
+    }
+    if (targets.empty()) {
+        std::cerr << "No target in: " << filename << "\n";
+        return EXIT_FAILURE;
+    }
+
+    std::error_code ec;
+    std::filesystem::path directory = std::filesystem::absolute(fleet_dir, ec);
+    std::filesystem::create_directories(directory, ec);
+    std::string shared_cache = (directory / "cache").string();
+    // Identical targets share their recipes: the first one to converge records the resolution the others replay
+    recipes_file = recipes_file == "fixConflicts.recipes" ? (directory / "recipes").string() : std::filesystem::absolute(recipes_file, ec).string();
+    std::string fleet_config = pacman_config.empty() ? "" : std::filesystem::absolute(pacman_config, ec).string();
+    std::vector<std::string> cachedirs;
+    for (const auto& cachedir : pacman_cachedirs) {
+        cachedirs.push_back(std::filesystem::absolute(cachedir, ec).string());
+    }
+
+    struct sigaction cancel_action = {};
+    cancel_action.sa_handler = [](int) { cancel_requested = true; };
+    sigemptyset(&cancel_action.sa_mask);
+    sigaction(SIGINT, &cancel_action, nullptr);
+    sigaction(SIGTERM, &cancel_action, nullptr);
+
+    printf("\n[FLEET] >> %zu target(s), %d at once, in %s\n", targets.size(), fleet_jobs, directory.c_str());
+
+    std::unordered_map<pid_t, size_t> running; // Child process -> target
+    std::vector<std::string> statuses(targets.size(), "not started");
+    std::vector<std::chrono::steady_clock::time_point> started(targets.size());
+    auto fleet_start = std::chrono::steady_clock::now();
+    size_t next = 0;
+
+    while (next < targets.size() || !running.empty()) {
+        while (!cancel_requested && running.size() < static_cast<size_t>(fleet_jobs) && next < targets.size()) {
+            const FleetTarget& target = targets[next];
+            std::filesystem::path work_dir = directory / target.name;
+            std::filesystem::create_directories(work_dir, ec);
+
+            fflush(stdout);
+            fflush(stderr);
+            pid_t pid = fork();
+            if (pid == -1) {
+                std::cerr << "Failed to start target " << target.name << "\n";
+                statuses[next++] = "failed to start";
+                continue;
+            }
+            if (pid == 0) {
+                // Child: the target is fixed as a run of its own, in its directory
+                if (chdir(work_dir.c_str()) == -1) {
+                    _exit(EXIT_FAILURE);
+                }
+                int output_fd = open("output.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (output_fd != -1) {
+                    dup2(output_fd, STDOUT_FILENO);
+                    dup2(output_fd, STDERR_FILENO);
+                    close(output_fd);
+                }
+                pacman_root = target.root;
+                pacman_dbpath = target.dbpath.empty() ? pacman_dbpath : target.dbpath;
+                pacman_config = target.config.empty() ? fleet_config : target.config;
+                pacman_cachedirs = cachedirs;
+                prefetch_dir = shared_cache;
+                prefetch_dbpath = (work_dir / "prefetch.db").string();
+
+                auto target_start = std::chrono::steady_clock::now();
+                ProceedureStatus status = ERROR_OCCURRED;
+                bool opened = open_backend(use_alpm, target.universe);
+                int exit_code = opened ? run_fix(resume, &status) : EXIT_FAILURE;
+                double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - target_start).count();
+                write_target_report(target, !opened ? "failed" : status != NOTHING_TO_DO ? "error" : exit_code != 0 ? "incomplete" : "done", elapsed);
+                exit(exit_code);
+            }
+            running[pid] = next;
+            started[next] = std::chrono::steady_clock::now();
+            statuses[next] = "running";
+            printf("[FLEET] >> %s started (%s)\n", target.name.c_str(),
+                   !target.universe.empty() ? target.universe.c_str() : target.root.empty() ? "/" : target.root.c_str());
+            fflush(stdout);
+            ++next;
+        }
+        if (running.empty()) {
+            break;
+        }
+
+        int wait_status;
+        pid_t pid = waitpid(-1, &wait_status, 0);
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        auto finished = running.find(pid);
+        if (finished == running.end()) {
+            continue;
+        }
+        size_t index = finished->second;
+        running.erase(finished);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started[index]).count();
+        if (WIFEXITED(wait_status) && WEXITSTATUS(wait_status) == 0) {
+            statuses[index] = "done";
+        } else if (WIFEXITED(wait_status) && WEXITSTATUS(wait_status) == 130) {
+            statuses[index] = "cancelled";
+        } else {
+            statuses[index] = WIFEXITED(wait_status) ? "error" : "crashed";
+        }
+        printf("[FLEET] >> %s %s in %.1f s, %zu running, %zu waiting\n", targets[index].name.c_str(), statuses[index].c_str(),
+               elapsed, running.size(), targets.size() - next);
+        fflush(stdout);
+    }
+    double fleet_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - fleet_start).count();
+
+    // Aggregate report: the report of every target, or its status when it wrote none
+    std::string fleet_report = (directory / "fleet.json").string();
+    FILE* report = fopen(fleet_report.c_str(), "w");
+    int done = 0;
+    printf("\n[FLEET REPORT]\n");
+    printf("  %-20s %-12s %10s %7s %7s %8s %16s\n", "target", "status", "time s", "cycles", "pacman", "removed", "not reinstalled");
+    if (report) {
+        fprintf(report, "{\"elapsed_s\":%.3f,\"jobs\":%d,\"targets\":[\n", fleet_seconds, fleet_jobs);
+    }
+    for (size_t i = 0; i < targets.size(); ++i) {
+        std::ifstream target_input(directory / targets[i].name / "report.json");
+        std::string target_report;
+        std::getline(target_input, target_report);
+        if (target_report.empty() || statuses[i] == "not started") {
+            target_report = "{\"target\":\"" + json_escape(targets[i].name) + "\",\"status\":\"" + statuses[i] + "\"}";
+        } else if (statuses[i] == "error") {
+            statuses[i] = json_string_field(target_report, "status"); // "error" of the main loop, "incomplete" or "failed" to start
+        }
+        done += statuses[i] == "done";
+
+        auto number = [&](const std::string& key) {
+            std::string field = "\"" + key + "\":";
+            size_t pos = target_report.find(field);
+            return pos == std::string::npos ? std::string("-") : target_report.substr(pos + field.size(), target_report.find_first_of(",}", pos) - pos - field.size());
+        };
+        printf("  %-20s %-12s %10s %7s %7s %8s %16s\n", targets[i].name.c_str(), statuses[i].c_str(), number("elapsed_s").c_str(),
+               number("cycles").c_str(), number("pacman_runs").c_str(), number("packages_removed").c_str(), number("removed_not_reinstalled").c_str());
+        if (report) {
+            fprintf(report, "  %s%s\n", target_report.c_str(), i + 1 < targets.size() ? "," : "");
+        }
+    }
+    if (report) {
+        fprintf(report, "],\"done\":%d,\"failed\":%zu}\n", done, targets.size() - done);
+        fclose(report);
+    }
+    printf("\n[FLEET] >> %d of %zu target(s) fixed in %.1f s, report: %s\n", done, targets.size(), fleet_seconds, fleet_report.c_str());
+    if (cancel_requested) {
+        printf("[INTERRUPTED] >> Fleet cancelled. Continue it with --fleet %s --resume\n", filename.c_str());
+    }
+    return done == static_cast<int>(targets.size()) ? 0 : EXIT_FAILURE;
+}
+
+
+// Function to compute the fingerprint of the system before it is changed: a 64-bit FNV-1a hash of the installed
+// packages and of the repository packages with their versions, sorted, then both counts. Empty if a database
+// cannot be read. Two machines installed from the same image, with the same sync databases, have the same one.
+std::string system_fingerprint() {
+    if (!ensure_local_database() || !ensure_sync_databases()) {
+        return "";
+    }
+    std::vector<std::string> entries;
+    entries.reserve(local_pkges_index.size() + sync_pkges_index.size());
+    for (const auto& [name, pkge] : local_pkges_index) {
+        entries.push_back("local " + name + " " + pkge.version);
+    }
+    for (const auto& [name, pkge] : sync_pkges_index) {
+        entries.push_back("sync " + name + " " + pkge.version);
+    }
+    std::sort(entries.begin(), entries.end());
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (const auto& entry : entries) {
+        for (char c : entry) {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+        }
+        hash = (hash ^ '\n') * 1099511628211ULL;
+    }
+    char fingerprint[64];
+    snprintf(fingerprint, sizeof(fingerprint), "%016llx-%zu-%zu", static_cast<unsigned long long>(hash),
+             local_pkges_index.size(), sync_pkges_index.size());
+    return fingerprint;
+}
+
+
+// Function to read the recipes of the cache, in the order they were recorded. Each recipe is its header
+// ("recipe <fingerprint> <time>") followed by its steps, journal-like records separated by tabs:
+//   removed <package>...     a removal transaction, its packages in order
+//   not_reinstalled <package>    removed and not reinstalled (replaced, or its file taken over)
+//   unsatisfied_removed <package>    removed as its dependencies cannot be satisfied after the upgrade
+//   overwrite <glob>    file pacman may overwrite
+//   conflict <package>    package found in conflict (for the report)
+std::vector<std::pair<std::string, std::vector<std::string>>> read_recipes() {
+    std::vector<std::pair<std::string, std::vector<std::string>>> recipes;
+    std::ifstream input(recipes_file);
+    std::string line;
+    if (!std::getline(input, line) || line != "FCRECIPES1") {
+        return recipes;
+    }
+    while (std::getline(input, line)) {
+        if (line.compare(0, 7, "recipe\t") == 0) {
+            recipes.push_back({line, {}});
+        } else if (!line.empty() && !recipes.empty()) {
+            recipes.back().second.push_back(line);
+        }
+    }
+    return recipes;
+}
+
+
+// Function to replay the recipe recorded for a system with the same fingerprint: its removal transactions run in
+// order (archives kept and journaled as any removal), the packages that were not reinstalled are dropped and the
+// files are allowed to be overwritten. The main loop then reinstalls and runs the full system upgrade, the final check
+// of the recipe: if anything is left, it is resolved as usual. A removal failing stops the replay.
+bool replay_recipe(const std::string& fingerprint) {
+    if (!recipes_enabled || fingerprint.empty()) {
+        return false;
+    }
+    std::string header = "recipe\t" + fingerprint + "\t";
+    std::vector<std::string> steps;
+    bool found = false;
+    for (auto& recipe : read_recipes()) {
+        if (recipe.first.compare(0, header.size(), header) == 0) {
+            steps = std::move(recipe.second);
+            found = true;
+        }
+    }
+    if (!found) {
+        return false;
+    }
+
+    int removals = 0;
+    for (const auto& step : steps) {
+        removals += step.compare(0, 8, "removed\t") == 0;
+    }
+    printf("\n[RECIPE] >> Replaying the resolution recorded for this system (%s): %d removal transaction(s)\n",
+           fingerprint.c_str(), removals);
+    log_event("recipe_replayed", "fingerprint", fingerprint);
+
+    for (const auto& step : steps) {
+        std::vector<std::string> fields;
+        std::istringstream fields_in(step);
+        for (std::string field; std::getline(fields_in, field, '\t'); ) {
+            fields.push_back(field);
+        }
+        if (fields.size() < 2) {
+            continue;
+        }
+        if (fields[0] == "removed") {
+            if (remove_packages(std::vector<std::string>(fields.begin() + 1, fields.end())) == "ERROR") {
+                printf("\n[RECIPE] >> A removal of the recipe failed, resolving as usual from here\n");
+                return false;
+            }
+            ++stats_recipe_removals;
+        } else if (fields[0] == "not_reinstalled" || fields[0] == "unsatisfied_removed") {
+            if (removed_pkges.erase(fields[1])) {
+                log_package(fields[0] == "not_reinstalled" ? log_removed_not_reinstalled : log_dependency_unsatisfy_removed,
+                            fields[0] == "not_reinstalled" ? "removed_not_reinstalled" : "dependency_unsatisfy_removed", fields[1]);
+                journal_append({fields[0] + "\t" + fields[1]});
+            }
+        } else if (fields[0] == "overwrite") {
+            if (std::find(overwrite_globs.begin(), overwrite_globs.end(), fields[1]) == overwrite_globs.end()) {
+                overwrite_globs.push_back(fields[1]);
+            }
+        } else if (fields[0] == "conflict") {
+            log_package(log_conflicts_resolved, "conflict_resolved", fields[1]);
+        }
+    }
+    ++stats_recipes_replayed;
+    return true;
+}
+
+
+// Function to record the resolution a run converged on, under the fingerprint the system had before it started.
+// The cache keeps the last 100 recipes; it may be shared by concurrent runs (a fleet), so it is rewritten under a
+// lock and replaced with a rename.
+bool record_recipe(const std::string& fingerprint) {
+    if (!recipes_enabled || fingerprint.empty() || (recipe_removals.empty() && overwrite_globs.empty())) {
+        return false;
+    }
+    const size_t max_recipes = 100;
+
+    std::vector<std::string> steps;
+    for (const auto& removal : recipe_removals) {
+        std::string step = "removed";
+        for (const auto& pkge : removal) {
+            step += "\t" + pkge;
+        }
+        steps.push_back(step);
+    }
+    for (const auto& pkge : log_removed_not_reinstalled) {
+        // A failed reinstall is tried again by the replay, it may work there
+        if (log_reinstall_failed.count(pkge) == 0) {
+            steps.push_back("not_reinstalled\t" + pkge);
+        }
+    }
+    for (const auto& pkge : log_dependency_unsatisfy_removed) {
+        steps.push_back("unsatisfied_removed\t" + pkge);
+    }
+    for (const auto& glob : overwrite_globs) {
+        steps.push_back("overwrite\t" + glob);
+    }
+    for (const auto& pkge : log_conflicts_resolved) {
+        steps.push_back("conflict\t" + pkge);
+    }
+
+    int lock_fd = open((recipes_file + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd != -1) {
+        flock(lock_fd, LOCK_EX);
+    }
+    std::vector<std::pair<std::string, std::vector<std::string>>> recipes;
+    std::string header = "recipe\t" + fingerprint + "\t";
+    for (auto& recipe : read_recipes()) {
+        if (recipe.first.compare(0, header.size(), header) != 0) {
+            recipes.push_back(std::move(recipe));
+        }
+    }
+    recipes.push_back({header + std::to_string(std::time(nullptr)), steps});
+    if (recipes.size() > max_recipes) {
+        recipes.erase(recipes.begin(), recipes.end() - max_recipes);
+    }
+
+    std::string temporary = recipes_file + ".tmp";
+    FILE* output = fopen(temporary.c_str(), "w");
+    bool written = output != nullptr;
+    if (output) {
+        fprintf(output, "FCRECIPES1\n");
+        for (const auto& [recipe_header, recipe_steps] : recipes) {
+            fprintf(output, "%s\n", recipe_header.c_str());
+            for (const auto& step : recipe_steps) {
+                fprintf(output, "%s\n", step.c_str());
+            }
+        }
+        written = fclose(output) == 0 && rename(temporary.c_str(), recipes_file.c_str()) == 0;
+    }
+    if (lock_fd != -1) {
+        close(lock_fd);
+    }
+    if (!written) {
+        std::cerr << "Failed to write the recipes: " << recipes_file << "\n";
+        return false;
+    }
+    printf("\n[RECIPE] >> Resolution recorded for this system (%s): %zu removal transaction(s), %zu step(s), in %s\n",
+           fingerprint.c_str(), recipe_removals.size(), steps.size(), recipes_file.c_str());
+    return true;
+}
+
+
+// Function to order packages to reinstall, dependencies first. The dependencies come from the repositories (or the
+// installed version when the repositories lack the package); a cycle keeps the order given.
+std::vector<std::string> reinstall_order(const std::vector<std::string>& packageNames) {
+    std::unordered_map<std::string, size_t> position;
+    for (size_t i = 0; i < packageNames.size(); ++i) {
+        position.emplace(packageNames[i], i);
+    }
+
+    // Edges between the packages of the set only: the others are already installed or pulled by pacman
+    std::vector<std::vector<size_t>> dependents(packageNames.size());
+    std::vector<int> pending(packageNames.size(), 0);
+    for (size_t i = 0; i < packageNames.size(); ++i) {
+        const PackageDesc* pkge = nullptr;
+        auto sync = sync_pkges_index.find(packageNames[i]);
+        if (sync != sync_pkges_index.end()) {
+            pkge = &sync->second;
+        } else {
+            auto local = local_pkges_index.find(packageNames[i]);
+            if (local != local_pkges_index.end()) {
+                pkge = &local->second;
+            }
+        }
+        if (!pkge) {
+            continue;
+        }
+        std::set<size_t> required;
+        for (const auto& depend : pkge->depends) {
+            std::string name = strip_version_constraint(depend);
+            auto direct = position.find(name);
+            if (direct != position.end()) {
+                required.insert(direct->second);
+                continue;
+            }
+            auto providers = sync_provides_index.find(name);
+            if (providers != sync_provides_index.end()) {
+                for (const auto& provider : providers->second) {
+                    auto found = position.find(provider);
+                    if (found != position.end()) {
+                        required.insert(found->second);
+                    }
+                }
+            }
+        }
+        required.erase(i);
+        for (size_t dependency : required) {
+            dependents[dependency].push_back(i);
+            ++pending[i];
+        }
+    }
+
+    // Kahn's algorithm, taking the ready packages in the order given
+    std::set<size_t> ready;
+    for (size_t i = 0; i < packageNames.size(); ++i) {
+        if (pending[i] == 0) {
+            ready.insert(i);
+        }
+    }
+    std::vector<std::string> order;
+    std::vector<bool> placed(packageNames.size(), false);
+    while (order.size() < packageNames.size()) {
+        if (ready.empty()) {
+            // A dependency cycle: its first package goes next, pacman installs the cycle in one transaction anyway
+            for (size_t i = 0; i < packageNames.size(); ++i) {
+                if (!placed[i]) {
+                    ready.insert(i);
+                    break;
+                }
+            }
         }
+        size_t next = *ready.begin();
+        ready.erase(ready.begin());
+        placed[next] = true;
+        order.push_back(packageNames[next]);
+        for (size_t dependent : dependents[next]) {
+            if (!placed[dependent] && --pending[dependent] == 0) {
+                ready.insert(dependent);
+            }
+        }
+    }
+    return order;
+}
+
+
+// Function to reinstall packages in one transaction, from their archive (pacman -U) or from the repositories
+bool reinstall_batch(const std::vector<std::string>& packageNames, bool from_archives) {
+    int reinstall_exit_code;
+    TraceScope trace("reinstall", (from_archives ? "reinstall archives " : "reinstall ") + std::to_string(packageNames.size()) + " package(s)");
+    auto reinstall_start = std::chrono::steady_clock::now();
+    std::string reinstall_output;
+    if (from_archives) {
+        std::vector<std::string> archives;
+        for (const auto& pkge : packageNames) {
+            archives.push_back(preserved_archives[pkge]);
+        }
+        reinstall_output = backend->install_archives(archives, &reinstall_exit_code);
     } else {
-        fprintf(logFile, "  (none)\n");
+        reinstall_output = backend->install(packageNames, &reinstall_exit_code);
+    }
+    trace.end(reinstall_exit_code, reinstall_output.size());
+    ++system_generation;
+    stats_reinstall_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - reinstall_start).count();
+    ++stats_reinstall_transactions;
+    if (reinstall_exit_code == 0) {
+        std::vector<std::string> reinstalled_records;
+        for (const auto& pkge : packageNames) {
+            reinstalled_records.push_back("reinstalled\t" + pkge);
+        }
+        journal_append(reinstalled_records);
     }
-    fprintf(logFile, "\n");
+    return reinstall_exit_code == 0;
+}
+
+
+// Function to reinstall packages in dependency-ordered batches. pacman aborts the whole transaction when one package
+// fails, so a failed batch is split in two halves (the first one holds the dependencies of the second) and each half
+// is retried, down to the packages failing alone: k bad packages among n cost about 2k*log2(n) transactions, not n.
+// Returns the packages not reinstalled.
+std::vector<std::string> reinstall_packages(const std::vector<std::string>& packageNames, bool from_archives) {
+    const size_t max_per_transaction = 500; // Same bound as the removal transactions
+    std::vector<std::string> order = reinstall_order(packageNames);
+    std::vector<std::string> failed;
 
-    fprintf(logFile, "=== End of Log ===\n");
-    fclose(logFile);
-    printf("\n[LOG FILE UPDATED] >> %s\n", filename.c_str());
-}
\ No newline at end of file
+    std::function<void(size_t, size_t)> reinstall_range = [&](size_t first, size_t last) {
+        std::vector<std::string> batch(order.begin() + first, order.begin() + last);
+        if (reinstall_batch(batch, from_archives)) {
+            return;
+        }
+        if (batch.size() == 1) {
+            printf("\n[REINSTALL FAILED] >> %s\n\n", batch[0].c_str());
+            ++stats_reinstall_failed;
+            failed.push_back(batch[0]);
+            return;
+        }
+        size_t middle = first + (last - first) / 2;
+        printf("\n[REINSTALL BISECT] >> %zu package(s) failed together, retrying them as %zu and %zu\n\n",
+               batch.size(), middle - first, last - middle);
+        ++stats_reinstall_bisections;
+        reinstall_range(first, middle);
+        reinstall_range(middle, last);
+    };
+    for (size_t first = 0; first < order.size(); first += max_per_transaction) {
+        check_cancelled();
+        reinstall_range(first, std::min(order.size(), first + max_per_transaction));
+    }
+    return failed;
+}
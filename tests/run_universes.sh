@@ -0,0 +1,44 @@
+#!/usr/bin/env bash
+# Regression checks on the scripted universes of tests/universes.
+# Each universe holds its expectations as comments, for --predict and --fix:
+#   # expect <mode> exit <code>     exit status of the run (0 when not given)
+#   # expect <mode> <text>          line of the output containing the text
+# Usage: tests/run_universes.sh [path/to/fixConflicts]
+
+binary=$(realpath "${1:-./fixConflicts}")
+universes=$(dirname "$(realpath "$0")")/universes
+if [ ! -x "$binary" ]; then
+    echo "Binary not found: $binary (build it first, or pass its path)" >&2
+    exit 1
+fi
+
+failed=0
+checks=0
+for universe in "$universes"/*.txt; do
+    name=$(basename "$universe" .txt)
+    for mode in --predict --fix; do
+        # Every run in a directory of its own: event log, journal, archives and recipes start empty
+        work=$(mktemp -d)
+        output=$(cd "$work" && "$binary" --fake-universe "$universe" "$mode" 2>&1)
+        status=$?
+        rm -rf "$work"
+
+        expected_status=$(sed -n "s/^# expect $mode exit \([0-9]*\)$/\1/p" "$universe")
+        checks=$((checks + 1))
+        if [ "$status" != "${expected_status:-0}" ]; then
+            echo "FAIL $name $mode: exit $status, expected ${expected_status:-0}"
+            failed=$((failed + 1))
+        fi
+        while IFS= read -r text; do
+            checks=$((checks + 1))
+            if ! grep -qF -- "$text" <<< "$output"; then
+                echo "FAIL $name $mode: missing \"$text\""
+                failed=$((failed + 1))
+            fi
+        done < <(sed -n "s/^# expect $mode //p" "$universe" | grep -v '^exit [0-9]*$')
+    done
+    echo "ran  $name"
+done
+
+echo "$((checks - failed)) of $checks check(s) passed"
+[ "$failed" -eq 0 ]